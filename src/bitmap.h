@@ -62,3 +62,82 @@ static inline void pc_init_bitmap(unsigned long* bitmap, char value, unsigned lo
 
 	memset(bitmap, value, byte_count);
 }
+
+/// return the index of the first bit equal to value at or after start,
+/// or total if there is none; whole words are skipped at a time
+static inline unsigned long long
+pc_find_next_bit(unsigned long *bitmap, unsigned long long total,
+		 unsigned long long start, int value)
+{
+	unsigned long long offset, nr;
+	unsigned long word;
+
+	if (!bitmap || start >= total)
+		return total;
+
+	offset = start / PART_BITS_PER_LONG;
+	word = value ? bitmap[offset] : ~bitmap[offset];
+	word &= ~0UL << (start & (PART_BITS_PER_LONG - 1));
+
+	while (!word) {
+		if (++offset >= BITS_TO_LONGS(total))
+			return total;
+		word = value ? bitmap[offset] : ~bitmap[offset];
+	}
+
+	nr = offset * PART_BITS_PER_LONG + __builtin_ctzl(word);
+	return nr < total ? nr : total;
+}
+
+/// count the set bits in [start, end)
+static inline unsigned long long
+pc_count_bits(unsigned long *bitmap, unsigned long long start,
+	      unsigned long long end)
+{
+	unsigned long long first, last, offset, count = 0;
+	unsigned long word;
+
+	if (!bitmap || start >= end)
+		return 0;
+
+	first = start / PART_BITS_PER_LONG;
+	last  = (end - 1) / PART_BITS_PER_LONG;
+	for (offset = first; offset <= last; offset++) {
+		word = bitmap[offset];
+		if (offset == first)
+			word &= ~0UL << (start & (PART_BITS_PER_LONG - 1));
+		if (offset == last && (end & (PART_BITS_PER_LONG - 1)))
+			word &= ~(~0UL << (end & (PART_BITS_PER_LONG - 1)));
+		count += __builtin_popcountl(word);
+	}
+	return count;
+}
+
+/// return the index of the set bit with the given rank (0 based),
+/// or total if the bitmap has fewer set bits
+static inline unsigned long long
+pc_select_bit(unsigned long *bitmap, unsigned long long total,
+	      unsigned long long rank)
+{
+	unsigned long long offset, words = BITS_TO_LONGS(total);
+	unsigned long word;
+	int count;
+
+	if (!bitmap)
+		return total;
+
+	for (offset = 0; offset < words; offset++) {
+		word = bitmap[offset];
+		count = __builtin_popcountl(word);
+		if (rank < (unsigned long long)count)
+			break;
+		rank -= count;
+	}
+	if (offset >= words)
+		return total;
+
+	while (rank--)
+		word &= word - 1;
+	offset = offset * PART_BITS_PER_LONG + __builtin_ctzl(word);
+	return offset < total ? offset : total;
+}
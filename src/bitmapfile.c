@@ -0,0 +1,178 @@
+/**
+ * bitmapfile.c - Part of Partclone project.
+ *
+ * save the bitmap of a file system to a file and load it back
+ *
+ * Reading the bitmap means walking the file system metadata. A bitmap file
+ * keeps the result with the file system information, keyed on an identity
+ * of the file system, so the next runs on the same unchanged device can
+ * start copying at once. The identity comes from the module, from the
+ * generation or write counters the file system keeps itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "bitmapfile.h"
+
+/**
+ * default: no identity. The content of the device alone does not tell if the
+ * file system was written since, counters and free space may be updated lazily
+ * or elsewhere, so the bitmap files are refused.
+ */
+int __attribute__((weak)) get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity) {
+
+	return 0;
+}
+
+/// load a bitmap file, returns 0 when it is the one of this file system
+static int load_bitmap_file(const char* path, const bitmap_file_head* expect, file_system_info* fs_info, unsigned long* bitmap, cmd_opt* opt) {
+
+	bitmap_file_head head;
+	unsigned long long bitmap_size = BITS_TO_BYTES(fs_info->totalblock);
+	uint32_t crc, file_crc;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd == -1) {
+		log_mesg(0, 0, 1, opt->debug, "Can't open bitmap file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (read_all(&fd, (char*)&head, sizeof(head), opt) != sizeof(head)
+	    || memcmp(head.magic, BITMAP_FILE_MAGIC, BITMAP_FILE_MAGIC_SIZE)) {
+		log_mesg(0, 0, 1, opt->debug, "%s is not a bitmap file\n", path);
+		goto out;
+	}
+
+	init_crc32(&crc);
+	crc = crc32(crc, &head, sizeof(head) - CRC32_SIZE);
+	if (crc != head.crc || head.endianess != ENDIAN_MAGIC) {
+		log_mesg(0, 0, 1, opt->debug, "The head of bitmap file %s is damaged or from another machine\n", path);
+		goto out;
+	}
+
+	if (memcmp(head.identity, expect->identity, FS_IDENTITY_SIZE)
+	    || strncmp(head.fs_info.fs, expect->fs_info.fs, FS_MAGIC_SIZE)
+	    || head.fs_info.device_size != expect->fs_info.device_size
+	    || head.fs_info.totalblock != expect->fs_info.totalblock
+	    || head.fs_info.block_size != expect->fs_info.block_size) {
+		log_mesg(0, 0, 1, opt->debug, "Bitmap file %s is not from this file system, or it was written since\n", path);
+		goto out;
+	}
+
+	if (read_all(&fd, (char*)bitmap, bitmap_size, opt) != (int)bitmap_size
+	    || read_all(&fd, (char*)&file_crc, CRC32_SIZE, opt) != CRC32_SIZE) {
+		log_mesg(0, 0, 1, opt->debug, "Bitmap file %s is truncated\n", path);
+		goto out;
+	}
+
+	init_crc32(&crc);
+	crc = crc32(crc, bitmap, bitmap_size);
+	if (crc != file_crc) {
+		log_mesg(0, 0, 1, opt->debug, "Bitmap CRC error in %s\n", path);
+		goto out;
+	}
+
+	fs_info->superBlockUsedBlocks = head.fs_info.superBlockUsedBlocks;
+	fs_info->usedblocks = head.fs_info.usedblocks;
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+/// write the bitmap file through a temporary file, so a failed run leaves no partial file
+static void save_bitmap_file(const char* path, bitmap_file_head* head, unsigned long* bitmap, cmd_opt* opt) {
+
+	unsigned long long bitmap_size = BITS_TO_BYTES(head->fs_info.totalblock);
+	char* tmp;
+	uint32_t crc;
+	int fd;
+
+	tmp = malloc(strlen(path) + 5);
+	if (tmp == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	sprintf(tmp, "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1)
+		log_mesg(0, 1, 1, opt->debug, "Can't create bitmap file %s: %s\n", tmp, strerror(errno));
+
+	init_crc32(&head->crc);
+	head->crc = crc32(head->crc, head, sizeof(bitmap_file_head) - CRC32_SIZE);
+	init_crc32(&crc);
+	crc = crc32(crc, bitmap, bitmap_size);
+
+	if (write_all(&fd, (char*)head, sizeof(bitmap_file_head), opt) == -1
+	    || write_all(&fd, (char*)bitmap, bitmap_size, opt) == -1
+	    || write_all(&fd, (char*)&crc, CRC32_SIZE, opt) == -1
+	    || fsync(fd) == -1 || close(fd) == -1
+	    || rename(tmp, path) == -1) {
+		unlink(tmp);
+		log_mesg(0, 1, 1, opt->debug, "Can't write bitmap file %s: %s\n", path, strerror(errno));
+	}
+
+	log_mesg(0, 0, 1, opt->debug, "Bitmap saved to %s\n", path);
+	free(tmp);
+}
+
+void read_bitmap_file(char* device, file_system_info* fs_info, unsigned long* bitmap, int pui, cmd_opt* opt) {
+
+	bitmap_file_head head;
+
+	if (!opt->load_bitmap && !opt->save_bitmap) {
+		read_bitmap(device, *fs_info, bitmap, pui);
+		return;
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, BITMAP_FILE_MAGIC, BITMAP_FILE_MAGIC_SIZE);
+	head.endianess = ENDIAN_MAGIC;
+	if (!get_fs_identity(device, fs_info, head.identity)) {
+		log_mesg(0, 1, 1, opt->debug, "--save-bitmap and --load-bitmap need a file system that records its writes, "
+			"like ext2/3/4, XFS, NTFS or btrfs, %s can't tell when it was written\n", fs_info->fs);
+		/// forced, the bitmap is read without the files
+		read_bitmap(device, *fs_info, bitmap, pui);
+		return;
+	}
+
+	if (opt->load_bitmap) {
+		memcpy(&head.fs_info, fs_info, sizeof(file_system_info));
+		if (load_bitmap_file(opt->load_bitmap, &head, fs_info, bitmap, opt) == 0) {
+			log_mesg(0, 0, 1, opt->debug, "Bitmap loaded from %s\n", opt->load_bitmap);
+			if (opt->save_bitmap && strcmp(opt->save_bitmap, opt->load_bitmap)) {
+				memcpy(&head.fs_info, fs_info, sizeof(file_system_info));
+				save_bitmap_file(opt->save_bitmap, &head, bitmap, opt);
+			}
+			return;
+		}
+		log_mesg(0, 0, 1, opt->debug, "Reading the bitmap from the file system instead\n");
+	}
+
+	read_bitmap(device, *fs_info, bitmap, pui);
+
+	if (opt->save_bitmap) {
+		memcpy(&head.fs_info, fs_info, sizeof(file_system_info));
+		update_used_blocks_count(&head.fs_info, bitmap);
+		save_bitmap_file(opt->save_bitmap, &head, bitmap, opt);
+	}
+}
+
@@ -0,0 +1,22 @@
+/**
+ * bitmapfile.h - Part of Partclone project.
+ *
+ * save the bitmap of a file system to a file and load it back
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BITMAPFILE_H_
+#define BITMAPFILE_H_
+
+/**
+ * read_bitmap(), or load the bitmap from opt->load_bitmap when that file is
+ * from this file system and unchanged. The bitmap is saved to
+ * opt->save_bitmap when it is given.
+ */
+void read_bitmap_file(char* device, file_system_info* fs_info, unsigned long* bitmap, int pui, cmd_opt* opt);
+
+#endif /* BITMAPFILE_H_ */
@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <uuid/uuid.h>
+#include <openssl/sha.h>
 
 #include "btrfs/kernel-shared/ctree.h"
 #include "btrfs/kernel-shared/volumes.h"
@@ -300,6 +301,10 @@ static void fs_open(char* device){
     //struct btrfs_fs_info *info;
     u64 bytenr = 0;
 
+    /// already opened by this session
+    if (root)
+	return;
+
     log_mesg(0, 0, 0, fs_opt.debug, "\n%s: btrfs library version = %s\n", __FILE__, BTRFS_BUILD_VERSION);
 
     cache_tree_init(&root_cache);
@@ -333,6 +338,16 @@ static void fs_open(char* device){
 /// close device
 static void fs_close(){
     close_ctree(root);
+    root = NULL;
+    info = NULL;
+}
+
+/// end the session opened by read_super_blocks or read_bitmap
+void fs_session_close(void){
+    if (root) {
+	fs_close();
+	log_mesg(0, 0, 0, fs_opt.debug, "%s: fs_close\n", __FILE__);
+    }
 }
 
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
@@ -428,6 +443,22 @@ no_node:
     btrfs_release_path(&path);
 }
 
+/// the fsid and the generation, moved by every transaction commit
+int get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity)
+{
+    struct {
+	u8  fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+    } __attribute__((packed)) id;
+
+    fs_open(device);
+    memset(&id, 0, sizeof(id));
+    memcpy(id.fsid, info->super_copy->fsid, sizeof(id.fsid));
+    id.generation = btrfs_super_generation(info->super_copy);
+    SHA256((unsigned char*)&id, sizeof(id), identity);
+    return 1;
+}
+
 void read_super_blocks(char* device, file_system_info* fs_info)
 {    
     fs_open(device);
@@ -444,8 +475,5 @@ void read_super_blocks(char* device, file_system_info* fs_info)
     log_mesg(0, 0, 0, fs_opt.debug, "superBlockUsedBlocks = %lli\n", fs_info->superBlockUsedBlocks);
     log_mesg(0, 0, 0, fs_opt.debug, "device_size = %llu\n", fs_info->device_size);
     log_mesg(0, 0, 0, fs_opt.debug, "totalblock = %lli\n", fs_info->totalblock);
-
-    fs_close();
-    log_mesg(0, 0, 0, fs_opt.debug, "%s: fs_close\n", __FILE__);
 }
 
@@ -0,0 +1,155 @@
+/**
+ * bufpool.c - Part of Partclone project.
+ *
+ * aligned I/O buffers, backed by huge pages when possible and recycled
+ *
+ * Buffers of a huge page or more are mapped with MAP_HUGETLB when huge
+ * pages are reserved, else mapped and marked for transparent huge pages,
+ * which cuts the TLB misses of the copy loops. Smaller buffers come from
+ * posix_memalign. A freed buffer stays in the pool and is handed out again
+ * to the next stage asking for the same size or less.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "partclone.h"
+#include "bufpool.h"
+
+enum { POOL_MALLOC, POOL_MMAP };
+
+typedef struct {
+	void *ptr;
+	size_t size;
+	int kind;
+	int in_use;
+} pool_entry;
+
+static pool_entry *pool;
+static unsigned int pool_count, pool_capacity;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *pool_map(size_t size, int *kind) {
+	void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED)
+		log_mesg(2, 0, 0, 0, "%s: %zu bytes on huge pages\n", __func__, size);
+#endif
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	*kind = POOL_MMAP;
+	return ptr;
+}
+
+static void pool_release(pool_entry *e) {
+	if (e->kind == POOL_MMAP)
+		munmap(e->ptr, e->size);
+	else
+		free(e->ptr);
+}
+
+void *io_buffer_alloc(size_t size) {
+	pool_entry *best = NULL;
+	void *ptr = NULL;
+	int kind = POOL_MALLOC;
+	unsigned int i;
+
+	if (size == 0)
+		size = 1;
+
+	pthread_mutex_lock(&pool_lock);
+
+	/// the smallest free buffer large enough
+	for (i = 0; i < pool_count; i++)
+		if (!pool[i].in_use && pool[i].size >= size && (best == NULL || pool[i].size < best->size))
+			best = &pool[i];
+	if (best) {
+		best->in_use = 1;
+		pthread_mutex_unlock(&pool_lock);
+		return best->ptr;
+	}
+
+	if (pool_count == pool_capacity) {
+		unsigned int capacity = pool_capacity ? pool_capacity * 2 : 16;
+		pool_entry *entries = realloc(pool, capacity * sizeof(pool_entry));
+
+		if (entries == NULL) {
+			pthread_mutex_unlock(&pool_lock);
+			return NULL;
+		}
+		pool = entries;
+		pool_capacity = capacity;
+	}
+
+	if (size >= IO_HUGE_PAGE) {
+		size = (size + IO_HUGE_PAGE - 1) & ~(IO_HUGE_PAGE - 1);
+		ptr = pool_map(size, &kind);
+	} else {
+		size = (size + IO_BUFFER_ALIGN - 1) & ~((size_t)IO_BUFFER_ALIGN - 1);
+		if (posix_memalign(&ptr, IO_BUFFER_ALIGN, size))
+			ptr = NULL;
+		else
+			memset(ptr, 0, size);
+	}
+
+	if (ptr) {
+		pool[pool_count].ptr = ptr;
+		pool[pool_count].size = size;
+		pool[pool_count].kind = kind;
+		pool[pool_count].in_use = 1;
+		pool_count++;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+	return ptr;
+}
+
+void io_buffer_free(void *buffer) {
+	unsigned int i;
+
+	if (buffer == NULL)
+		return;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < pool_count; i++)
+		if (pool[i].ptr == buffer) {
+			pool[i].in_use = 0;
+			break;
+		}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (i == pool_count)
+		log_mesg(0, 1, 1, 0, "%s: %p is not a pool buffer\n", __func__, buffer);
+}
+
+void io_buffer_pool_destroy(void) {
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < pool_count; i++)
+		pool_release(&pool[i]);
+	free(pool);
+	pool = NULL;
+	pool_count = pool_capacity = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
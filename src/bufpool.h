@@ -0,0 +1,28 @@
+/**
+ * bufpool.h - Part of Partclone project.
+ *
+ * aligned I/O buffers, backed by huge pages when possible and recycled
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BUFPOOL_H_
+#define BUFPOOL_H_
+
+#include <stddef.h>
+
+#define IO_BUFFER_ALIGN 4096               /// page and sector aligned, fits O_DIRECT
+#define IO_HUGE_PAGE    (2UL * 1024 * 1024)
+
+// an aligned buffer of at least size bytes, NULL when out of memory.
+// a new buffer is zeroed, a recycled one keeps its data
+void *io_buffer_alloc(size_t size);
+// give the buffer back to the pool for the next io_buffer_alloc()
+void io_buffer_free(void *buffer);
+// release the memory of the pool, no buffer may be in use
+void io_buffer_pool_destroy(void);
+
+#endif /* BUFPOOL_H_ */
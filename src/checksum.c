@@ -1,11 +1,37 @@
 #include "checksum.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
 #include "partclone.h" // for log_mesg() & cmd_opt
 
 #define CRC32_SEED 0xFFFFFFFF
 
 static uint32_t crc_tab32[256] = { 0 };
-static int cs_mode = CSM_NONE;
+static pthread_once_t crc_tab32_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The checksum in progress belongs to the thread computing it: the mode,
+ * the cipher context and the chunk sequence are thread local. The key and
+ * the nonce are set once by init_cipher() before the threads start.
+ */
+static __thread int cs_mode = CSM_NONE;
+
+/**
+ * CSM_AES256_GCM state. Every checksum chunk is encrypted on its own, with
+ * the image nonce xor'ed with the chunk's sequence number as IV, so that a
+ * chunk can be decrypted without the ones before it.
+ */
+static __thread EVP_CIPHER_CTX *cipher_ctx = NULL;
+static __thread unsigned long long cipher_sequence = 0;
+static pthread_key_t cipher_ctx_key;
+static pthread_once_t cipher_ctx_once = PTHREAD_ONCE_INIT;
+static unsigned char cipher_key[CIPHER_KEY_SIZE];
+static unsigned char cipher_nonce[CIPHER_NONCE_SIZE];
+static int cipher_encrypt = 1;
+static int cipher_loaded = 0;
 
 unsigned get_checksum_size(int checksum_mode, int debug) {
 
@@ -18,6 +44,9 @@ unsigned get_checksum_size(int checksum_mode, int debug) {
 	case CSM_CRC32_0001:
 		return 4;
 
+	case CSM_AES256_GCM:
+		return CIPHER_TAG_SIZE;
+
 	default:
 		log_mesg(0, 1, 1, debug, "Unknown checksum mode [%d]\n", checksum_mode);
 		return UINT_LEAST32_MAX;
@@ -38,35 +67,52 @@ const char *get_checksum_str(int checksum_mode) {
 	case CSM_CRC32_0001:
 		return "CRC32_0001";
 
+	case CSM_AES256_GCM:
+		return "AES256-GCM";
+
 	default:
 		return "UNKNOWN";
 	}
 }
 
+/// fill the crc32 lookup table, once for all threads
+static void init_crc_tab32(void) {
+
+	uint32_t init_crc, init_p;
+	uint32_t i, j;
+	init_p = 0xEDB88320L;
+
+	for (i = 0; i < 256; i++) {
+		init_crc = i;
+		for (j = 0; j < 8; j++) {
+			if (init_crc & 0x00000001L)
+				init_crc = ( init_crc >> 1 ) ^ init_p;
+			else
+				init_crc = init_crc >> 1;
+		}
+
+		crc_tab32[i] = init_crc;
+	}
+}
+
+/// free the cipher context of a thread when it exits, nbd and fuse start many
+static void free_cipher_ctx(void* ctx) {
+
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+static void init_cipher_ctx_key(void) {
+
+	pthread_key_create(&cipher_ctx_key, free_cipher_ctx);
+}
+
 /**
  * Initialise crc32 lookup table if it is not already done and initialise seed
  * the the default implementation seed value
  */
 void init_crc32(uint32_t* seed) {
 
-	if (crc_tab32[0] == 0) {
-		/// initial crc table
-		uint32_t init_crc, init_p;
-		uint32_t i, j;
-		init_p = 0xEDB88320L;
-
-		for (i = 0; i < 256; i++) {
-			init_crc = i;
-			for (j = 0; j < 8; j++) {
-				if (init_crc & 0x00000001L)
-					init_crc = ( init_crc >> 1 ) ^ init_p;
-				else
-					init_crc = init_crc >> 1;
-			}
-
-			crc_tab32[i] = init_crc;
-		}
-	}
+	pthread_once(&crc_tab32_once, init_crc_tab32);
 
 	*seed = CRC32_SEED;
 }
@@ -90,6 +136,31 @@ void init_checksum(int checksum_mode, unsigned char* seed, int debug) {
 		init_crc32((uint32_t*)seed);
 		break;
 
+	case CSM_AES256_GCM:
+	{
+		unsigned char iv[CIPHER_NONCE_SIZE];
+		int i;
+
+		if (!cipher_loaded)
+			log_mesg(0, 1, 1, debug, "No encryption key loaded\n");
+		if (cipher_ctx == NULL) {
+			pthread_once(&cipher_ctx_once, init_cipher_ctx_key);
+			cipher_ctx = EVP_CIPHER_CTX_new();
+			if (cipher_ctx == NULL || pthread_setspecific(cipher_ctx_key, cipher_ctx) != 0)
+				log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+
+		memcpy(iv, cipher_nonce, CIPHER_NONCE_SIZE);
+		for (i = 0; i < 8; i++)
+			iv[CIPHER_NONCE_SIZE - 1 - i] ^= (cipher_sequence >> (8 * i)) & 0xff;
+		cipher_sequence++;
+
+		if (EVP_CipherInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, cipher_key, iv, cipher_encrypt) != 1)
+			log_mesg(0, 1, 1, debug, "Unable to initialise the cipher\n");
+		memset(seed, 0, CIPHER_TAG_SIZE);
+		break;
+	}
+
 	case CSM_NONE:
 		// Nothing to do
 		// Leave seed alone as it may be NULL or point to a zero-sized array
@@ -170,6 +241,16 @@ void update_checksum(unsigned char* checksum, char* buf, int size) {
 		*crc = crc32_0001(*crc, (unsigned char*)buf, size);
 		break;
 
+	case CSM_AES256_GCM:
+	{
+		// encrypt or decrypt buf in place
+		int outl;
+
+		if (EVP_CipherUpdate(cipher_ctx, (unsigned char*)buf, &outl, (unsigned char*)buf, size) != 1)
+			log_mesg(0, 1, 1, 0, "Cipher update failed\n");
+		break;
+	}
+
 	case CSM_NONE:
 		// Nothing to do
 		// Leave checksum alone as it may be NULL or point to a zero-sized array.
@@ -177,3 +258,88 @@ void update_checksum(unsigned char* checksum, char* buf, int size) {
 	}
 
 }
+
+/**
+ * Complete the checksum of a chunk before it is written or compared.
+ *
+ * Only authenticated encryption needs this: when encrypting, the tag is stored
+ * in checksum. When decrypting, the tag read from the image (stored) is
+ * verified and copied to checksum, or its complement is, so that the usual
+ * memcmp() against the stored value reports the error.
+ */
+void finish_checksum(unsigned char* checksum, const unsigned char* stored) {
+
+	unsigned char final[EVP_MAX_BLOCK_LENGTH];
+	int outl, i;
+
+	if (cs_mode != CSM_AES256_GCM)
+		return;
+
+	if (cipher_encrypt) {
+		if (EVP_CipherFinal_ex(cipher_ctx, final, &outl) != 1 ||
+		    EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_GET_TAG, CIPHER_TAG_SIZE, checksum) != 1)
+			log_mesg(0, 1, 1, 0, "Cipher finalisation failed\n");
+		return;
+	}
+
+	if (EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_TAG, CIPHER_TAG_SIZE, (void*)stored) == 1 &&
+	    EVP_CipherFinal_ex(cipher_ctx, final, &outl) == 1) {
+		memcpy(checksum, stored, CIPHER_TAG_SIZE);
+	} else {
+		for (i = 0; i < CIPHER_TAG_SIZE; i++)
+			checksum[i] = ~stored[i];
+	}
+}
+
+/**
+ * Load the key and the per-image nonce used by CSM_AES256_GCM.
+ * encrypt is 1 to create an image, 0 to read one.
+ */
+void init_cipher(const unsigned char* key, const unsigned char* nonce, int encrypt) {
+
+	memcpy(cipher_key, key, CIPHER_KEY_SIZE);
+	memcpy(cipher_nonce, nonce, CIPHER_NONCE_SIZE);
+	cipher_encrypt = encrypt;
+	cipher_sequence = 0;
+	cipher_loaded = 1;
+}
+
+/**
+ * Set the sequence number of the next checksum chunk of the calling thread,
+ * for callers that start in the middle of an image.
+ */
+void set_checksum_sequence(unsigned long long sequence) {
+
+	cipher_sequence = sequence;
+}
+
+/**
+ * Derive an AES-256 key from the content of key_file with PBKDF2-HMAC-SHA256.
+ * The file may hold a raw key or a passphrase of up to CIPHER_KEY_FILE_MAX
+ * bytes, all of its bytes are used.
+ *
+ * return 0 on success, -1 if the file can not be read or is too large
+ */
+int derive_cipher_key(const char* key_file, const unsigned char* salt, int salt_size,
+	unsigned int iterations, unsigned char* key) {
+
+	unsigned char secret[CIPHER_KEY_FILE_MAX];
+	size_t len;
+	FILE* f;
+	int ret;
+
+	f = fopen(key_file, "rb");
+	if (f == NULL)
+		return -1;
+	len = fread(secret, 1, sizeof(secret), f);
+	/// a longer file would give the same key as any other sharing its start
+	ret = ferror(f) || len == 0 || (len == sizeof(secret) && fgetc(f) != EOF) ? -1 : 0;
+	fclose(f);
+
+	if (ret == 0 && PKCS5_PBKDF2_HMAC((const char*)secret, len, salt, salt_size,
+		iterations, EVP_sha256(), CIPHER_KEY_SIZE, key) != 1)
+		ret = -1;
+
+	memset(secret, 0, sizeof(secret));
+	return ret;
+}
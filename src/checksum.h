@@ -7,6 +7,7 @@ typedef enum
 {
 	CSM_NONE  = 0x00,
 	CSM_CRC32 = 0x20,
+	CSM_AES256_GCM = 0x40, // encrypt the data, the "checksum" is the GCM tag
 	CSM_CRC32_0001 = 0xFF, // use crc32_0001() and watch for x64 bug
 } checksum_mode_enum;
 
@@ -17,5 +18,16 @@ extern unsigned get_checksum_size(int checksum_mode, int debug);
 extern const char *get_checksum_str(int checksum_mode);
 extern void init_checksum(int checksum_mode, unsigned char* seed, int debug);
 extern void update_checksum(unsigned char* checksum, char* buf, int size);
+extern void finish_checksum(unsigned char* checksum, const unsigned char* stored);
+
+#define CIPHER_KEY_SIZE   32
+#define CIPHER_NONCE_SIZE 12
+#define CIPHER_TAG_SIZE   16
+#define CIPHER_KEY_FILE_MAX 4096
+
+extern void init_cipher(const unsigned char* key, const unsigned char* nonce, int encrypt);
+extern void set_checksum_sequence(unsigned long long sequence);
+extern int derive_cipher_key(const char* key_file, const unsigned char* salt, int salt_size,
+	unsigned int iterations, unsigned char* key);
 
 #endif /* CHECKSUM_H_ */
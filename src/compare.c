@@ -0,0 +1,292 @@
+/**
+ * compare.c - Part of Partclone project.
+ *
+ * compare a device with an image of it
+ *
+ * The bitmaps are compared first. Then the blocks stored in the image are
+ * read in image order while a second thread reads the same blocks from
+ * the device into the other half of a double buffer, so both streams run
+ * at the same time. The image checksums are verified on the way and the
+ * blocks are compared byte for byte.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "compare.h"
+#include "bufpool.h"
+#include "progress.h"
+#include "iolimit.h"
+
+#define COMPARE_MAX_REPORT 32   /// ranges printed, the others only go to the log
+
+extern unsigned long long copied;
+extern unsigned long long block_id;
+
+/// device reader, fills the half of the buffer main is not comparing
+typedef struct {
+	int fd;
+	unsigned long *bitmap;        /// image bitmap, the blocks to read
+	unsigned long long total;
+	unsigned long long blocks_used;
+	unsigned int block_size;
+	unsigned int capacity;        /// blocks per half
+	char *buffer[2];
+	int full[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	cmd_opt *opt;
+} source_reader;
+
+/// merge consecutive blocks into ranges and print them
+typedef struct {
+	const char *what;
+	unsigned long long first, end;
+	unsigned long long ranges, blocks;
+	unsigned int block_size;
+	int debug;
+} range_report;
+
+static void report_flush(range_report *r) {
+	if (r->end == r->first)
+		return;
+
+	r->ranges++;
+	r->blocks += r->end - r->first;
+	log_mesg(r->ranges <= COMPARE_MAX_REPORT ? 0 : 1, 0, r->ranges <= COMPARE_MAX_REPORT, r->debug,
+		"%s: blocks %llu-%llu (offset %llu, %llu bytes)\n", r->what, r->first, r->end - 1,
+		r->first * r->block_size, (r->end - r->first) * r->block_size);
+	r->first = r->end = 0;
+}
+
+static void report_add(range_report *r, unsigned long long block, unsigned long long count) {
+	if (r->end != r->first && r->end != block)
+		report_flush(r);
+	if (r->end == r->first)
+		r->first = r->end = block;
+	r->end += count;
+}
+
+static void report_done(range_report *r) {
+	report_flush(r);
+	if (r->ranges > COMPARE_MAX_REPORT)
+		log_mesg(0, 0, 1, r->debug, "%s: %llu more ranges in the log\n", r->what, r->ranges - COMPARE_MAX_REPORT);
+}
+
+static void *source_reader_thread(void *arg) {
+	source_reader *sr = (source_reader *)arg;
+	unsigned long long rank = 0, next = 0;
+	int half = 0;
+
+	while (rank < sr->blocks_used) {
+		unsigned int count = sr->blocks_used - rank < sr->capacity ? sr->blocks_used - rank : sr->capacity;
+		unsigned int done = 0;
+
+		pthread_mutex_lock(&sr->lock);
+		while (sr->full[half])
+			pthread_cond_wait(&sr->cond, &sr->lock);
+		pthread_mutex_unlock(&sr->lock);
+
+		/// read the runs of the next count image blocks
+		while (done < count) {
+			unsigned long long first = pc_find_next_bit(sr->bitmap, sr->total, next, 1);
+			unsigned long long end = pc_find_next_bit(sr->bitmap, sr->total, first, 0);
+			unsigned long long size;
+			ssize_t r_size;
+
+			if (end - first > count - done)
+				end = first + count - done;
+			size = (end - first) * sr->block_size;
+
+			io_limit(0, size);
+			r_size = pread(sr->fd, sr->buffer[half] + (unsigned long long)done * sr->block_size, size,
+				first * sr->block_size);
+			if (r_size != (ssize_t)size)
+				log_mesg(0, 1, 1, sr->opt->debug, "source read ERROR at block %llu: %s\n", first,
+					r_size < 0 ? strerror(errno) : "short read");
+
+			done += end - first;
+			next = end;
+		}
+		rank += count;
+
+		pthread_mutex_lock(&sr->lock);
+		sr->full[half] = 1;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
+		half ^= 1;
+	}
+
+	pthread_exit(NULL);
+}
+
+unsigned long long compare_image(int dfr, int dfi, file_system_info fs_info, image_options img_opt,
+	unsigned long *bitmap, unsigned long *img_bitmap, cmd_opt *opt) {
+
+	const unsigned long long blocks_total = fs_info.totalblock;
+	const unsigned int block_size = fs_info.block_size;
+	const unsigned int buffer_capacity = opt->buffer_size > block_size ? opt->buffer_size / block_size : 1;
+	const unsigned int blocks_per_cs = img_opt.blocks_per_checksum;
+	const unsigned int cs_size = img_opt.checksum_size;
+	const unsigned int cs_slot = get_checksum_slot(block_size, &img_opt);
+	const int cs_check = img_opt.checksum_mode != CSM_NONE && !opt->ignore_crc;
+	/// an encrypted image is decrypted even when its tags are not checked
+	const int cs_update = cs_check || img_opt.checksum_mode == CSM_AES256_GCM;
+	const int debug = opt->debug;
+	unsigned long long blocks_used = pc_count_bits(img_bitmap, 0, blocks_total);
+	unsigned long long b;
+	unsigned char checksum[cs_size ? cs_size : 1];
+	unsigned int blocks_in_cs = 0, read_size;
+	char *read_buffer, *image_buffer;
+	range_report only_dev = { "used on the device only", 0, 0, 0, 0, block_size, debug };
+	range_report only_img = { "used in the image only", 0, 0, 0, 0, block_size, debug };
+	range_report differ = { "data differ", 0, 0, 0, 0, block_size, debug };
+	source_reader sr;
+	pthread_t reader;
+	int half = 0;
+
+	/// bitmaps, a word at a time
+	log_mesg(0, 0, 1, debug, "Comparing bitmaps...\n");
+	for (b = 0; b < blocks_total; ) {
+		unsigned long long i = b / PART_BITS_PER_LONG;
+		unsigned long long end = (i + 1) * PART_BITS_PER_LONG < blocks_total ? (i + 1) * PART_BITS_PER_LONG : blocks_total;
+
+		if (bitmap[i] == img_bitmap[i]) {
+			b = end;
+			continue;
+		}
+		for (; b < end; b++) {
+			int dev = pc_test_bit(b, bitmap, blocks_total);
+			int img = pc_test_bit(b, img_bitmap, blocks_total);
+
+			if (dev && !img)
+				report_add(&only_dev, b, 1);
+			else if (img && !dev)
+				report_add(&only_img, b, 1);
+		}
+	}
+	report_done(&only_dev);
+	report_done(&only_img);
+
+	/// data, in image order
+	log_mesg(0, 0, 1, debug, "Comparing data...\n");
+	read_buffer = io_buffer_alloc(cnv_blocks_to_bytes(0, buffer_capacity, block_size, &img_opt) + cs_slot);
+	image_buffer = io_buffer_alloc(buffer_capacity * block_size);
+	memset(&sr, 0, sizeof(sr));
+	/// aligned, the device may be opened with --read-direct-io
+	sr.buffer[0] = io_buffer_alloc(buffer_capacity * block_size);
+	sr.buffer[1] = io_buffer_alloc(buffer_capacity * block_size);
+	if (!read_buffer || !image_buffer || !sr.buffer[0] || !sr.buffer[1])
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	sr.fd = dfr;
+	sr.bitmap = img_bitmap;
+	sr.total = blocks_total;
+	sr.blocks_used = blocks_used;
+	sr.block_size = block_size;
+	sr.capacity = buffer_capacity;
+	sr.opt = opt;
+	pthread_mutex_init(&sr.lock, NULL);
+	pthread_cond_init(&sr.cond, NULL);
+	if (pthread_create(&reader, NULL, source_reader_thread, &sr))
+		log_mesg(0, 1, 1, debug, "%s, %i, thread create error\n", __func__, __LINE__);
+
+	if (cs_update)
+		init_checksum(img_opt.checksum_mode, checksum, debug);
+
+	copied = 0;
+	block_id = 0;
+	while (copied < blocks_used) {
+		unsigned int blocks_read = blocks_used - copied < buffer_capacity ? blocks_used - copied : buffer_capacity;
+		unsigned int i, run, read_offset = 0;
+
+		read_size = cnv_blocks_to_bytes(copied, blocks_read, block_size, &img_opt);
+		/// the checksum of a partial chunk ends the image
+		if (blocks_per_cs && copied + blocks_read == blocks_used && blocks_used % blocks_per_cs)
+			read_size += cs_slot;
+
+		if (read_all(&dfi, read_buffer, read_size, opt) != (int)read_size)
+			log_mesg(0, 1, 1, debug, "image read ERROR:%s\n", strerror(errno));
+
+		/// a run of blocks up to the end of the chunk at a time, as the restore
+		for (i = 0; i < blocks_read; i += run) {
+			run = blocks_read - i;
+			if (blocks_per_cs && run > blocks_per_cs - blocks_in_cs)
+				run = blocks_per_cs - blocks_in_cs;
+
+			if (cs_update)
+				update_checksum(checksum, read_buffer + read_offset, run * block_size);
+			memcpy(image_buffer + i * block_size, read_buffer + read_offset, run * block_size);
+			read_offset += run * block_size;
+			blocks_in_cs += run;
+
+			/// the end of a chunk, or of the partial one ending the image
+			if (!blocks_per_cs || (blocks_in_cs != blocks_per_cs &&
+					!(copied + i + run == blocks_used && blocks_used % blocks_per_cs)))
+				continue;
+
+			if (cs_check) {
+				finish_checksum(checksum, (unsigned char *)read_buffer + read_offset);
+				if (memcmp(read_buffer + read_offset, checksum, cs_size))
+					log_mesg(0, 1, 1, debug, "CRC error in the image, block %llu\n", copied + i + run - 1);
+				if (img_opt.reseed_checksum)
+					init_checksum(img_opt.checksum_mode, checksum, debug);
+			} else if (cs_update)
+				init_checksum(img_opt.checksum_mode, checksum, debug);
+			read_offset += cs_slot;
+			blocks_in_cs = 0;
+		}
+
+		pthread_mutex_lock(&sr.lock);
+		while (!sr.full[half])
+			pthread_cond_wait(&sr.cond, &sr.lock);
+		pthread_mutex_unlock(&sr.lock);
+
+		/// walk the image bitmap again to name the blocks
+		for (i = 0; i < blocks_read; i++) {
+			block_id = pc_find_next_bit(img_bitmap, blocks_total, block_id, 1);
+			if (pc_test_bit(block_id, bitmap, blocks_total) &&
+			    memcmp(image_buffer + i * block_size, sr.buffer[half] + i * block_size, block_size))
+				report_add(&differ, block_id, 1);
+			block_id++;
+		}
+
+		pthread_mutex_lock(&sr.lock);
+		sr.full[half] = 0;
+		pthread_cond_broadcast(&sr.cond);
+		pthread_mutex_unlock(&sr.lock);
+		half ^= 1;
+
+		copied += blocks_read;
+		progress_publish(copied, block_id);
+	}
+	report_done(&differ);
+
+	pthread_join(reader, NULL);
+	pthread_mutex_destroy(&sr.lock);
+	pthread_cond_destroy(&sr.cond);
+	io_buffer_free(sr.buffer[0]);
+	io_buffer_free(sr.buffer[1]);
+	io_buffer_free(image_buffer);
+	io_buffer_free(read_buffer);
+
+	log_mesg(0, 0, 1, debug, "compare: %llu blocks used on the device only, %llu in the image only, %llu blocks differ\n",
+		only_dev.blocks, only_img.blocks, differ.blocks);
+
+	return only_dev.ranges + only_img.ranges + differ.ranges;
+}
@@ -0,0 +1,23 @@
+/**
+ * compare.h - Part of Partclone project.
+ *
+ * compare a device with an image of it
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef COMPARE_H_
+#define COMPARE_H_
+
+/**
+ * compare the bitmaps, then the data of the blocks used in the image with
+ * the same blocks of the device. dfr is the device, dfi the image, its
+ * header and bitmap already read. returns the number of differences found.
+ */
+unsigned long long compare_image(int dfr, int dfi, file_system_info fs_info, image_options img_opt,
+	unsigned long *bitmap, unsigned long *img_bitmap, cmd_opt *opt);
+
+#endif /* COMPARE_H_ */
@@ -21,7 +21,10 @@
 #include <malloc.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <string.h>
+#include <stddef.h>
 #include <config.h>
+#include <openssl/sha.h>
 
 #define in_use(m, x)    (ext2fs_test_bit ((x), (m)))
 
@@ -36,13 +39,47 @@
 
 ext2_filsys  fs;
 
-/// open device
+/// a group descriptor changed in the image by --skip-unused-itable
+typedef struct {
+    unsigned long long block;   /// descriptor block on the device, one of the copies
+    unsigned long group;        /// whose descriptor it is
+    unsigned int offset;        /// of the descriptor in the block
+    uint16_t flags;             /// bg_flags and bg_checksum, little endian
+    uint16_t checksum;
+} itable_patch;
+
+static itable_patch *patches;
+static unsigned long patch_count, patch_next;
+static unsigned int patch_block_size;
+
+/// journal superblock, in the big endian jbd2 layout
+#define JSB_MAGIC           0xC03B3998
+#define JSB_OFF_BLOCKTYPE   0x04
+#define JSB_OFF_SEQUENCE    0x18
+#define JSB_OFF_START       0x1C
+#define JSB_OFF_INCOMPAT    0x28
+#define JSB_OFF_CHECKSUM    0xFC
+#define JSB_SIZE            1024
+#define JSB_INCOMPAT_CSUM   (0x08 | 0x10)   /// JBD2_FEATURE_INCOMPAT_CSUM_V2, _V3
+/**
+ * how far the transaction ids of a journal are moved when its blocks are
+ * left out of the image, so the records left on the target by a later state
+ * of the same file system never carry the id the recovery looks for
+ */
+#define JOURNAL_SEQUENCE_JUMP (1U << 30)
+
+static unsigned long long journal_sb_block; /// 0 when the journal is copied
+
+/// open device, once per session
 static void fs_open(char* device){
     errcode_t retval;
     int use_superblock = 0;
     int use_blocksize = 0;
     int flags;
 
+    if (fs)
+	return;
+
 #ifdef EXTFS_1_41
     flags = EXT2_FLAG_JOURNAL_DEV_OK | EXT2_FLAG_SOFTSUPP_FEATURES;
 #else
@@ -79,6 +116,13 @@ static void fs_open(char* device){
 /// close device
 static void fs_close(){
     ext2fs_close(fs);
+    fs = NULL;
+}
+
+/// end the session opened by read_super_blocks or read_bitmap
+void fs_session_close(void){
+    if (fs)
+	fs_close();
 }
 
 /// get block size from super block
@@ -96,6 +140,9 @@ static unsigned long long get_used_blocks(){
     return (unsigned long long)(ext2fs_blocks_count(fs->super) - ext2fs_free_blocks_count(fs->super));
 }
 
+static void skip_unused_itable(unsigned long* bitmap, unsigned long long total);
+static void skip_clean_journal(unsigned long* bitmap, unsigned long long total);
+
 // reference dumpe2fs
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui) {
     errcode_t retval;
@@ -114,7 +161,7 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     log_mesg(2, 0, 0, fs_opt.debug, "%s: read_bitmap %p\n", __FILE__, bitmap);
 
     fs_open(device);
-    retval = ext2fs_read_bitmaps(fs); /// open extfs bitmap
+    retval = ext2fs_read_bitmaps(fs); /// open extfs bitmap, kept by the session
     if (retval)
 	log_mesg(0, 1, 1, fs_opt.debug, "%s: Couldn't find valid filesystem bitmap.\n", __FILE__);
 
@@ -199,12 +246,380 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 	    log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap free count err, partclone get free:%llu but extfs get %llu.\nPlease run fsck to check and repair the file system\n", __FILE__, lfree, ext2fs_free_blocks_count(fs->super));
     }
 
-    fs_close();
+    if (fs_opt.skip_unused_itable)
+	skip_unused_itable(bitmap, fs_info.totalblock);
+    if (fs_opt.skip_clean_journal)
+	skip_clean_journal(bitmap, fs_info.totalblock);
+
     /// update progress
     update_pui(&prog, 1, 1, 1);//finish
     free(block_bitmap);
 }
 
+/// clear the bits of the blocks count blocks from first, within the device
+static unsigned long long clear_blocks(unsigned long* bitmap, unsigned long long total, unsigned long long first, unsigned long long count) {
+    unsigned long long block, cleared = 0;
+
+    for (block = first; block < first + count && block < total; block++) {
+	if (pc_test_bit(block, bitmap, total)) {
+	    pc_clear_bit(block, bitmap, total);
+	    cleared++;
+	}
+    }
+    return cleared;
+}
+
+#ifndef EXTFS_1_41
+static int patch_order(const void* a, const void* b) {
+    const itable_patch *pa = a, *pb = b;
+
+    if (pa->block != pb->block)
+	return pa->block < pb->block ? -1 : 1;
+    return pa->offset < pb->offset ? -1 : pa->offset > pb->offset;
+}
+
+/// append a copy of patch at block to copies, holding count of size
+static itable_patch *add_patch_copy(itable_patch *copies, unsigned long *count, unsigned long *size,
+	const itable_patch *patch, unsigned long long block) {
+
+    if (copies && *count == *size) {
+	*size *= 2;
+	copies = realloc(copies, *size * sizeof(itable_patch));
+    }
+    if (copies == NULL)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    copies[*count] = *patch;
+    copies[(*count)++].block = block;
+    return copies;
+}
+
+/**
+ * patch every copy of the descriptors of the count groups in patches, in
+ * group order: the primary table and its backups in the groups with a super
+ * block, or with meta_bg the first, second and last group of each meta group.
+ * e2fsck falls back to a backup, which must not keep INODE_ZEROED either.
+ * The copies are sorted by block for fs_patch_blocks().
+ */
+static void patch_descriptor_copies(unsigned long count, unsigned int dpb) {
+    unsigned long group, i, meta = 0, copies = 0, size = count;
+    unsigned long long old_desc_blocks = fs->desc_blocks;
+    blk64_t super_blk, old_desc, new_desc;
+    blk_t used_blks;
+    itable_patch *all = malloc(size * sizeof(itable_patch));
+
+    if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+	old_desc_blocks = fs->super->s_first_meta_bg;
+
+    for (group = 0; group < fs->group_desc_count; group++) {
+	if (ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc, &new_desc, &used_blks))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: can't locate the descriptors of group %lu\n", __FILE__, group);
+
+	/// a copy of the whole table but its meta groups
+	for (i = 0; old_desc && i < count && patches[i].group / dpb < old_desc_blocks; i++)
+	    all = add_patch_copy(all, &copies, &size, &patches[i], old_desc + patches[i].group / dpb);
+
+	/// a copy of the descriptor block of its meta group
+	for (; meta < count && patches[meta].group / dpb < group / dpb; meta++);
+	for (i = meta; new_desc && i < count && patches[i].group / dpb == group / dpb; i++)
+	    all = add_patch_copy(all, &copies, &size, &patches[i], new_desc);
+    }
+
+    qsort(all, copies, sizeof(itable_patch), patch_order);
+    free(patches);
+    patches = all;
+    patch_count = copies;
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: %lu group descriptors patched in %lu copies\n", __FILE__, count, copies);
+}
+#endif
+
+/**
+ * With group descriptor checksums the kernel and e2fsck trust bg_itable_unused
+ * and the UNINIT flags, so the tail of the inode tables that never held an
+ * inode and the bitmaps of uninitialised groups are not read. Leave them out
+ * of the image. A group whose inode table was zeroed loses INODE_ZEROED in the
+ * image, in every copy of its descriptor, so the kernel zeroes the table again
+ * after the restore.
+ */
+static void skip_unused_itable(unsigned long* bitmap, unsigned long long total) {
+#ifdef EXTFS_1_41
+    log_mesg(0, 0, 1, fs_opt.debug, "%s: --skip-unused-itable needs e2fsprogs 1.42 or later, all blocks are copied\n", __FILE__);
+#else
+    unsigned long group;
+    unsigned long long skipped = 0;
+    unsigned int ipg = EXT2_INODES_PER_GROUP(fs->super);
+    unsigned int ipb = EXT2_INODES_PER_BLOCK(fs->super);
+    unsigned int dpb = EXT2_DESC_PER_BLOCK(fs->super);
+    int csum = fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+
+#ifdef EXT4_FEATURE_RO_COMPAT_METADATA_CSUM
+    csum |= fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+#endif
+    if (!csum) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: no group descriptor checksums, all inode tables are copied\n", __FILE__);
+	return;
+    }
+
+    patches = calloc(fs->group_desc_count, sizeof(itable_patch));
+    if (patches == NULL)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    patch_count = patch_next = 0;
+    patch_block_size = EXT2_BLOCK_SIZE(fs->super);
+
+    for (group = 0; group < fs->group_desc_count; group++) {
+	int flags = ext2fs_bg_flags(fs, group);
+	unsigned int unused = flags & EXT2_BG_INODE_UNINIT ? ipg : ext2fs_bg_itable_unused(fs, group);
+	unsigned long long used_blocks, cleared;
+
+	if (unused > ipg) {
+	    log_mesg(1, 0, 0, fs_opt.debug, "%s: bad itable_unused %u in group %lu, kept\n", __FILE__, unused, group);
+	    continue;
+	}
+
+	if (flags & EXT2_BG_BLOCK_UNINIT)
+	    skipped += clear_blocks(bitmap, total, ext2fs_block_bitmap_loc(fs, group), 1);
+	if (flags & EXT2_BG_INODE_UNINIT)
+	    skipped += clear_blocks(bitmap, total, ext2fs_inode_bitmap_loc(fs, group), 1);
+
+	used_blocks = ((unsigned long long)(ipg - unused) + ipb - 1) / ipb;
+	if (used_blocks >= fs->inode_blocks_per_group)
+	    continue;
+	cleared = clear_blocks(bitmap, total, ext2fs_inode_table_loc(fs, group) + used_blocks,
+		fs->inode_blocks_per_group - used_blocks);
+	skipped += cleared;
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: %llu unused inode table blocks in group %lu\n", __FILE__, cleared, group);
+
+	if (cleared && (flags & EXT2_BG_INODE_ZEROED)) {
+	    itable_patch *p = &patches[patch_count++];
+
+	    /// the checksum of the descriptor without the flag, fs is left as read
+	    ext2fs_bg_flags_clear(fs, group, EXT2_BG_INODE_ZEROED);
+	    p->checksum = ext2fs_cpu_to_le16(ext2fs_group_desc_csum(fs, group));
+	    p->flags = ext2fs_cpu_to_le16(ext2fs_bg_flags(fs, group));
+	    ext2fs_bg_flags_set(fs, group, EXT2_BG_INODE_ZEROED);
+
+	    p->group = group;
+	    p->offset = (group % dpb) * EXT2_DESC_SIZE(fs->super);
+	}
+    }
+    if (patch_count)
+	patch_descriptor_copies(patch_count, dpb);
+
+    log_mesg(0, 0, 1, fs_opt.debug, "%s: %llu unused inode table and bitmap blocks are not copied\n", __FILE__, skipped);
+#endif
+}
+
+/// set the bits of the count blocks from first, within the device
+static void mark_blocks(unsigned long* bitmap, unsigned long long total, unsigned long long first, unsigned long long count) {
+    unsigned long long block;
+
+    for (block = first; block < first + count && block < total; block++)
+	pc_set_bit(block, bitmap, total);
+}
+
+/// the super blocks and their descriptors, the allocation bitmaps and the inode tables
+int read_metadata_bitmap(char* device, file_system_info fs_info, unsigned long* metadata) {
+#ifdef EXTFS_1_41
+    log_mesg(0, 0, 1, fs_opt.debug, "%s: --metadata-first needs e2fsprogs 1.42 or later\n", __FILE__);
+    return 0;
+#else
+    unsigned long group;
+    unsigned long long total = fs_info.totalblock, old_desc_blocks;
+    blk64_t super_blk, old_desc, new_desc;
+    blk_t used_blks;
+
+    fs_open(device);
+    if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+	old_desc_blocks = fs->super->s_first_meta_bg;
+    else
+	old_desc_blocks = fs->desc_blocks + fs->super->s_reserved_gdt_blocks;
+
+    /// the boot sectors and the primary super block
+    mark_blocks(metadata, total, 0, fs->super->s_first_data_block + 1);
+
+    for (group = 0; group < fs->group_desc_count; group++) {
+	if (ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc, &new_desc, &used_blks))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: can't locate the descriptors of group %lu\n", __FILE__, group);
+	if (super_blk)
+	    mark_blocks(metadata, total, super_blk, 1);
+	if (old_desc)
+	    mark_blocks(metadata, total, old_desc, old_desc_blocks);
+	if (new_desc)
+	    mark_blocks(metadata, total, new_desc, 1);
+	mark_blocks(metadata, total, ext2fs_block_bitmap_loc(fs, group), 1);
+	mark_blocks(metadata, total, ext2fs_inode_bitmap_loc(fs, group), 1);
+	mark_blocks(metadata, total, ext2fs_inode_table_loc(fs, group), fs->inode_blocks_per_group);
+    }
+    return 1;
+#endif
+}
+
+/// the blocks listed in the bad blocks inode
+unsigned long long read_bad_blocks(char* device, file_system_info fs_info, unsigned long* bad) {
+    ext2_badblocks_list bb_list = NULL;
+    ext2_badblocks_iterate bb_iter;
+    blk_t blk;
+    unsigned long long count = 0;
+
+    fs_open(device);
+    if (ext2fs_read_bb_inode(fs, &bb_list) || ext2fs_badblocks_list_iterate_begin(bb_list, &bb_iter)) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: can't read the bad blocks inode, the bad blocks are read\n", __FILE__);
+	if (bb_list)
+	    ext2fs_badblocks_list_free(bb_list);
+	return 0;
+    }
+    while (ext2fs_badblocks_list_iterate(bb_iter, &blk)) {
+	if (blk >= fs_info.totalblock)
+	    continue;
+	pc_set_bit(blk, bad, fs_info.totalblock);
+	count++;
+    }
+    ext2fs_badblocks_list_iterate_end(bb_iter);
+    ext2fs_badblocks_list_free(bb_list);
+    return count;
+}
+
+/// the UUID and the counters moved by every mount and every write of the kernel or e2fsprogs
+int get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity) {
+    struct {
+	uint8_t  uuid[16];
+	uint32_t wtime;
+	uint32_t mtime;
+	uint64_t kbytes_written;
+	uint16_t mnt_count;
+	uint16_t state;
+    } __attribute__((packed)) id;
+
+    fs_open(device);
+    memset(&id, 0, sizeof(id));
+    memcpy(id.uuid, fs->super->s_uuid, sizeof(id.uuid));
+    id.wtime = fs->super->s_wtime;
+    id.mtime = fs->super->s_mtime;
+    id.kbytes_written = fs->super->s_kbytes_written;
+    id.mnt_count = fs->super->s_mnt_count;
+    id.state = fs->super->s_state;
+    SHA256((unsigned char*)&id, sizeof(id), identity);
+    return 1;
+}
+
+static uint32_t get_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(unsigned char* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+#ifndef EXTFS_1_41
+typedef struct {
+    unsigned long* bitmap;      /// NULL to find the superblock only
+    unsigned long long total;
+    unsigned long long cleared;
+    unsigned long long sb_block;
+} journal_walk;
+
+/// clear the journal blocks but its superblock, the extent tree is kept
+static int journal_block(ext2_filsys efs, blk64_t* blocknr, e2_blkcnt_t blockcnt, blk64_t ref_blk, int ref_offset, void* priv) {
+    journal_walk* walk = (journal_walk*)priv;
+
+    if (blockcnt == 0) {
+	walk->sb_block = *blocknr;
+	if (walk->bitmap == NULL)
+	    return BLOCK_ABORT;
+    } else if (blockcnt > 0)
+	walk->cleared += clear_blocks(walk->bitmap, walk->total, *blocknr, 1);
+    return 0;
+}
+#endif
+
+/**
+ * A journal left clean, without the RECOVER feature and with s_start 0, is
+ * not read again: the kernel and e2fsck start a new one from its superblock.
+ * Keep that superblock, leave the other journal blocks out of the image and
+ * move the transaction ids on, so whatever the target holds there is never
+ * replayed. Nothing has to be written at the restore.
+ */
+static void skip_clean_journal(unsigned long* bitmap, unsigned long long total) {
+#ifdef EXTFS_1_41
+    log_mesg(0, 0, 1, fs_opt.debug, "%s: --skip-clean-journal needs e2fsprogs 1.42 or later, the journal is copied\n", __FILE__);
+#else
+    journal_walk walk = { NULL, total, 0, 0 };
+    unsigned char *jsb;
+    errcode_t retval;
+
+    if (!(fs->super->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) || !fs->super->s_journal_inum) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: no internal journal to skip\n", __FILE__);
+	return;
+    }
+    if (fs->super->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: the journal needs recovery, it is copied\n", __FILE__);
+	return;
+    }
+
+    retval = ext2fs_block_iterate3(fs, fs->super->s_journal_inum, BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY, NULL, journal_block, &walk);
+    if (retval || !walk.sb_block) {
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: can't read the journal inode\n", __FILE__);
+	return;
+    }
+
+    jsb = malloc(EXT2_BLOCK_SIZE(fs->super));
+    if (jsb == NULL)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    retval = io_channel_read_blk64(fs->io, walk.sb_block, 1, jsb);
+    if (retval)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: can't read the journal superblock\n", __FILE__);
+
+    if (get_be32(jsb) != JSB_MAGIC || get_be32(jsb + JSB_OFF_START) != 0) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: the journal is not clean, it is copied\n", __FILE__);
+	free(jsb);
+	return;
+    }
+    free(jsb);
+
+    walk.bitmap = bitmap;
+    retval = ext2fs_block_iterate3(fs, fs->super->s_journal_inum, BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY, NULL, journal_block, &walk);
+    if (retval)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: can't read the journal inode\n", __FILE__);
+
+    journal_sb_block = walk.sb_block;
+    patch_block_size = EXT2_BLOCK_SIZE(fs->super);
+    log_mesg(0, 0, 1, fs_opt.debug, "%s: %llu blocks of the clean journal are not copied\n", __FILE__, walk.cleared);
+#endif
+}
+
+/// clear INODE_ZEROED in the descriptors of the groups whose inode table was cut,
+/// move the ids of the journal left out
+void fs_patch_blocks(unsigned long long block, unsigned long long count, char* buffer) {
+
+    if (journal_sb_block && journal_sb_block >= block && journal_sb_block < block + count) {
+	unsigned char *jsb = (unsigned char *)buffer + (journal_sb_block - block) * patch_block_size;
+
+	put_be32(jsb + JSB_OFF_SEQUENCE, get_be32(jsb + JSB_OFF_SEQUENCE) + JOURNAL_SEQUENCE_JUMP);
+#ifdef EXT4_FEATURE_RO_COMPAT_METADATA_CSUM
+	if (get_be32(jsb + JSB_OFF_BLOCKTYPE) == 4 && (get_be32(jsb + JSB_OFF_INCOMPAT) & JSB_INCOMPAT_CSUM)) {
+	    put_be32(jsb + JSB_OFF_CHECKSUM, 0);
+	    put_be32(jsb + JSB_OFF_CHECKSUM, ext2fs_crc32c_le(~0, jsb, JSB_SIZE));
+	}
+#endif
+	log_mesg(1, 0, 0, fs_opt.debug, "%s: journal sequence moved to %u\n", __FILE__, get_be32(jsb + JSB_OFF_SEQUENCE));
+    }
+
+    /// the clone loop reads the blocks in order
+    while (patch_next < patch_count && patches[patch_next].block < block)
+	patch_next++;
+
+    for (; patch_next < patch_count && patches[patch_next].block < block + count; patch_next++) {
+	itable_patch *p = &patches[patch_next];
+	char *desc = buffer + (p->block - block) * patch_block_size + p->offset;
+
+	memcpy(desc + offsetof(struct ext2_group_desc, bg_flags), &p->flags, sizeof(p->flags));
+	memcpy(desc + offsetof(struct ext2_group_desc, bg_checksum), &p->checksum, sizeof(p->checksum));
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: INODE_ZEROED cleared at block %llu offset %u\n", __FILE__, p->block, p->offset);
+    }
+}
+
 /// get extfs type
 static int test_extfs_type(char* device){
     int ext2 = 1;
@@ -223,7 +638,6 @@ static int test_extfs_type(char* device){
 	log_mesg(1, 0, 0, fs_opt.debug, "%s: test feature as EXT2\n", __FILE__);
 	device_type = ext2;
     }
-    fs_close();
     return device_type;
 }
 
@@ -245,7 +659,5 @@ void read_super_blocks(char* device, file_system_info* fs_info)
     log_mesg(1, 0, 0, fs_opt.debug, "%s: extfs used blocks %lli\n", __FILE__, fs_info->usedblocks);
     log_mesg(1, 0, 0, fs_opt.debug, "%s: extfs superBlock used blocks %lli\n", __FILE__, fs_info->superBlockUsedBlocks);
     log_mesg(1, 0, 0, fs_opt.debug, "%s: extfs device size %lli\n", __FILE__, fs_info->device_size);
-
-    fs_close();
 }
 
@@ -40,6 +40,9 @@ char *fat_type = "FATXX";
 #define ROUND_TO_MULTIPLE(n,m) ((n) && (m) ? (n)+(m)-1-((n)-1)%(m) : 0)
 #define MSDOS_DIR_BITS 5        /* log2(sizeof(struct msdos_dir_entry)) */
 unsigned long long total_block = 0;
+static int fat_opened = 0;
+static unsigned long *fat_bitmap_cache = NULL; /// counted by read_super_blocks, reused by read_bitmap
+static unsigned long *fat_bad_bitmap = NULL;   /// sectors of the clusters marked bad in the FAT
 
 static unsigned long long get_used_block();
 
@@ -251,6 +254,9 @@ static void fs_open(char* device)
 {
     char *buffer;
 
+    if (fat_opened)
+	return;
+
     log_mesg(2, 0, 0, fs_opt.debug, "%s: open device\n", __FILE__);
     ret = open(device, O_RDONLY);
 
@@ -273,6 +279,7 @@ static void fs_open(char* device)
     assert(buffer != NULL);
     memcpy(&fatfs_info, buffer, sizeof(FatFsInfo));
     free(buffer);
+    fat_opened = 1;
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s: open device down\n", __FILE__);
 
@@ -282,6 +289,35 @@ static void fs_open(char* device)
 static void fs_close()
 {
     close(ret);
+    fat_opened = 0;
+}
+
+/// end the session opened by read_super_blocks or read_bitmap
+void fs_session_close(void)
+{
+    free(fat_bitmap_cache);
+    fat_bitmap_cache = NULL;
+    free(fat_bad_bitmap);
+    fat_bad_bitmap = NULL;
+    if (fat_opened)
+	fs_close();
+}
+
+/// leave a cluster marked bad out of the bitmap, keep it for read_bad_blocks
+static unsigned long long mark_bad_cluster(unsigned long* fat_bitmap, unsigned long long block)
+{
+    unsigned long long i = 0;
+
+    if (fat_bad_bitmap == NULL) {
+        fat_bad_bitmap = pc_alloc_bitmap(total_block);
+        if (fat_bad_bitmap == NULL)
+            log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    }
+    for (i=0; i < fat_sb.cluster_size; i++,block++) {
+        pc_clear_bit(block, fat_bitmap, total_block);
+        pc_set_bit(block, fat_bad_bitmap, total_block);
+    }
+    return block;
 }
 
 /// check per FAT32 entry
@@ -295,16 +331,15 @@ unsigned long long check_fat32_entry(unsigned long* fat_bitmap, unsigned long lo
     if (rd == -1)
         log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat32_Entry error\n", __FILE__);
     if (Fat32_Entry  == 0x0FFFFFF7) { /// bad FAT32 cluster
-        DamagedClusters++;
+        (*DamagedClusters)++;
         log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
+        block = mark_bad_cluster(fat_bitmap, block);
     } else if (Fat32_Entry == 0x0000){ /// free
-        bfree++;
+        (*bfree)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_clear_bit(block, fat_bitmap, total_block);
     } else {
-        bused++;
+        (*bused)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_set_bit(block, fat_bitmap, total_block);
     }
@@ -322,16 +357,15 @@ unsigned long long check_fat16_entry(unsigned long* fat_bitmap, unsigned long lo
     if (rd == -1)
         log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat16_Entry error\n", __FILE__);
     if (Fat16_Entry  == 0xFFF7) { /// bad FAT16 cluster
-        DamagedClusters++;
+        (*DamagedClusters)++;
         log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
+        block = mark_bad_cluster(fat_bitmap, block);
     } else if (Fat16_Entry == 0x0000){ /// free
-        bfree++;
+        (*bfree)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_clear_bit(block, fat_bitmap, total_block);
     } else {
-        bused++;
+        (*bused)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_set_bit(block, fat_bitmap, total_block);
     }
@@ -350,16 +384,15 @@ unsigned long long check_fat12_entry(unsigned long* fat_bitmap, unsigned long lo
         log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat12_Entry error\n", __FILE__);
     Fat12_Entry = Fat16_Entry>>4;
     if (Fat12_Entry  == 0xFF7) { /// bad FAT12 cluster
-        DamagedClusters++;
+        (*DamagedClusters)++;
         log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
+        block = mark_bad_cluster(fat_bitmap, block);
     } else if (Fat12_Entry == 0x0000){ /// free
-        bfree++;
+        (*bfree)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_clear_bit(block, fat_bitmap, total_block);
     } else {
-        bused++;
+        (*bused)++;
         for (i=0; i < fat_sb.cluster_size; i++,block++)
             pc_set_bit(block, fat_bitmap, total_block);
     }
@@ -393,7 +426,6 @@ void read_super_blocks(char* device, file_system_info* fs_info)
     log_mesg(2, 0, 0, fs_opt.debug, "%s: superBlockUsedBlocks:%llu\n", __FILE__, fs_info->superBlockUsedBlocks);
     log_mesg(2, 0, 0, fs_opt.debug, "%s: Device Size:%llu\n", __FILE__, fs_info->device_size);
 
-    fs_close();
     log_mesg(2, 0, 0, fs_opt.debug, "%s: initial_image down\n", __FILE__);
 }
 
@@ -418,6 +450,14 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     progress_bar   prog;	/// progress_bar structure defined in progress.h
     progress_init(&prog, start, cluster_count, fs_info.totalblock, BITMAP, bit_size);
 
+    /// the FAT was already scanned by read_super_blocks in this session
+    if (fat_bitmap_cache) {
+	memcpy(bitmap, fat_bitmap_cache, BITS_TO_LONGS(total_sector) * sizeof(unsigned long));
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: bitmap from read_super_blocks\n", __FILE__);
+	update_pui(&prog, 1, 1, 1);//finish
+	return;
+    }
+
     /// init bitmap
     pc_init_bitmap(bitmap, 0xFF, total_sector);
 
@@ -457,14 +497,39 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
         /// update progress
         update_pui(&prog, i, i, 0);//keep update
     }
+    if (DamagedClusters)
+        log_mesg(1, 0, 0, fs_opt.debug, "%s: %llu bad clusters\n", __FILE__, DamagedClusters);
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s: done\n", __FILE__);
-    fs_close();
 
     /// update progress
     update_pui(&prog, 1, 1, 1);//finish
 }
 
+/// the reserved sectors, the FATs and the root directory of FAT12 and FAT16
+int read_metadata_bitmap(char* device, file_system_info fs_info, unsigned long* metadata)
+{
+    fs_open(device);
+    mark_reserved_sectors(metadata, 0);
+    return 1;
+}
+
+/// the clusters marked bad in the FAT, already out of the bitmap
+unsigned long long read_bad_blocks(char* device, file_system_info fs_info, unsigned long* bad)
+{
+    unsigned long long block, count = 0;
+
+    if (fat_bad_bitmap == NULL)
+        return 0;
+    for (block = 0; block < fs_info.totalblock; block++) {
+        if (pc_test_bit(block, fat_bad_bitmap, total_block)) {
+            pc_set_bit(block, bad, fs_info.totalblock);
+            count++;
+        }
+    }
+    return count;
+}
+
 /// get_used_block - get FAT used blocks
 static unsigned long long get_used_block()
 {
@@ -529,7 +594,9 @@ static unsigned long long get_used_block()
             real_back_block++;
         }
     }
-    free(fat_bitmap);
+    /// keep it for read_bitmap
+    free(fat_bitmap_cache);
+    fat_bitmap_cache = fat_bitmap;
     log_mesg(2, 0, 0, fs_opt.debug, "%s: get_used_block down\n", __FILE__);
 
     return real_back_block;
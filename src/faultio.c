@@ -0,0 +1,215 @@
+/**
+ * faultio.c - Part of Partclone project.
+ *
+ * inject I/O faults on the source and the target, for the tests
+ *
+ * Built with ./configure --enable-fault-inject, the reads and writes of
+ * io_all go through here and --fault-inject FILE gives the faults, one
+ * per line:
+ *
+ *   source eio START LEN         the calls touching [START, START+LEN) fail with EIO
+ *   source short START LEN BYTES they move at most BYTES bytes
+ *   target eintr START LEN       every other call fails with EINTR
+ *   target eagain START LEN      or with EAGAIN
+ *   source delay START LEN MS    each call waits MS milliseconds first
+ *
+ * START and LEN take a k, m, g or t suffix. The position is the file
+ * offset, or the bytes moved so far on a pipe. Lines starting with # are
+ * comments.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "partclone.h"
+#include "faultio.h"
+
+#ifdef FAULT_INJECT
+
+typedef enum {
+	FAULT_EIO,
+	FAULT_SHORT,
+	FAULT_EINTR,
+	FAULT_EAGAIN,
+	FAULT_DELAY
+} fault_kind;
+
+static const char *fault_names[] = { "eio", "short", "eintr", "eagain", "delay" };
+
+typedef struct {
+	int which;                     /// FAULT_SOURCE or FAULT_TARGET
+	fault_kind kind;
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long long value;      /// bytes of a short call, milliseconds of a delay
+	unsigned long long hits;
+} fault_rule;
+
+static fault_rule *rules = NULL;
+static unsigned int rule_count = 0;
+static int fault_fds[2] = { -1, -1 };
+static unsigned long long streamed[2];   /// bytes moved on a pipe
+static pthread_mutex_t fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fault_debug = 0;
+
+static unsigned long long parse_fault_size(const char *str, const char *path, unsigned int line) {
+
+	unsigned long long value;
+	int in_blocks;
+	const char *end = parse_size(str, &value, &in_blocks);
+
+	if (end == NULL || *end != '\0' || in_blocks)
+		log_mesg(0, 1, 1, fault_debug, "fault: %s:%u: bad size '%s'\n", path, line, str);
+	return value;
+}
+
+void fault_init(struct cmd_opt *opt) {
+
+	char buf[256], file[16], kind[16], start[32], len[32], value[32];
+	unsigned int line = 0;
+	FILE *spec;
+
+	fault_debug = opt->debug;
+	if (opt->fault_spec == NULL)
+		return;
+
+	spec = fopen(opt->fault_spec, "r");
+	if (spec == NULL)
+		log_mesg(0, 1, 1, fault_debug, "fault: open %s error: %s\n", opt->fault_spec, strerror(errno));
+
+	while (fgets(buf, sizeof(buf), spec)) {
+		fault_rule *rule;
+		int fields, k;
+
+		line++;
+		fields = sscanf(buf, "%15s %15s %31s %31s %31s", file, kind, start, len, value);
+		if (fields <= 0 || file[0] == '#')
+			continue;
+
+		rules = realloc(rules, (rule_count + 1) * sizeof(fault_rule));
+		if (rules == NULL)
+			log_mesg(0, 1, 1, fault_debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		rule = &rules[rule_count++];
+		memset(rule, 0, sizeof(fault_rule));
+
+		for (k = FAULT_DELAY; k >= 0 && strcmp(kind, fault_names[k]); k--);
+		if (fields < 4 || k < 0 || (strcmp(file, "source") && strcmp(file, "target")))
+			log_mesg(0, 1, 1, fault_debug, "fault: %s:%u: bad line\n", opt->fault_spec, line);
+		if ((k == FAULT_SHORT || k == FAULT_DELAY) != (fields == 5))
+			log_mesg(0, 1, 1, fault_debug, "fault: %s:%u: %s %s a value\n", opt->fault_spec, line,
+				kind, fields == 5 ? "takes no" : "needs");
+
+		rule->which = strcmp(file, "source") ? FAULT_TARGET : FAULT_SOURCE;
+		rule->kind = k;
+		rule->start = parse_fault_size(start, opt->fault_spec, line);
+		rule->end = rule->start + parse_fault_size(len, opt->fault_spec, line);
+		if (fields == 5)
+			rule->value = parse_fault_size(value, opt->fault_spec, line);
+		if (k == FAULT_SHORT && rule->value == 0)
+			log_mesg(0, 1, 1, fault_debug, "fault: %s:%u: short needs at least a byte\n", opt->fault_spec, line);
+
+		log_mesg(1, 0, 0, fault_debug, "fault: %s %s %llu-%llu %llu\n", file, kind,
+			rule->start, rule->end, rule->value);
+	}
+	fclose(spec);
+}
+
+void fault_register(int fd, int which) {
+
+	pthread_mutex_lock(&fault_lock);
+	fault_fds[which] = fd;
+	streamed[which] = 0;
+	pthread_mutex_unlock(&fault_lock);
+}
+
+static ssize_t fault_io(int fd, void *buf, size_t count, int do_write) {
+
+	int which = fd == -1 ? -1 : fd == fault_fds[FAULT_SOURCE] ? FAULT_SOURCE
+		: fd == fault_fds[FAULT_TARGET] ? FAULT_TARGET : -1;
+	unsigned long long pos, delay = 0;
+	int error = 0, seekable;
+	unsigned int i;
+	ssize_t r;
+
+	if (which == -1 || rule_count == 0)
+		return do_write ? write(fd, buf, count) : read(fd, buf, count);
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	seekable = pos != (unsigned long long)-1;
+
+	pthread_mutex_lock(&fault_lock);
+	if (!seekable)
+		pos = streamed[which];
+	for (i = 0; i < rule_count; i++) {
+		fault_rule *rule = &rules[i];
+
+		if (rule->which != which || pos >= rule->end || pos + count <= rule->start)
+			continue;
+
+		switch (rule->kind) {
+		case FAULT_EIO:
+			error = EIO;
+			break;
+		case FAULT_SHORT:
+			if (count > rule->value)
+				count = rule->value;
+			break;
+		case FAULT_EINTR:
+		case FAULT_EAGAIN:
+			/// the retry of the call goes through
+			if (rule->hits % 2 == 0 && error != EIO)
+				error = rule->kind == FAULT_EINTR ? EINTR : EAGAIN;
+			break;
+		case FAULT_DELAY:
+			delay += rule->value;
+			break;
+		}
+		rule->hits++;
+		log_mesg(2, 0, 0, fault_debug, "fault: %s %s at %llu, %zu bytes\n",
+			which == FAULT_SOURCE ? "source" : "target", fault_names[rule->kind], pos, count);
+	}
+	pthread_mutex_unlock(&fault_lock);
+
+	if (delay) {
+		struct timespec ts = { delay / 1000, (delay % 1000) * 1000000 };
+
+		while (nanosleep(&ts, &ts) && errno == EINTR);
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	r = do_write ? write(fd, buf, count) : read(fd, buf, count);
+	if (r > 0 && !seekable) {
+		pthread_mutex_lock(&fault_lock);
+		streamed[which] += r;
+		pthread_mutex_unlock(&fault_lock);
+	}
+	return r;
+}
+
+ssize_t fault_read(int fd, void *buf, size_t count) {
+
+	return fault_io(fd, buf, count, 0);
+}
+
+ssize_t fault_write(int fd, const void *buf, size_t count) {
+
+	return fault_io(fd, (void *)buf, count, 1);
+}
+
+#endif /* FAULT_INJECT */
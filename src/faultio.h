@@ -0,0 +1,41 @@
+/**
+ * faultio.h - Part of Partclone project.
+ *
+ * inject I/O faults on the source and the target, for the tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FAULTIO_H_
+#define FAULTIO_H_
+
+#include <sys/types.h>
+
+#define FAULT_SOURCE 0
+#define FAULT_TARGET 1
+
+#ifdef FAULT_INJECT
+
+struct cmd_opt;
+
+// load the faults of the --fault-inject file, exits on a bad line
+void fault_init(struct cmd_opt *opt);
+// the faults of the source or the target apply to fd from now on
+void fault_register(int fd, int which);
+// read and write, failing, short or late when a fault covers the file position
+ssize_t fault_read(int fd, void *buf, size_t count);
+ssize_t fault_write(int fd, const void *buf, size_t count);
+
+#else
+
+#define fault_init(opt)
+#define fault_register(fd, which)
+#define fault_read read
+#define fault_write write
+
+#endif
+
+#endif /* FAULTIO_H_ */
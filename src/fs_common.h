@@ -4,6 +4,8 @@ struct fs_cmd_opt
     int debug;
     int ignore_fschk;
     int force;
+    int skip_unused_itable;
+    int skip_clean_journal;
 };
 typedef struct fs_cmd_opt fs_cmd_opt;
 
@@ -1,5 +1,9 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <vmfs/vmfs.h>
+#include "swapclone.h"
 //#include <vmfs/vmfs_fs.h>
 
 vmfs_fs_t *fs;
@@ -54,6 +58,24 @@ static int pvmfs_fs_open(char* device){
 
 }
 
+/// linux swap area, its signature ends the first page
+static int swap_type(char* device){
+    char page[SWAP_MAX_PAGE_SIZE];
+    unsigned int page_size;
+    ssize_t size;
+    int fd;
+
+    if ((fd = open(device, O_RDONLY)) == -1)
+	return 0;
+    size = pread(fd, page, sizeof(page), 0);
+    close(fd);
+
+    for (page_size = SWAP_MIN_PAGE_SIZE; page_size <= SWAP_MAX_PAGE_SIZE && (ssize_t)page_size <= size; page_size <<= 1)
+	if (!memcmp(page + page_size - SWAP_SIGNATURE_SIZE, SWAP_SIGNATURE, SWAP_SIGNATURE_SIZE))
+	    return 1;
+    return 0;
+}
+
 /// close device
 static void pvmfs_vmfs_close(){
     vmfs_dir_close(root_dir);
@@ -71,6 +93,11 @@ int main (int argc, char **argv){
     }
 
     source=argv[1];
+    if (swap_type(source)) {
+	fprintf(stdout, "TYPE=\"swap\"\n");
+	return 0;
+    }
+
     ret = pvmfs_fs_open(source);
     if(ret == 0){
 	fprintf(stdout, "TYPE=\"vmfs%i\"\n", vol->vol_info.version);
@@ -29,6 +29,9 @@
 #include <errno.h>
 
 #include "partclone.h"
+#include "checksum.h"
+#include "stripcache.h"
+#include "repository.h"
 off_t baseseek=0;
 cmd_opt opt;
 image_options    img_opt;
@@ -36,13 +39,22 @@ int dfr;                  /// file descriptor for source and target
 unsigned long   *bitmap;  /// the point for bitmap data
 file_system_info fs_info;
 char *image_file;
+strip_cache *cache;        /// shared by the fuse threads
+repo_image *repo_img;      /// the image when it is read from a repository
+unsigned long long cache_size = STRIP_CACHE_DEFAULT_SIZE;
 
 void info_usage(void)
 {
     fprintf(stderr, "partclone v%s http://partclone.org\n"
-		    "Usage: partclone.fuseimg [FILE] [mount point]\n"
+		    "Usage: partclone.imgfuse [OPTIONS] [FILE] [mount point]\n"
 		    "\n"
-		    , VERSION);
+		    "    --key-file=FILE      Key file of an encrypted image\n"
+		    "    --cache-size=SIZE    MiB of image data kept in memory, default %llu\n"
+		    "    --repository=DIR     FILE is the name of an image in the repository DIR\n"
+		    "\n"
+		    "Other options are given to fuse.\n"
+		    "\n"
+		    , VERSION, STRIP_CACHE_DEFAULT_SIZE / 1024 / 1024);
     exit(1);
 }
 unsigned long pathtoblock(const char *path)
@@ -63,110 +75,14 @@ unsigned long pathtoblock(const char *path)
 
 size_t get_file_size(unsigned long block)
 {
-    unsigned long copied = 0;
-    unsigned long long block_id =0;
-    unsigned long nx_current = 0;
-    for (block_id = block; block_id <= fs_info.totalblock; block_id++) {
-	if (block_id < fs_info.totalblock) {
-	    nx_current = pc_test_bit(block_id, bitmap, fs_info.totalblock);
-	    if (nx_current)
-		copied++;
-	} else
-	    nx_current = -1;
-	if (!nx_current) {
-	    return (size_t)(copied*fs_info.block_size);
-	}
-    }
-    return 0;
-}
-
-
-size_t read_block_data(unsigned long block, char *buf, size_t size, off_t offset)
-{
-    unsigned long long used = 0;
-    unsigned long long i;
-    unsigned long int seek_crc_size = 0;
-    off_t bseek = 0;
-    size_t x = 0;
-
-    for(i = 0; i < block; ++i) {
-	if (pc_test_bit(i, bitmap, fs_info.totalblock))
-	    ++used;
-    }
-
-    seek_crc_size = (used / img_opt.blocks_per_checksum) * img_opt.checksum_size;
-    bseek = (off_t)(fs_info.block_size*used+seek_crc_size+baseseek);
-
-    //printf("RRRRR read block %lu\n", block);
-    //printf("bseek, == %zd, ", bseek);
-    //printf("blockXsiz == %zd, ", (fs_info.block_size*used));
-    //printf("crcXsize == %zd, ", seek_crc_size);
-    //printf("base == %zd, ", baseseek);
-    //printf("\n");
-
-    offset+=bseek;
-    //printf("pread buf %p, size %zu, offset %zd\n", buf, size, offset);
-    x  = pread(dfr, buf, size, offset);
-    return x;
+    unsigned long long end;
 
+    if (block >= fs_info.totalblock || !pc_test_bit(block, bitmap, fs_info.totalblock))
+	return 0;
+    end = pc_find_next_bit(bitmap, fs_info.totalblock, block, 0);
+    return (size_t)((end - block) * fs_info.block_size);
 }
-size_t read_blocks_data(unsigned long block, char *buf, size_t size, off_t offset)
-{
-    size_t readed_size = 0;
-    size_t total_readed_size = 0;
-    unsigned long block_count = 0;
-    size_t last_size = 0;
-    unsigned long current_block = 0;
-    unsigned long skip_block = 0;
-    unsigned long x_block = 0;
-    size_t skip_size = 0;
-
-    current_block = block;
-    skip_block = offset/fs_info.block_size;
-    skip_size = offset%fs_info.block_size;
-
-    // first block
-    if ((skip_size > 0) || (skip_block >= 1)){
-	current_block += skip_block;
-	//printf("read first block %lu\n", current_block);
-	if (size <= fs_info.block_size){
-	    readed_size = read_block_data(current_block, buf, size, skip_size);
-	}else{
-	    readed_size = read_block_data(current_block, buf, fs_info.block_size-skip_size, skip_size);
-	}
-	current_block++;
-	total_readed_size+=readed_size;
-    }
-
-    if (total_readed_size == size)
-	return total_readed_size;
-
-    block_count = (size-total_readed_size) / fs_info.block_size;
-
-    // continue read each block
-    //printf("block %lu blockcount %lu\n", block, block_count);
-    for (x_block = 0; x_block < block_count ; x_block++){
-	//printf("read block %lu\n", current_block);
-	readed_size = read_block_data(current_block, buf+total_readed_size, fs_info.block_size, 0);
-	total_readed_size+=readed_size;
-	current_block++;
-    }
 
-    if (total_readed_size == size)
-	return total_readed_size;
-
-    last_size = size - total_readed_size;
-    // last size in last block
-    if (last_size > 0){
-	//printf("read last block %lu\n", current_block);
-	readed_size = read_block_data(current_block, buf+total_readed_size, last_size, 0);
-	current_block++;
-	total_readed_size+=readed_size;
-    }
-    
-    return total_readed_size;
-
-}
 
 void info_options ()
 {
@@ -227,14 +143,14 @@ static int readdir_block(const char *path, void *buf, fuse_fill_dir_t filler, of
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
-    for (test_block = 0; test_block < fs_info.totalblock; ++test_block){
-	if (pc_test_bit(test_block, bitmap, fs_info.totalblock)){
-	    n = sprintf (buffer, "%032llx", test_block*fs_info.block_size);
-	    if (n >0){ 
-		filler(buf, buffer, NULL, 0);
-		test_block = test_block + (get_file_size(test_block)/fs_info.block_size);
-	    }
-	}
+    /// one file per extent of used blocks
+    test_block = pc_find_next_bit(bitmap, fs_info.totalblock, 0, 1);
+    while (test_block < fs_info.totalblock) {
+	n = sprintf (buffer, "%032llx", test_block*fs_info.block_size);
+	if (n >0)
+	    filler(buf, buffer, NULL, 0);
+	test_block = pc_find_next_bit(bitmap, fs_info.totalblock, test_block, 0);
+	test_block = pc_find_next_bit(bitmap, fs_info.totalblock, test_block, 1);
     }
 
     return 0;
@@ -253,6 +169,8 @@ static int open_block(const char *path, struct fuse_file_info *fi)
     //load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
     //baseseek = lseek(dfr, 0, SEEK_CUR);
     fi->fh = dfr;
+    /// the image does not change, keep the pages between opens
+    fi->keep_cache = 1;
     return 0;
 }
 
@@ -260,32 +178,23 @@ static int read_block(const char *path, char *buf, size_t size, off_t offset, st
 {
 
     unsigned long block = 0;
-    size_t r_size = 0;
     size_t len = 0;
 
+    if (!path)
+	return -ENOENT;
+
     block = pathtoblock(path);
     len = get_file_size(block);
 
-    if (path) {
-	if (offset >= len) {
-	    printf("offset bigger than len\n");
-	    return 0;
-	}
-
-	if (offset + size > len) {
-	    //printf("ReadIng Offset(%zd) size(%zu) > len(%zu)\n", offset, size, len);
-	    r_size = read_blocks_data(block, buf, len-offset, offset);
-	    return len - offset;
-	}
-
-	//printf("Read Offset(%zd) size(%zu) len(%zu)\n", offset, size, len);
-	r_size = read_blocks_data(block, buf, size, offset);
-	//printf("Read Size %zu\n", r_size);
-	return r_size;
-
-    }
+    if (offset >= len)
+	return 0;
+    if (offset + size > len)
+	size = len - offset;
 
-    return -ENOENT;
+    /// the cache is thread safe, the reads run in parallel
+    if (strip_cache_read(cache, buf, size, (unsigned long long)block * fs_info.block_size + offset))
+	return -EIO;
+    return size;
 }
 
 static struct fuse_operations ptl_fuse_operations =
@@ -297,26 +206,59 @@ static struct fuse_operations ptl_fuse_operations =
     .readdir = readdir_block,
 };
 
+static int repo_reader(void *ctx, char *buf, size_t size, unsigned long long offset)
+{
+    return repo_image_pread((repo_image *)ctx, buf, size, offset);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
+    char *key_file = NULL;
+    char *repo_dir = NULL;
+    int i, j;
+    int ret;
+
+    /// take our options out, the others are for fuse
+    for (i = 1, j = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--key-file=", 11) == 0)
+	    key_file = argv[i] + 11;
+	else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+	    cache_size = strtoull(argv[i] + 13, NULL, 10) * 1024 * 1024;
+	else if (strncmp(argv[i], "--repository=", 13) == 0)
+	    repo_dir = realpath(argv[i] + 13, NULL);
+	else
+	    argv[j++] = argv[i];
+    }
+    argc = j;
+    argv[argc] = NULL;
+
+    if (argc < 3) {
         info_usage(); // Never returns.
     }
-    image_file = realpath(argv[argc-2], NULL);
+    /// an image in a repository is named, not a path
+    image_file = repo_dir ? strdup(argv[argc-2]) : realpath(argv[argc-2], NULL);
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
 
     image_head_v2    img_head;
 
-    memset(&opt, 0, sizeof(cmd_opt));
     info_options();
+    opt.key_file = key_file;
     open_log(opt.logfile);
 
     /**
     * open Image file
     */
-    dfr = open(opt.source, O_RDONLY);
+    if (repo_dir) {
+	/// the head and the bitmap are read from a copy, the data from the chunks
+	repo_img = repo_image_open(repo_dir, opt.source, opt.debug);
+	if (repo_img == NULL)
+	    log_mesg(0, 1, 1, opt.debug, "fuseinfo: Can't open %s in %s\n", opt.source, repo_dir);
+	dfr = repo_image_prefix_fd(repo_img);
+    } else {
+	dfr = open(opt.source, O_RDONLY);
+    }
 //    if (dfr == -1){
 //	log_mesg(0, 1, 1, opt.debug, "fuseinfo: Can't open file(%s)\n", opt.source);
 //    }
@@ -335,6 +277,10 @@ int main(int argc, char *argv[])
     /// read and check bitmap from image file
     load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
 
+    if (img_opt.checksum_mode == CSM_AES256_GCM)
+	load_image_cipher(&dfr, &img_head, fs_info, img_opt, bitmap, &opt);
+    load_image_padding(&dfr, fs_info, img_opt, &opt);
+
 //    log_mesg(0, 0, 0, opt.debug, "check main bitmap pointer %p\n", bitmap);
 //    log_mesg(0, 0, 0, opt.debug, "print image information\n");
 //    log_mesg(0, 0, 1, opt.debug, "\n");
@@ -343,5 +289,14 @@ int main(int argc, char *argv[])
 //    print_file_system_info(fs_info, opt);
     baseseek = lseek(dfr, 0, SEEK_CUR);
 
-    return fuse_main(argc, argv, &ptl_fuse_operations, NULL);
+    cache = strip_cache_open(dfr, baseseek, &fs_info, &img_opt, bitmap, cache_size, opt.debug);
+    if (cache == NULL)
+	log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    if (repo_img)
+	strip_cache_set_reader(cache, repo_reader, repo_img);
+
+    ret = fuse_main(argc, argv, &ptl_fuse_operations, NULL);
+    strip_cache_close(cache);
+    repo_image_close(repo_img);
+    return ret;
 }
@@ -0,0 +1,336 @@
+/**
+ * imgrepo.c - Part of Partclone project.
+ *
+ * store images in a repository sharing their identical chunks, and give
+ * them back
+ *
+ * An image is read from a file or from a pipe, like one written by
+ * partclone.<fs> -c -o -, and given back to a file or to a pipe, like one
+ * read by partclone.restore -s -. The chunks of the image given back are
+ * read by several threads, written in order.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "partclone.h"
+#include "repository.h"
+
+/// cmd_opt structure defined in partclone.h
+cmd_opt opt;
+
+#define REPO_SEGMENT_SIZE     (4 * 1024 * 1024)   /// read by a thread at once
+#define REPO_DEFAULT_THREADS  4
+#define REPO_MAX_THREADS      64
+
+static const char *repo_dir = NULL;
+static const char *add_name = NULL;
+static const char *extract_name = NULL;
+static int list_images = 0;
+static int threads = REPO_DEFAULT_THREADS;
+
+/// the segments being read, each slot holds segment % slots
+typedef struct {
+	repo_image *ri;
+	unsigned long long segments;
+	unsigned int slots;
+	char **buf;
+	unsigned long long *ready;       /// the segment in each slot, or ~0ULL
+	unsigned long long written;      /// segments written out
+	unsigned long long next;         /// next segment to read
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} extract_state;
+
+void repo_usage(void) {
+	fprintf(stderr, "partclone v%s http://partclone.org\n"
+	                "Usage: partclone.repo -r DIR -a NAME [-s FILE]\n"
+	                "   or: partclone.repo -r DIR -x NAME [-o FILE]\n"
+	                "   or: partclone.repo -r DIR -l\n"
+	                "Store images in a repository sharing their identical chunks\n"
+	                "\n"
+		"    -r,  --repository DIR   The repository DIR, created by the first --add\n"
+		"    -a,  --add NAME         Store the image read from the source as NAME\n"
+		"    -x,  --extract NAME     Write the image NAME to the output\n"
+		"    -l,  --list             List the images of the repository\n"
+		"    -s,  --source FILE      Source image FILE (default stdin)\n"
+		"    -o,  --output FILE      Output image FILE (default stdout)\n"
+		"    -T,  --threads N        Read the chunks with N threads (default %i)\n"
+		"    -L,  --logfile FILE     Log FILE\n"
+		"    -dX, --debug=X          Set the debug level to X = [0|1|2]\n"
+		"    -v,  --version          Display partclone version\n"
+		"    -h,  --help             Display this help\n"
+		, VERSION, REPO_DEFAULT_THREADS);
+	exit(1);
+}
+
+void repo_options(int argc, char **argv) {
+
+	static const char *sopt = "hvd::L:r:a:x:ls:o:T:";
+	static const struct option lopt[] = {
+		{ "help",       no_argument,        NULL,   'h' },
+		{ "version",    no_argument,        NULL,   'v' },
+		{ "debug",      optional_argument,  NULL,   'd' },
+		{ "logfile",    required_argument,  NULL,   'L' },
+		{ "repository", required_argument,  NULL,   'r' },
+		{ "add",        required_argument,  NULL,   'a' },
+		{ "extract",    required_argument,  NULL,   'x' },
+		{ "list",       no_argument,        NULL,   'l' },
+		{ "source",     required_argument,  NULL,   's' },
+		{ "output",     required_argument,  NULL,   'o' },
+		{ "threads",    required_argument,  NULL,   'T' },
+		{ NULL,         0,                  NULL,    0  }
+	};
+	int c;
+
+	memset(&opt, 0, sizeof(cmd_opt));
+	opt.logfile = "/var/log/partclone.log";
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			repo_usage();
+			break;
+		case 'v':
+			print_version();
+			break;
+		case 'd':
+			opt.debug = optarg ? atol(optarg) : 1;
+			break;
+		case 'L':
+			opt.logfile = optarg;
+			break;
+		case 'r':
+			repo_dir = optarg;
+			break;
+		case 'a':
+			add_name = optarg;
+			break;
+		case 'x':
+			extract_name = optarg;
+			break;
+		case 'l':
+			list_images = 1;
+			break;
+		case 's':
+			opt.source = optarg;
+			break;
+		case 'o':
+			opt.target = optarg;
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > REPO_MAX_THREADS) {
+				fprintf(stderr, "--threads must be between 1 and %i.\n", REPO_MAX_THREADS);
+				repo_usage();
+			}
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%s'.\n", argv[optind-1]);
+			repo_usage();
+		}
+	}
+
+	if (repo_dir == NULL || (!!add_name + !!extract_name + list_images) != 1)
+		repo_usage();
+}
+
+static void *extract_thread(void *arg) {
+
+	extract_state *st = (extract_state *)arg;
+	const unsigned long long size = repo_image_size(st->ri);
+
+	pthread_mutex_lock(&st->lock);
+	while (!st->error && st->next < st->segments) {
+		unsigned long long segment = st->next++;
+		unsigned long long offset = segment * REPO_SEGMENT_SIZE;
+		unsigned int slot = segment % st->slots;
+		int ret;
+
+		/// wait for the segment using the slot before to be written
+		while (!st->error && segment >= st->written + st->slots)
+			pthread_cond_wait(&st->cond, &st->lock);
+		if (st->error)
+			break;
+		pthread_mutex_unlock(&st->lock);
+
+		ret = repo_image_pread(st->ri, st->buf[slot],
+			size - offset < REPO_SEGMENT_SIZE ? size - offset : REPO_SEGMENT_SIZE, offset);
+
+		pthread_mutex_lock(&st->lock);
+		if (ret)
+			st->error = 1;
+		st->ready[slot] = segment;
+		pthread_cond_broadcast(&st->cond);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+static int repo_extract(int out) {
+
+	extract_state st;
+	pthread_t tid[REPO_MAX_THREADS];
+	unsigned long long size, segment;
+	unsigned int i;
+	int ret = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.ri = repo_image_open(repo_dir, extract_name, opt.debug);
+	if (st.ri == NULL)
+		return -1;
+	size = repo_image_size(st.ri);
+	st.segments = (size + REPO_SEGMENT_SIZE - 1) / REPO_SEGMENT_SIZE;
+	st.slots = threads * 2;
+	st.buf = calloc(st.slots, sizeof(char *));
+	st.ready = malloc(st.slots * sizeof(unsigned long long));
+	if (st.buf == NULL || st.ready == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	for (i = 0; i < st.slots; i++) {
+		st.buf[i] = malloc(REPO_SEGMENT_SIZE);
+		st.ready[i] = ~0ULL;
+		if (st.buf[i] == NULL)
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.cond, NULL);
+
+	for (i = 0; i < (unsigned int)threads; i++)
+		if (pthread_create(&tid[i], NULL, extract_thread, &st))
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+
+	for (segment = 0; segment < st.segments; segment++) {
+		unsigned int slot = segment % st.slots;
+		unsigned long long offset = segment * REPO_SEGMENT_SIZE;
+		unsigned long long len = size - offset < REPO_SEGMENT_SIZE ? size - offset : REPO_SEGMENT_SIZE;
+		char *p = st.buf[slot];
+
+		pthread_mutex_lock(&st.lock);
+		while (!st.error && st.ready[slot] != segment)
+			pthread_cond_wait(&st.cond, &st.lock);
+		ret = st.error ? -1 : 0;
+		pthread_mutex_unlock(&st.lock);
+		if (ret)
+			break;
+
+		while (len) {
+			ssize_t w = write(out, p, len);
+
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				log_mesg(0, 0, 1, opt.debug, "repository: write error: %s\n", strerror(errno));
+				ret = -1;
+				break;
+			}
+			p += w;
+			len -= w;
+		}
+
+		pthread_mutex_lock(&st.lock);
+		if (ret)
+			st.error = 1;
+		st.written = segment + 1;
+		pthread_cond_broadcast(&st.cond);
+		pthread_mutex_unlock(&st.lock);
+		if (ret)
+			break;
+	}
+
+	for (i = 0; i < (unsigned int)threads; i++)
+		pthread_join(tid[i], NULL);
+	pthread_cond_destroy(&st.cond);
+	pthread_mutex_destroy(&st.lock);
+	for (i = 0; i < st.slots; i++)
+		free(st.buf[i]);
+	free(st.buf);
+	free(st.ready);
+	repo_image_close(st.ri);
+	return ret;
+}
+
+static int repo_list(void) {
+
+	char *path;
+	struct dirent *entry;
+	DIR *dir;
+
+	if (asprintf(&path, "%s/images", repo_dir) < 0)
+		return -1;
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL) {
+		log_mesg(0, 0, 1, opt.debug, "repository: can't read %s: %s\n", repo_dir, strerror(errno));
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		repo_image *ri;
+
+		if (entry->d_name[0] == '.')
+			continue;
+		ri = repo_image_open(repo_dir, entry->d_name, opt.debug);
+		if (ri == NULL)
+			continue;
+		printf("%s\t%llu\n", entry->d_name, repo_image_size(ri));
+		repo_image_close(ri);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	repo_stats stats;
+	int fd, ret;
+
+	repo_options(argc, argv);
+	open_log(opt.logfile);
+
+	if (list_images) {
+		ret = repo_list();
+	} else if (add_name) {
+		fd = STDIN_FILENO;
+		if (opt.source && strcmp(opt.source, "-")) {
+			fd = open(opt.source, O_RDONLY | O_LARGEFILE);
+			if (fd == -1)
+				log_mesg(0, 1, 1, opt.debug, "repository: Can't open file(%s)\n", opt.source);
+		}
+		ret = repo_store(repo_dir, add_name, fd, &stats, opt.debug);
+		if (ret == 0)
+			log_mesg(0, 0, 1, opt.debug, "Stored %s: %llu chunks, %llu new, %llu of %llu bytes added\n",
+				add_name, stats.chunks, stats.new_chunks, stats.new_bytes, stats.bytes);
+		if (fd != STDIN_FILENO)
+			close(fd);
+	} else {
+		fd = STDOUT_FILENO;
+		if (opt.target && strcmp(opt.target, "-")) {
+			fd = open(opt.target, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+			if (fd == -1)
+				log_mesg(0, 1, 1, opt.debug, "repository: Can't open file(%s)\n", opt.target);
+		}
+		ret = repo_extract(fd);
+		if (fd != STDOUT_FILENO && close(fd))
+			ret = -1;
+	}
+
+	close_log();
+	return ret ? 1 : 0;
+}
@@ -25,10 +25,33 @@
 #include <string.h>
 
 #include "partclone.h"
+#include "checksum.h"
 
 /// cmd_opt structure defined in partclone.h
 cmd_opt opt;
 
+#define OPT_REGIONS 1000
+
+/// number of log2 buckets in the extent length histogram
+#define HIST_BUCKETS 64
+
+static int show_stats   = 0;    /// print bitmap analytics
+static int json_output  = 0;    /// print everything as JSON on stdout
+static int stats_regions = 16;  /// number of equal regions for the usage map
+
+/// bitmap analytics, gathered by scan_bitmap_stats()
+typedef struct {
+	unsigned long long used;            /// used blocks counted in bitmap
+	unsigned long long extents;         /// runs of used blocks
+	unsigned long long free_extents;    /// runs of free blocks
+	unsigned long long largest_extent;  /// longest used run, in blocks
+	unsigned long long largest_gap;     /// longest free run, in blocks
+	unsigned long long largest_gap_start;
+	unsigned long long seeks;           /// discontinuities a restore has to seek over
+	unsigned long long hist[HIST_BUCKETS];
+	unsigned long long *region_used;    /// used blocks per region
+} bitmap_stats;
+
 void info_usage(void) {
 	fprintf(stderr, "partclone v%s http://partclone.org\n"
 	                "Usage: partclone.info [FILE]\n"
@@ -38,6 +61,9 @@ void info_usage(void) {
 		"    -L,  --logfile FILE     Log FILE\n"
 		"    -dX, --debug=X          Set the debug level to X = [0|1|2]\n"
 		"    -q,  --quiet            Disable progress message\n"
+		"    -S,  --stats            Show extent and fragmentation statistics\n"
+		"    -j,  --json             Print image information and statistics as JSON\n"
+		"    --regions=N             Split the usage map into N regions (default 16)\n"
 		"    -v,  --version          Display partclone version\n"
 		"    -h,  --help             Display this help\n"
 		, VERSION);
@@ -47,7 +73,7 @@ void info_usage(void) {
 
 void info_options (int argc, char **argv){
 
-    static const char *sopt = "-hvqd::L:s:";
+    static const char *sopt = "-hvqd::L:s:Sj";
     static const struct option lopt[] = {
 	{ "help",	no_argument,	    NULL,   'h' },
 	{ "print_version",  no_argument,	NULL,   'v' },
@@ -55,6 +81,9 @@ void info_options (int argc, char **argv){
 	{ "debug",	optional_argument,  NULL,   'd' },
 	{ "logfile",	    required_argument,	NULL,   'L' },
 	{ "quiet",              no_argument,            NULL,   'q' },
+	{ "stats",              no_argument,            NULL,   'S' },
+	{ "json",               no_argument,            NULL,   'j' },
+	{ "regions",            required_argument,      NULL,   OPT_REGIONS },
 	{ NULL,			0,			NULL,    0  }
     };
 	int c;
@@ -93,6 +122,20 @@ void info_options (int argc, char **argv){
 	    case 'L':
 		opt.logfile = optarg;
 		break;
+	    case 'S':
+		show_stats = 1;
+		break;
+	    case 'j':
+		json_output = 1;
+		show_stats = 1;
+		break;
+	    case OPT_REGIONS:
+		stats_regions = atoi(optarg);
+		if (stats_regions <= 0) {
+		    fprintf(stderr, "Invalid number of regions '%s'.\n", optarg);
+		    info_usage();
+		}
+		break;
 	    default:
 		fprintf(stderr, "Unknown option '%s'.\n", argv[optind-1]);
 		info_usage();
@@ -104,6 +147,147 @@ void info_options (int argc, char **argv){
 
 }
 
+/**
+ * walk the bitmap one run at a time; pc_find_next_bit() skips whole
+ * words, so the cost follows the number of runs rather than the
+ * number of blocks
+ */
+static void scan_bitmap_stats(unsigned long *bitmap, unsigned long long total, bitmap_stats *st) {
+
+	unsigned long long pos = 0, start, end, len, r_begin, r_end, region;
+	int bucket;
+
+	memset(st->hist, 0, sizeof(st->hist));
+	st->used = st->extents = st->free_extents = 0;
+	st->largest_extent = st->largest_gap = st->largest_gap_start = st->seeks = 0;
+	memset(st->region_used, 0, sizeof(unsigned long long) * stats_regions);
+
+	while (pos < total) {
+		start = pc_find_next_bit(bitmap, total, pos, 1);
+		if (start > pos) {
+			/// free run [pos, start)
+			st->free_extents++;
+			if (start - pos > st->largest_gap) {
+				st->largest_gap = start - pos;
+				st->largest_gap_start = pos;
+			}
+		}
+		if (start >= total)
+			break;
+		end = pc_find_next_bit(bitmap, total, start, 0);
+		len = end - start;
+
+		st->extents++;
+		st->used += len;
+		if (len > st->largest_extent)
+			st->largest_extent = len;
+		bucket = 63 - __builtin_clzll(len);
+		st->hist[bucket]++;
+		if (start > 0)
+			st->seeks++;
+
+		/// split the run over the regions it covers
+		for (r_begin = start; r_begin < end; r_begin = r_end) {
+			region = r_begin * stats_regions / total;
+			r_end = (region + 1) * total / stats_regions;
+			/// integer rounding can leave r_end at or behind r_begin
+			while (r_end <= r_begin)
+				r_end = (++region + 1) * total / stats_regions;
+			if (r_end > end)
+				r_end = end;
+			st->region_used[region] += r_end - r_begin;
+		}
+		pos = end;
+	}
+}
+
+/// print bitmap analytics as text
+static void print_bitmap_stats(file_system_info fs_info, bitmap_stats *st) {
+
+	int debug = opt.debug;
+	unsigned int block_s = fs_info.block_size;
+	unsigned long long total = fs_info.totalblock;
+	unsigned long long r_begin, r_end;
+	char size_str[11];
+	char end_str[11];
+	int i;
+
+	log_mesg(0, 0, 1, debug, "Used extents:    %llu\n", st->extents);
+	log_mesg(0, 0, 1, debug, "Free extents:    %llu\n", st->free_extents);
+	print_readable_size_str(st->largest_extent * block_s, size_str);
+	log_mesg(0, 0, 1, debug, "Largest extent:  %s = %llu Blocks\n", size_str, st->largest_extent);
+	print_readable_size_str(st->largest_gap * block_s, size_str);
+	log_mesg(0, 0, 1, debug, "Largest gap:     %s = %llu Blocks at block %llu\n", size_str, st->largest_gap, st->largest_gap_start);
+	log_mesg(0, 0, 1, debug, "Restore seeks:   %llu\n", st->seeks);
+	if (st->used != fs_info.usedblocks)
+		log_mesg(0, 0, 1, debug, "Bitmap counts %llu used blocks, header says %llu\n", st->used, fs_info.usedblocks);
+
+	log_mesg(0, 0, 1, debug, "\nExtent length histogram (blocks):\n");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!st->hist[i])
+			continue;
+		log_mesg(0, 0, 1, debug, "  %20llu - %-20llu %llu\n", 1ULL << i, (i == 63) ? ~0ULL : (2ULL << i) - 1, st->hist[i]);
+	}
+
+	log_mesg(0, 0, 1, debug, "\nUsage by region:\n");
+	for (i = 0; i < stats_regions; i++) {
+		r_begin = (unsigned long long)i * total / stats_regions;
+		r_end = (unsigned long long)(i + 1) * total / stats_regions;
+		print_readable_size_str(r_begin * block_s, size_str);
+		print_readable_size_str(r_end * block_s, end_str);
+		log_mesg(0, 0, 1, debug, "  %10s - %10s  %5.1f%%  %llu Blocks\n", size_str, end_str,
+			(r_end > r_begin) ? 100.0 * st->region_used[i] / (r_end - r_begin) : 0.0, st->region_used[i]);
+	}
+}
+
+/// print image information and bitmap analytics as one JSON object on stdout
+static void print_json(image_head_v2 img_head, file_system_info fs_info, image_options img_opt, bitmap_stats *st) {
+
+	unsigned long long total = fs_info.totalblock;
+	unsigned int block_s = fs_info.block_size;
+	int i, first = 1;
+
+	printf("{\n");
+	printf("  \"file_system\": \"%.*s\",\n", FS_MAGIC_SIZE, fs_info.fs);
+	printf("  \"block_size\": %u,\n", block_s);
+	printf("  \"total_blocks\": %llu,\n", total);
+	printf("  \"used_blocks\": %llu,\n", fs_info.usedblocks);
+	printf("  \"device_size\": %llu,\n", fs_info.device_size);
+	printf("  \"image_version\": \"%04d\",\n", img_opt.image_version);
+	if (img_opt.image_version != 0x0001)
+		printf("  \"partclone_version\": \"%.*s\",\n", PARTCLONE_VERSION_SIZE, img_head.ptc_version);
+	printf("  \"checksum\": \"%s\",\n", get_checksum_str(img_opt.checksum_mode));
+	printf("  \"checksum_size\": %u,\n", img_opt.checksum_size);
+	printf("  \"blocks_per_checksum\": %u,\n", img_opt.blocks_per_checksum);
+	printf("  \"stats\": {\n");
+	printf("    \"bitmap_used_blocks\": %llu,\n", st->used);
+	printf("    \"extents\": %llu,\n", st->extents);
+	printf("    \"free_extents\": %llu,\n", st->free_extents);
+	printf("    \"largest_extent\": %llu,\n", st->largest_extent);
+	printf("    \"largest_gap\": %llu,\n", st->largest_gap);
+	printf("    \"largest_gap_start\": %llu,\n", st->largest_gap_start);
+	printf("    \"restore_seeks\": %llu,\n", st->seeks);
+	printf("    \"extent_histogram\": [");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!st->hist[i])
+			continue;
+		printf("%s\n      { \"min_blocks\": %llu, \"count\": %llu }", first ? "" : ",", 1ULL << i, st->hist[i]);
+		first = 0;
+	}
+	printf("%s],\n", first ? "" : "\n    ");
+	printf("    \"regions\": [");
+	for (i = 0; i < stats_regions; i++) {
+		printf("%s\n      { \"start_block\": %llu, \"end_block\": %llu, \"used_blocks\": %llu, \"used_bytes\": %llu }",
+			i ? "," : "",
+			(unsigned long long)i * total / stats_regions,
+			(unsigned long long)(i + 1) * total / stats_regions,
+			st->region_used[i], st->region_used[i] * block_s);
+	}
+	printf("\n    ]\n");
+	printf("  }\n");
+	printf("}\n");
+}
+
 /**
  * main functiom - print Image file metadata.
  */
@@ -114,6 +298,7 @@ int main(int argc, char **argv){
 	image_head_v2    img_head;
 	file_system_info fs_info;
 	image_options    img_opt;
+	bitmap_stats     stats;
 
     if (argc == 2){
 	memset(&opt, 0, sizeof(cmd_opt));
@@ -158,9 +343,27 @@ int main(int argc, char **argv){
     log_mesg(0, 0, 0, opt.debug, "check main bitmap pointer %p\n", bitmap);
     log_mesg(0, 0, 0, opt.debug, "print image information\n");
 
-    print_file_system_info(fs_info, opt);
-    log_mesg(0, 0, 1, opt.debug, "\n");
-    print_image_info(img_head, img_opt, opt);
+    if (show_stats) {
+	stats.region_used = calloc(stats_regions, sizeof(unsigned long long));
+	if (stats.region_used == NULL)
+	    log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	scan_bitmap_stats(bitmap, fs_info.totalblock, &stats);
+    }
+
+    if (json_output) {
+	print_json(img_head, fs_info, img_opt, &stats);
+    } else {
+	print_file_system_info(fs_info, opt);
+	log_mesg(0, 0, 1, opt.debug, "\n");
+	print_image_info(img_head, img_opt, opt);
+	if (show_stats) {
+	    log_mesg(0, 0, 1, opt.debug, "\n");
+	    print_bitmap_stats(fs_info, &stats);
+	}
+    }
+
+    if (show_stats)
+	free(stats.region_used);
 
     close(dfr);     /// close source
     free(bitmap);   /// free bitmap
@@ -0,0 +1,97 @@
+/**
+ * iolimit.c - Part of Partclone project.
+ *
+ * limit the read and write rates and set the I/O priority
+ *
+ * Reads and writes have their own token bucket, filled at the rate given
+ * and holding a second of data, so one bucket refills while a serial copy
+ * loop sleeps on the other. A request larger than the tokens left is let
+ * through at once and the caller sleeps for the debt, so the requests
+ * keep their size and the device its queue depth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "partclone.h"
+#include "iolimit.h"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+typedef struct {
+	unsigned long long rate;   /// bytes per second, 0 for no limit
+	double tokens;             /// bytes that may go now, negative when in debt
+	struct timespec last;      /// last refill
+	pthread_mutex_t lock;
+} token_bucket;
+
+static token_bucket buckets[2] = {
+	{ 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER },  /// read
+	{ 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER },  /// write
+};
+
+static void bucket_init(token_bucket *b, unsigned long long rate) {
+	b->rate = rate;
+	b->tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+void io_limit_init(struct cmd_opt *opt) {
+
+	bucket_init(&buckets[0], opt->max_read_rate);
+	bucket_init(&buckets[1], opt->max_write_rate);
+	if (opt->max_read_rate)
+		log_mesg(1, 0, 0, opt->debug, "read rate limited to %llu bytes/s\n", opt->max_read_rate);
+	if (opt->max_write_rate)
+		log_mesg(1, 0, 0, opt->debug, "write rate limited to %llu bytes/s\n", opt->max_write_rate);
+
+	/// threads started later inherit the priority
+	if (opt->ioprio_class != IOPRIO_CLASS_NONE) {
+		int prio = (opt->ioprio_class << IOPRIO_CLASS_SHIFT) | opt->ioprio_level;
+
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) == -1)
+			log_mesg(0, 0, 1, opt->debug, "Can't set the I/O priority: %s\n", strerror(errno));
+		else
+			log_mesg(1, 0, 0, opt->debug, "I/O priority class %i level %i\n", opt->ioprio_class, opt->ioprio_level);
+	}
+}
+
+void io_limit(int do_write, unsigned long long bytes) {
+	token_bucket *b = &buckets[do_write ? 1 : 0];
+	struct timespec now, wait;
+	double burst, debt;
+
+	if (b->rate == 0)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->tokens += ((now.tv_sec - b->last.tv_sec) + (now.tv_nsec - b->last.tv_nsec) / 1e9) * b->rate;
+	b->last = now;
+	burst = b->rate;
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->tokens -= bytes;
+	debt = b->tokens < 0 ? -b->tokens / b->rate : 0;
+	pthread_mutex_unlock(&b->lock);
+
+	if (debt > 0) {
+		wait.tv_sec = (time_t)debt;
+		wait.tv_nsec = (long)((debt - wait.tv_sec) * 1e9);
+		while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+	}
+}
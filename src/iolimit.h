@@ -0,0 +1,27 @@
+/**
+ * iolimit.h - Part of Partclone project.
+ *
+ * limit the read and write rates and set the I/O priority
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef IOLIMIT_H_
+#define IOLIMIT_H_
+
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_RT   1
+#define IOPRIO_CLASS_BE   2
+#define IOPRIO_CLASS_IDLE 3
+
+struct cmd_opt;
+
+// set up the rate limits and the I/O priority of the options, before any thread starts
+void io_limit_init(struct cmd_opt *opt);
+// wait until bytes may be read or written
+void io_limit(int do_write, unsigned long long bytes);
+
+#endif /* IOLIMIT_H_ */
@@ -50,9 +50,9 @@
 void *thread_update_pui(void *arg);
 /// progress_bar structure defined in progress.h
 progress_bar prog;
+/// position of the copy loop, written by the main thread only, see progress.h
 unsigned long long copied;
 unsigned long long block_id;
-int done;
 
 #include "partclone.h"
 
@@ -60,6 +60,15 @@ int done;
 cmd_opt opt;
 
 #include "checksum.h"
+#include "verify.h"
+#include "compare.h"
+#include "bitmapfile.h"
+#include "bufpool.h"
+#include "writeback.h"
+#include "iolimit.h"
+#include "volset.h"
+#include "faultio.h"
+#include "metadata.h"
 
 /// fs option
 #include "fs_common.h"
@@ -83,6 +92,9 @@ int main(int argc, char **argv) {
 	int			start;
 	unsigned long long      stop;		/// start, range, stop number for progress bar
 	unsigned long *bitmap = NULL;		/// the point for bitmap data
+	unsigned long *img_bitmap = NULL;	/// bitmap of the image in compare mode
+	unsigned long *metadata = NULL;		/// metadata blocks of --metadata-first
+	unsigned long *bad_blocks = NULL;	/// blocks known bad to the file system, not read
 	int			debug = 0;		/// debug level
 	int			tui = 0;		/// text user interface
 	int			pui = 0;		/// progress mode(default text)
@@ -92,7 +104,6 @@ int main(int argc, char **argv) {
 	pthread_t		prog_thread;
 	void			*p_result;
 	struct stat st_dev;
-        int                     ret = 0;
         time_t                  now = time(&now);
 
 	static const char *const bad_sectors_warning_msg =
@@ -108,6 +119,8 @@ int main(int argc, char **argv) {
 	image_options    img_opt;
 
 	int target_stdout = 0;
+	verify_log vlog;   /// written extents for --verify
+	writeback_ctl wb;  /// --writeback-window
 
 	init_fs_info(&fs_info);
 	init_image_options(&img_opt);
@@ -126,9 +139,12 @@ int main(int argc, char **argv) {
 	debug = opt.debug;
 	fs_opt.debug = debug;
 	fs_opt.ignore_fschk = opt.ignore_fschk;
+	fs_opt.skip_unused_itable = opt.skip_unused_itable;
+	fs_opt.skip_clean_journal = opt.skip_clean_journal;
 
 	//if(opt.debug)
 	open_log(opt.logfile);
+	log_set_options(&opt);
 
         struct tm *ptm = gmtime(&now);
         log_mesg(1, 0, 0, debug, "Partclone log start at UTC %s", asctime(ptm));
@@ -146,6 +162,7 @@ int main(int argc, char **argv) {
 	if ((opt.ncurses) && (!tui)) {
 		opt.ncurses = 0;
 		pui = TEXT;
+		log_set_options(&opt);
 		log_mesg(1, 0, 0, debug, "Open Ncurses User Interface Error.\n");
 	}
 
@@ -163,6 +180,10 @@ int main(int argc, char **argv) {
 	if (opt.ignore_crc)
 		log_mesg(1, 0, 1, debug, "Ignore CRC errors\n");
 
+	/// rate limits and I/O priority
+	io_limit_init(&opt);
+	fault_init(&opt);
+
 	/**
 	 * open source and target
 	 * clone mode, source is device and target is image file/stdout
@@ -172,24 +193,43 @@ int main(int argc, char **argv) {
 	source = opt.source;
 	target = opt.target;
 	log_mesg(1, 0, 0, debug, "source=%s, target=%s \n", source, target);
-	dfr = open_source(source, &opt);
+	if (opt.restore && volset_wanted(&opt))
+		dfr = volset_open_read(source, &opt);
+	else
+		dfr = open_source(source, &opt);
 	if (dfr == -1) {
 		log_mesg(0, 1, 1, debug, "Error exit\n");
 	}
+	fault_register(dfr, FAULT_SOURCE);
 
 #ifndef CHKIMG
-	dfw = open_target(target, &opt);
+	if (opt.compare) {
+		/// the image to compare with is only read
+		if (strcmp(target, "-") == 0)
+			dfw = fileno(stdin);
+		else
+			dfw = open(target, O_RDONLY | O_LARGEFILE);
+		if (dfw == -1)
+			log_mesg(0, 1, 1, debug, "compare: open %s error\n", target);
+	} else if (opt.clone && volset_wanted(&opt))
+		dfw = volset_open_write(target, &opt);
+	else
+		dfw = open_target(target, &opt);
 	if (opt.blockfile == 0) {
 	    if (dfw == -1) {
 		log_mesg(0, 1, 1, debug, "Error exit\n");
 	    }
 	}
+	fault_register(dfw, FAULT_TARGET);
 	if (strcmp(target, "-") == 0) {
 		target_stdout = 1;
 	}
+	if (opt.verify)
+		verify_init(&vlog, opt.buffer_size);
 #else
 	dfw = -1;
 #endif
+	writeback_init(&wb, dfw, opt.writeback_window, debug);
 
 	/**
 	 * get partition information like super block, bitmap from device or image file.
@@ -202,6 +242,8 @@ int main(int argc, char **argv) {
 		img_opt.checksum_size = get_checksum_size(opt.checksum_mode, opt.debug);
 		img_opt.blocks_per_checksum = opt.blocks_per_checksum;
 		img_opt.reseed_checksum = opt.reseed_checksum;
+		if (opt.aligned)
+			img_opt.image_version = 0x0003;
 
 		cs_size = img_opt.checksum_size;
 		cs_reseed = img_opt.reseed_checksum;
@@ -235,16 +277,15 @@ int main(int argc, char **argv) {
 
 		/// read and check bitmap from partition
 		log_mesg(0, 0, 1, debug, "Calculating bitmap... Please wait... \n");
-		read_bitmap(source, fs_info, bitmap, pui);
+		read_bitmap_file(source, &fs_info, bitmap, pui, &opt);
 		update_used_blocks_count(&fs_info, bitmap);
 
 		/* skip check free space while torrent_only on */
-		if ((opt.check) && (opt.torrent_only == 0) && (!target_stdout)) {
+		if ((opt.check) && (opt.torrent_only == 0) && (!target_stdout) && !volset_wanted(&opt)) {
 
 			unsigned long long needed_space = 0;
 
-			needed_space += sizeof(image_head) + sizeof(file_system_info) + sizeof(image_options);
-			needed_space += get_bitmap_size_on_disk(&fs_info, &img_opt, &opt);
+			needed_space += get_image_data_offset(&fs_info, &img_opt, &opt);
 			needed_space += cnv_blocks_to_bytes(0, fs_info.usedblocks, fs_info.block_size, &img_opt);
 
 			check_free_space(target, needed_space);
@@ -256,6 +297,9 @@ int main(int argc, char **argv) {
 		if (opt.blockfile == 0) {
 			write_image_desc(&dfw, fs_info, img_opt, &opt);
 			write_image_bitmap(&dfw, fs_info, img_opt, bitmap, &opt);
+			if (img_opt.checksum_mode == CSM_AES256_GCM)
+				write_image_cipher(&dfw, fs_info, img_opt, bitmap, &opt);
+			write_image_padding(&dfw, fs_info, img_opt, &opt);
 		}
 
 		log_mesg(0, 0, 1, debug, "done!\n");
@@ -286,6 +330,14 @@ int main(int argc, char **argv) {
 		/// read and check bitmap from image file
 		log_mesg(0, 0, 1, debug, "Calculating bitmap... Please wait...\n");
 		load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
+		if (img_opt.checksum_mode == CSM_AES256_GCM)
+			load_image_cipher(&dfr, &img_head, fs_info, img_opt, bitmap, &opt);
+		load_image_padding(&dfr, fs_info, img_opt, &opt);
+
+		/// the data of an aligned image is read past the page cache, io_all falls back when refused
+		if (img_opt.image_version == 0x0003 && strcmp(opt.source, "-") != 0 && !volset_wanted(&opt) &&
+		    fcntl(dfr, F_SETFL, fcntl(dfr, F_GETFL) | O_DIRECT) == 0)
+			log_mesg(1, 0, 0, debug, "read the image with O_DIRECT\n");
 
 #ifndef CHKIMG
 		/// check the dest partition size.
@@ -328,7 +380,7 @@ int main(int argc, char **argv) {
 
 		/// read and check bitmap from partition
 		log_mesg(0, 0, 1, debug, "Calculating bitmap... Please wait... ");
-		read_bitmap(source, fs_info, bitmap, pui);
+		read_bitmap_file(source, &fs_info, bitmap, pui, &opt);
 
 		/// check the dest partition size.
 		if (opt.dd && opt.check && !target_stdout) {
@@ -400,8 +452,67 @@ int main(int argc, char **argv) {
 		log_mesg(2, 0, 0, debug, "check main bitmap pointer %p\n", bitmap);
 		log_mesg(0, 0, 1, debug, "done!\n");
     
+	} else if (opt.compare) {
+
+		image_head_v2 img_head;
+		file_system_info img_fs_info;
+
+		log_mesg(1, 0, 1, debug, "Reading Super Block\n");
+
+		/// get Super Block information from partition and image
+		read_super_blocks(source, &fs_info);
+		load_image_desc(&dfw, &opt, &img_head, &img_fs_info, &img_opt);
+		cs_size = img_opt.checksum_size;
+
+		if (img_opt.image_version < 0x0002)
+			log_mesg(0, 1, 1, debug, "Can't compare with an image of version 0001, restore it instead.\n");
+		if (img_fs_info.block_size != fs_info.block_size || img_fs_info.totalblock != fs_info.totalblock)
+			log_mesg(0, 1, 1, debug, "The image (%llu blocks of %u bytes) is not from a device of this size (%llu blocks of %u bytes)\n",
+				img_fs_info.totalblock, img_fs_info.block_size, fs_info.totalblock, fs_info.block_size);
+
+		check_mem_size(fs_info, img_opt, opt);
+
+		/// alloc a memory for both bitmaps
+		bitmap = pc_alloc_bitmap(fs_info.totalblock);
+		img_bitmap = pc_alloc_bitmap(fs_info.totalblock);
+		if (bitmap == NULL || img_bitmap == NULL) {
+			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+
+		log_mesg(0, 0, 1, debug, "Calculating bitmap... Please wait... ");
+		read_bitmap_file(source, &fs_info, bitmap, pui, &opt);
+		update_used_blocks_count(&fs_info, bitmap);
+		load_image_bitmap(&dfw, opt, img_fs_info, img_opt, img_bitmap);
+		if (img_opt.checksum_mode == CSM_AES256_GCM)
+			load_image_cipher(&dfw, &img_head, img_fs_info, img_opt, img_bitmap, &opt);
+		load_image_padding(&dfw, img_fs_info, img_opt, &opt);
+
+		log_mesg(0, 0, 1, debug, "done!\n");
+	}
+
+	/// the blocks the file system knows bad are copied as zeros and kept out of the domain
+	if (opt.clone || opt.dd || opt.domain) {
+		unsigned long long bad_count;
+
+		bad_blocks = pc_alloc_bitmap(fs_info.totalblock);
+		if (bad_blocks == NULL)
+			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		bad_count = read_bad_blocks(source, fs_info, bad_blocks);
+		if (bad_count) {
+			log_mesg(0, 0, 1, debug, "%llu blocks are known bad to the file system, they are not read\n", bad_count);
+		} else {
+			free(bad_blocks);
+			bad_blocks = NULL;
+		}
 	}
 
+	/// the blocks to copy or map first
+	if (opt.metadata_first)
+		metadata = metadata_read_bitmap(source, &fs_info, bitmap, bad_blocks, &opt);
+
+	/// the file system library is not needed anymore
+	fs_session_close();
+
 	log_mesg(1, 0, 0, debug, "print image information\n");
 
 	/// print option to log file
@@ -427,6 +538,8 @@ int main(int argc, char **argv) {
         if (opt.prog_second)
             strncpy(prog.time_unit, "sec", 4);
 	copied = 0;				/// initial number is 0
+	block_id = 0;
+	progress_start();
 
 	/**
 	 * thread to print progress
@@ -444,9 +557,11 @@ int main(int argc, char **argv) {
 		const unsigned long long blocks_total = fs_info.totalblock;
 		const unsigned int block_size = fs_info.block_size;
 		const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
+		const unsigned int cs_slot = get_checksum_slot(block_size, &img_opt);
 		unsigned char checksum[cs_size];
 		unsigned int blocks_in_cs, blocks_per_cs, write_size;
 		char *read_buffer = NULL, *write_buffer = NULL;
+		int image_fd = -1;	/// the image read back for the metadata copied first
 
 		// SHA1 for torrent info
 		FILE* tinfo = NULL;
@@ -458,17 +573,8 @@ int main(int argc, char **argv) {
 
 		write_size = cnv_blocks_to_bytes(0, buffer_capacity, block_size, &img_opt);
 
-                if (opt.read_direct_io == 1){
-                    ret = posix_memalign((void **)&read_buffer, BSIZE, (buffer_capacity * block_size));
-                    if ( ret < 0 ){
-                        log_mesg(0, 1, 1, debug, "%s, %i, memory for read posix_memalign error\n", __func__, __LINE__);
-                    }
-                    memset(read_buffer, 0, (buffer_capacity * block_size));
-                } else {
-                    read_buffer = (char*)malloc(buffer_capacity * block_size);
-                }
-                
-                write_buffer = (char*)malloc(write_size + cs_size);
+		read_buffer = io_buffer_alloc(buffer_capacity * block_size);
+		write_buffer = io_buffer_alloc(write_size + cs_slot);
 		
                 if (read_buffer == NULL || write_buffer == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
@@ -496,11 +602,19 @@ int main(int argc, char **argv) {
 			fprintf(tinfo, "blocks_total: %llu\n", blocks_total);
 		}
 
+		if (metadata) {
+			metadata_copy(&dfr, &dfw, metadata, bitmap, &fs_info, &img_opt, &opt);
+			image_fd = open(target, O_RDONLY | O_LARGEFILE);
+			if (image_fd == -1)
+				log_mesg(0, 1, 1, debug, "open %s to read the metadata back error: %s\n", target, strerror(errno));
+		}
+
 		block_id = 0;
 		do {
 			/// scan bitmap
-			unsigned long long i, blocks_skip, blocks_read;
+			unsigned long long i, run, blocks_skip, blocks_read;
 			unsigned int cs_added = 0, write_offset = 0;
+			int in_bad, in_metadata;
 			off_t offset;
 
 			/// skip unused blocks
@@ -514,51 +628,78 @@ int main(int argc, char **argv) {
 			if (blocks_skip)
 				block_id += blocks_skip;
 
-			/// read blocks
+			/// read blocks, the known bad ones apart, and the metadata ones with --metadata-first
+			in_bad = bad_blocks && pc_test_bit(block_id, bad_blocks, fs_info.totalblock);
+			in_metadata = metadata && pc_test_bit(block_id, metadata, fs_info.totalblock);
 			for (blocks_read = 0;
 			     block_id + blocks_read < blocks_total && blocks_read < buffer_capacity &&
-			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock);
+			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock) &&
+			     (!bad_blocks || pc_test_bit(block_id + blocks_read, bad_blocks, fs_info.totalblock) == in_bad) &&
+			     (!metadata || pc_test_bit(block_id + blocks_read, metadata, fs_info.totalblock) == in_metadata);
 			     ++blocks_read);
 			if (!blocks_read)
 				break;
 
 			offset = (off_t)(block_id * block_size);
-			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
-				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
-
-			r_size = read_all(&dfr, read_buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
-				if ((r_size == -1) && (errno == EIO)) {
-					if (opt.rescue) {
-						memset(read_buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, read_buffer + r_size, &opt);
+			if (in_bad) {
+				/// known bad to the file system, zeros instead of retries
+				memset(read_buffer, 0, blocks_read * block_size);
+				r_size = blocks_read * block_size;
+			} else if (in_metadata) {
+				/// already in the image, the source is not read twice
+				r_size = metadata_read_back(&image_fd, read_buffer, copied, blocks_read, &fs_info, &img_opt, &opt);
+				if (r_size != (int)(blocks_read * block_size))
+					log_mesg(0, 1, 1, debug, "metadata read back error: %s\n", strerror(errno));
+			} else {
+				if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+
+				r_size = read_all(&dfr, read_buffer, blocks_read * block_size, &opt);
+				if (r_size != (int)(blocks_read * block_size)) {
+					if ((r_size == -1) && (errno == EIO)) {
+						if (opt.rescue) {
+							memset(read_buffer, 0, blocks_read * block_size);
+							for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
+								rescue_sector(&dfr, offset + r_size, read_buffer + r_size, &opt);
+						} else
+							log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 					} else
-						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
-				} else
-					log_mesg(0, 1, 1, debug, "read error: %s\n", strerror(errno));
+						log_mesg(0, 1, 1, debug, "read error: %s\n", strerror(errno));
+				}
 			}
 
 			log_mesg(2, 0, 0, debug, "blocks_read = %i\n", blocks_read);
+			fs_patch_blocks(block_id, blocks_read, read_buffer);
 
-			/// calculate checksum
-			if (opt.blockfile == 0) {
-				for (i = 0; i < blocks_read; ++i) {
+			/// calculate checksum, a run of blocks up to the end of the chunk at a time
+			if (opt.blockfile == 0 && img_opt.checksum_mode == CSM_NONE) {
+				/// nothing to add, the blocks are written as they were read
+				write_offset = blocks_read * block_size;
+			} else if (opt.blockfile == 0) {
+				for (i = 0; i < blocks_read; i += run) {
+
+					run = blocks_read - i;
+					if (blocks_per_cs > 0 && run > blocks_per_cs - blocks_in_cs)
+						run = blocks_per_cs - blocks_in_cs;
 
 					memcpy(write_buffer + write_offset,
-						read_buffer + i * block_size, block_size);
+						read_buffer + i * block_size, run * block_size);
 
-					write_offset += block_size;
+					// encrypting checksums work in place on the copy
+					update_checksum(checksum, write_buffer + write_offset, run * block_size);
 
-					update_checksum(checksum, read_buffer + i * block_size, block_size);
+					write_offset += run * block_size;
+					blocks_in_cs += run;
 
-					if (blocks_per_cs > 0 && ++blocks_in_cs == blocks_per_cs) {
+					if (blocks_per_cs > 0 && blocks_in_cs == blocks_per_cs) {
+					    finish_checksum(checksum, NULL);
 					    log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
 
 						memcpy(write_buffer + write_offset, checksum, cs_size);
+						memset(write_buffer + write_offset + cs_size, 0, cs_slot - cs_size);
 
 						++cs_added;
-						write_offset += cs_size;
+						write_offset += cs_slot;
 
 						blocks_in_cs = 0;
 						if (cs_reseed)
@@ -587,7 +728,7 @@ int main(int argc, char **argv) {
 					w_size = write_block_file(target, read_buffer, blocks_read * block_size, block_id * block_size, &opt);
 				}
 			} else {
-				w_size = write_all(&dfw, write_buffer, write_offset, &opt);
+				w_size = write_all(&dfw, img_opt.checksum_mode == CSM_NONE ? read_buffer : write_buffer, write_offset, &opt);
 				if (w_size != write_offset)
 					log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
 			}
@@ -598,9 +739,10 @@ int main(int argc, char **argv) {
 
 			/// next block
 			block_id += blocks_read;
+			progress_publish(copied, block_id);
 
 			/// read or write error
-			if (r_size + cs_added * cs_size != w_size)
+			if (r_size + cs_added * cs_slot != w_size)
 				log_mesg(0, 1, 1, debug, "read(%i) and write(%i) different\n", r_size, w_size);
 
 		} while (1);
@@ -611,21 +753,26 @@ int main(int argc, char **argv) {
 			if (blocks_in_cs > 0) {
 
 				// Write the checksum for the latest blocks
+				finish_checksum(checksum, NULL);
 				log_mesg(1, 0, 0, debug, "Write the checksum for the latest blocks. size = %i\n", cs_size);
 				log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
-				w_size = write_all(&dfw, (char*)checksum, cs_size, &opt);
-				if (w_size != cs_size)
+				memcpy(write_buffer, checksum, cs_size);
+				memset(write_buffer + cs_size, 0, cs_slot - cs_size);
+				w_size = write_all(&dfw, write_buffer, cs_slot, &opt);
+				if (w_size != cs_slot)
 					log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
 			}
 		}
 
-		free(write_buffer);
-		free(read_buffer);
+		if (image_fd != -1)
+			close(image_fd);
+		io_buffer_free(write_buffer);
+		io_buffer_free(read_buffer);
 
 	// check only the size when the image does not contains checksums and does not
 	// comes from a pipe
 	} else if (opt.chkimg && img_opt.checksum_mode == CSM_NONE
-		&& strcmp(opt.source, "-") != 0) {
+		&& strcmp(opt.source, "-") != 0 && !volset_wanted(&opt)) {
 
 		unsigned long long total_offset = (fs_info.usedblocks - 1) * fs_info.block_size;
 		char last_block[fs_info.block_size];
@@ -651,12 +798,19 @@ int main(int argc, char **argv) {
 		const unsigned int block_size = fs_info.block_size;
 		const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
 		const unsigned int blocks_per_cs = img_opt.blocks_per_checksum;
+		const unsigned int cs_slot = get_checksum_slot(block_size, &img_opt);
+		const int cs_cipher = img_opt.checksum_mode == CSM_AES256_GCM;
+		/// the reads of an aligned image stop at the end of a strip, its blocks are written from the read buffer
+		const int in_place = img_opt.image_version == 0x0003 && blocks_per_cs >= buffer_capacity;
 		unsigned long long blocks_used = fs_info.usedblocks;
 		unsigned int blocks_in_cs, buffer_size, read_offset;
 		unsigned char checksum[cs_size];
 		char *read_buffer = NULL, *write_buffer = NULL;
 		char *empty_buffer = NULL;
-		unsigned long long blocks_used_fix = 0, test_block = 0;
+		unsigned long long blocks_used_fix = 0;
+#ifndef CHKIMG
+		unsigned long long range_first = 0, range_end = blocks_total;
+#endif
 
 		// SHA1 for torrent info
 		FILE *tinfo = NULL;
@@ -665,9 +819,7 @@ int main(int argc, char **argv) {
 		log_mesg(1, 0, 0, debug, "#\nBuffer capacity = %u, Blocks per cs = %u\n#\n", buffer_capacity, blocks_per_cs);
 
 		// fix some super block record incorrect
-		for (test_block = 0; test_block < blocks_total; ++test_block)
-			if (pc_test_bit(test_block, bitmap, fs_info.totalblock))
-				blocks_used_fix++;
+		blocks_used_fix = pc_count_bits(bitmap, 0, blocks_total);
 
 		if (blocks_used_fix != blocks_used) {
 			blocks_used = blocks_used_fix;
@@ -676,13 +828,13 @@ int main(int argc, char **argv) {
 		buffer_size = cnv_blocks_to_bytes(0, buffer_capacity, block_size, &img_opt);
 
 		if (img_opt.image_version != 0x0001)
-			read_buffer = (char*)malloc(buffer_size);
+			// one more checksum when the buffer does not start on a chunk boundary
+			read_buffer = io_buffer_alloc(buffer_size + cs_slot);
 		else {
 			// Allocate more memory in case the image is affected by the 64 bits bug
-			read_buffer = (char*)malloc(buffer_size + buffer_capacity * cs_size);
+			read_buffer = io_buffer_alloc(buffer_size + buffer_capacity * cs_size);
 		}
-		//write_buffer = (char*)malloc(buffer_capacity * block_size);
-		posix_memalign((void**)&write_buffer, BSIZE, buffer_capacity * block_size);
+		write_buffer = io_buffer_alloc(buffer_capacity * block_size);
 		if (read_buffer == NULL || write_buffer == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 		}
@@ -695,6 +847,7 @@ int main(int argc, char **argv) {
 			memset(empty_buffer, 0, block_size);
 		}
 
+		block_id = 0;
 #ifndef CHKIMG
 		/// seek to the first
 		if (opt.blockfile == 0) {
@@ -702,13 +855,66 @@ int main(int argc, char **argv) {
 			log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 		    }
 		}
+
+		/**
+		 * restore only [range_first, range_end). The rank of the bitmap at
+		 * range_first gives the position of its data in the image. Reading
+		 * starts at the beginning of that checksum chunk and ends at the end
+		 * of the last one, so all checksums are verified, but the blocks
+		 * outside the window are not written.
+		 */
+		if (opt.range) {
+		    unsigned long long rank_first, rank_end, start_rank, end_rank;
+
+		    range_first = opt.range_start_blocks ? opt.range_start : opt.range_start / block_size;
+		    if (opt.range_length == 0)
+			range_end = blocks_total;
+		    else if (opt.range_length_blocks)
+			range_end = range_first + opt.range_length;
+		    else {
+			unsigned long long start_byte = opt.range_start_blocks ? opt.range_start * block_size : opt.range_start;
+			range_end = (start_byte + opt.range_length + block_size - 1) / block_size;
+		    }
+		    if (range_end > blocks_total)
+			range_end = blocks_total;
+		    if (range_first >= range_end)
+			log_mesg(0, 1, 1, debug, "range is outside of the device (%llu blocks)\n", blocks_total);
+
+		    rank_first = pc_count_bits(bitmap, 0, range_first);
+		    rank_end = rank_first + pc_count_bits(bitmap, range_first, range_end);
+		    start_rank = rank_first;
+		    end_rank = rank_end;
+		    if (blocks_per_cs) {
+			if (!cs_reseed && !opt.ignore_crc)
+			    start_rank = 0;  /// the checksum runs over the whole image
+			start_rank -= start_rank % blocks_per_cs;
+			end_rank += (blocks_per_cs - end_rank % blocks_per_cs) % blocks_per_cs;
+			if (end_rank > blocks_used)
+			    end_rank = blocks_used;
+		    }
+
+		    log_mesg(1, 0, 0, debug, "range: blocks %llu-%llu, image blocks %llu-%llu\n", range_first, range_end, start_rank, end_rank);
+		    if (skip_source(&dfr, read_buffer, buffer_size,
+				start_rank * block_size + get_checksum_count(start_rank, &img_opt) * cs_slot, &opt) < 0)
+			log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+
+		    if (blocks_per_cs)
+			set_checksum_sequence(start_rank / blocks_per_cs);
+		    copied = start_rank;
+		    blocks_used = end_rank;
+		    block_id = pc_select_bit(bitmap, blocks_total, start_rank);
+		    if (block_id == blocks_total)
+			block_id = range_first;
+		    if (skip_blocks(&dfw, NULL, block_size, block_id, &opt, NULL) < 0)
+			log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+		}
 #endif
 
 		/// start restore image file to partition
 		log_mesg(1, 0, 0, debug, "start restore data...\n");
 
 		blocks_in_cs = 0;
-		if (!opt.ignore_crc)
+		if (!opt.ignore_crc || cs_cipher)
 			init_checksum(img_opt.checksum_mode, checksum, debug);
 
 		// init SHA1 for torrent info
@@ -722,14 +928,18 @@ int main(int argc, char **argv) {
 			fprintf(tinfo, "blocks_total: %llu\n", blocks_total);
 		}
 
-		block_id = 0;
 		do {
-			unsigned int i;
+			unsigned int i, run;
 			unsigned long long blocks_written, blocks_skip;
 			unsigned int read_size;
+#ifndef CHKIMG
+			char *blocks;
+#endif
 			// max chunk to read using one read(2) syscall
 			unsigned int blocks_read = copied + buffer_capacity < blocks_used ?
 				buffer_capacity : blocks_used - copied;
+			if (in_place && blocks_read > blocks_per_cs - copied % blocks_per_cs)
+			    blocks_read = blocks_per_cs - copied % blocks_per_cs;
 			if (!blocks_read)
 			    break;
 			if (blocks_read < 0)
@@ -739,11 +949,10 @@ int main(int argc, char **argv) {
 			read_size = cnv_blocks_to_bytes(copied, blocks_read, block_size, &img_opt);
 
 			// increase read_size to make room for the oversized checksum
-			if (blocks_per_cs && blocks_read < buffer_capacity &&
-					(blocks_read % blocks_per_cs) && (blocks_used % blocks_per_cs)) {
+			if (blocks_per_cs && copied + blocks_read == blocks_used && (blocks_used % blocks_per_cs)) {
 				/// it is the last read and there is a partial chunk at the end
 				log_mesg(1, 0, 0, debug, "# PARTIAL CHUNK\n");
-				read_size += cs_size;
+				read_size += cs_slot;
 			}
 
 			// read chunk from image
@@ -759,46 +968,56 @@ int main(int argc, char **argv) {
 			// write buffer should be the following:
 			// <block1><block2>...
 
+			/// a run of blocks up to the end of the chunk at a time
 			read_offset = 0;
-			for (i = 0; i < blocks_read; ++i) {
+			for (i = 0; i < blocks_read && img_opt.checksum_mode != CSM_NONE; i += run) {
 
-				memcpy(write_buffer + i * block_size,
-					read_buffer + read_offset, block_size);
+				run = blocks_read - i;
+				if (blocks_per_cs && run > blocks_per_cs - blocks_in_cs)
+					run = blocks_per_cs - blocks_in_cs;
 
-				if (opt.ignore_crc) {
-					read_offset += block_size;
-					if (++blocks_in_cs == blocks_per_cs){
-						read_offset += cs_size;
-                                                blocks_in_cs = 0;
-                                            }
-					continue;
-				}
+				// an encrypted image is decrypted in place, even without checking it
+				if (!opt.ignore_crc || cs_cipher)
+					update_checksum(checksum, read_buffer + read_offset, run * block_size);
+
+				if (!in_place)
+					memcpy(write_buffer + i * block_size,
+						read_buffer + read_offset, run * block_size);
 
-				update_checksum(checksum, read_buffer + read_offset, block_size);
+				read_offset += run * block_size;
+				blocks_in_cs += run;
 
-				if (++blocks_in_cs == blocks_per_cs) {
+				if (blocks_in_cs != blocks_per_cs)
+					continue;
 
+				if (opt.ignore_crc) {
+					if (cs_cipher)
+						init_checksum(img_opt.checksum_mode, checksum, debug);
+				} else {
 				    unsigned char checksum_orig[cs_size];
-				    memcpy(checksum_orig, read_buffer + read_offset + block_size, cs_size);
+				    finish_checksum(checksum, (unsigned char*)read_buffer + read_offset);
+				    memcpy(checksum_orig, read_buffer + read_offset, cs_size);
 				    log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
 				    log_mesg(3, 0, 0, debug, "CRC.orig = %x%x%x%x \n", checksum_orig[0], checksum_orig[1], checksum_orig[2], checksum_orig[3]);
-					if (memcmp(read_buffer + read_offset + block_size, checksum, cs_size)) {
-					    log_mesg(0, 1, 1, debug, "CRC error, block_id=%llu...\n ", block_id + i);
+					if (memcmp(read_buffer + read_offset, checksum, cs_size)) {
+					    log_mesg(0, 1, 1, debug, "CRC error, block_id=%llu...\n ", block_id + i + run - 1);
 					}
 
-					read_offset += cs_size;
-
-					blocks_in_cs = 0;
 					if (cs_reseed)
 						init_checksum(img_opt.checksum_mode, checksum, debug);
 				}
 
-				read_offset += block_size;
+				read_offset += cs_slot;
+				blocks_in_cs = 0;
 			}
-			if (!opt.ignore_crc && blocks_in_cs && blocks_per_cs && blocks_read < buffer_capacity &&
-					(blocks_read % blocks_per_cs)) {
+#ifndef CHKIMG
+			/// without checksums the image holds the blocks as they are written
+			blocks = img_opt.checksum_mode == CSM_NONE || in_place ? read_buffer : write_buffer;
+#endif
+			if (!opt.ignore_crc && blocks_in_cs && blocks_per_cs && copied + blocks_read == blocks_used) {
 
 			    log_mesg(1, 0, 0, debug, "check latest chunk's checksum covering %u blocks\n", blocks_in_cs);
+			    finish_checksum(checksum, (unsigned char*)read_buffer + read_offset);
 			    if (memcmp(read_buffer + read_offset, checksum, cs_size)){
 				unsigned char checksum_orig[cs_size];
 				memcpy(checksum_orig, read_buffer + read_offset, cs_size);
@@ -843,6 +1062,7 @@ int main(int argc, char **argv) {
 #ifndef CHKIMG
 				// write blocks
 				if (blocks_write > 0) {
+					unsigned long long w_expect = blocks_write * block_size;
 				        if (opt.blockfile == 1){
 					    // SHA1 for torrent info
 					    // Not always bigger or smaller than 16MB
@@ -854,23 +1074,47 @@ int main(int argc, char **argv) {
 					    torrent_start_offset(&torrent, block_id * block_size);
 					    torrent_end_length(&torrent, blocks_write * block_size);
 
-					    torrent_update(&torrent, write_buffer + blocks_written * block_size, blocks_write * block_size);
+					    torrent_update(&torrent, blocks + blocks_written * block_size, blocks_write * block_size);
 
 					    if (opt.torrent_only == 1) {
 						w_size = blocks_write * block_size;
 					    } else {
-					    	w_size = write_block_file(target, write_buffer + blocks_written * block_size,
+					    	w_size = write_block_file(target, blocks + blocks_written * block_size,
 							blocks_write * block_size, (block_id*block_size), &opt);
 					    }
 					}else{
-					    w_size = write_all(&dfw, write_buffer + blocks_written * block_size,
-						    blocks_write * block_size, &opt);
+					    /// clip the run to --range, the default range covers it all
+					    unsigned long long w_lo = block_id > range_first ? block_id : range_first;
+					    unsigned long long w_hi = block_id + blocks_write < range_end ? block_id + blocks_write : range_end;
+
+					    if (w_hi <= w_lo) {
+						/// out of the range, only move past it
+						w_expect = w_size = 0;
+						if (skip_blocks(&dfw, NULL, block_size, blocks_write, &opt, NULL) < 0)
+						    log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+					    } else {
+						w_expect = (w_hi - w_lo) * block_size;
+						if (skip_blocks(&dfw, NULL, block_size, w_lo - block_id, &opt, NULL) < 0)
+						    log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+						w_size = write_all(&dfw, blocks + (blocks_written + w_lo - block_id) * block_size,
+							w_expect, &opt);
+						if (opt.verify)
+						    verify_update(&vlog, opt.offset + w_lo * block_size,
+							    blocks + (blocks_written + w_lo - block_id) * block_size, w_expect);
+						writeback_update(&wb, opt.offset + w_lo * block_size, w_expect);
+						if (skip_blocks(&dfw, NULL, block_size, block_id + blocks_write - w_hi, &opt, NULL) < 0)
+						    log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+					    }
 					}
-					if (w_size != blocks_write * block_size) {
+					if (w_size != w_expect) {
 						if (!opt.skip_write_error)
 							log_mesg(0, 1, 1, debug, "write block %llu ERROR:%s\n", block_id + blocks_written, strerror(errno));
 						else
 							log_mesg(0, 0, 1, debug, "skip write block %llu error:%s\n", block_id + blocks_written, strerror(errno));
+						/// the failed write left the target anywhere in the run, go on after it
+						if (opt.blockfile == 0 && !target_stdout &&
+						    lseek(dfw, opt.offset + (off_t)((block_id + blocks_write) * block_size), SEEK_SET) == (off_t)-1)
+							log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 					}
 				}
 #endif
@@ -878,6 +1122,7 @@ int main(int argc, char **argv) {
 				blocks_written += blocks_write;
 				block_id += blocks_write;
 				copied += blocks_write;
+				progress_publish(copied, block_id);
 			} while (blocks_written < blocks_read);
 
 		} while(1);
@@ -887,8 +1132,8 @@ int main(int argc, char **argv) {
 			torrent_final(&torrent);
 		}
 
-		free(write_buffer);
-		free(read_buffer);
+		io_buffer_free(write_buffer);
+		io_buffer_free(read_buffer);
 		if (empty_buffer) {
 		    if (block_id < blocks_total && skip_blocks(&dfw, empty_buffer, block_size, blocks_total - block_id, &opt, &block_id) < 0) {
 			log_mesg(0, 0, 1, debug, "target seek ERROR:%s\n", strerror(errno));
@@ -917,15 +1162,7 @@ int main(int argc, char **argv) {
 		unsigned long long blocks_total = fs_info.totalblock;
 		int buffer_capacity = block_size < opt.buffer_size ? opt.buffer_size / block_size : 1;
 
-                if ((opt.read_direct_io == 1) || (opt.write_direct_io == 1)){
-                    ret = posix_memalign((void **)&buffer, BSIZE, (buffer_capacity * block_size));
-                    if ( ret < 0 ){
-                        log_mesg(0, 1, 1, debug, "%s, %i, memory for read posix_memalign error\n", __func__, __LINE__);
-                    }
-                    memset(buffer, 0, (buffer_capacity * block_size));
-                } else {
-                    buffer = (char*)malloc(buffer_capacity * block_size);
-                }
+		buffer = io_buffer_alloc(buffer_capacity * block_size);
 
 		if (buffer == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
@@ -954,6 +1191,7 @@ int main(int argc, char **argv) {
 		do {
 			/// scan bitmap
 			unsigned long long blocks_skip, blocks_read;
+			int in_bad;
 			off_t offset;
 
 			/// skip unused blocks
@@ -971,39 +1209,54 @@ int main(int argc, char **argv) {
 				}
 			}
 
-			/// read chunk from source
+			/// read chunk from source, the known bad blocks apart
+			in_bad = bad_blocks && pc_test_bit(block_id, bad_blocks, fs_info.totalblock);
 			for (blocks_read = 0;
 			     block_id + blocks_read < blocks_total && blocks_read < buffer_capacity &&
-			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock);
+			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock) &&
+			     (!bad_blocks || pc_test_bit(block_id + blocks_read, bad_blocks, fs_info.totalblock) == in_bad);
 			     ++blocks_read);
 
 			if (!blocks_read)
 				break;
 
 			offset = (off_t)(block_id * block_size);
-			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
-				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
-
-			r_size = read_all(&dfr, buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
-				if ((r_size == -1) && (errno == EIO)) {
-					if (opt.rescue) {
-						memset(buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, buffer + r_size, &opt);
+			if (in_bad) {
+				/// known bad to the file system, zeros instead of retries
+				memset(buffer, 0, blocks_read * block_size);
+				r_size = blocks_read * block_size;
+			} else {
+				if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+
+				r_size = read_all(&dfr, buffer, blocks_read * block_size, &opt);
+				if (r_size != (int)(blocks_read * block_size)) {
+					if ((r_size == -1) && (errno == EIO)) {
+						if (opt.rescue) {
+							memset(buffer, 0, blocks_read * block_size);
+							for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
+								rescue_sector(&dfr, offset + r_size, buffer + r_size, &opt);
+						} else
+							log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 					} else
-						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
-				} else
-					log_mesg(0, 1, 1, debug, "source read ERROR %s\n", strerror(errno));
+						log_mesg(0, 1, 1, debug, "source read ERROR %s\n", strerror(errno));
+				}
 			}
 
 			/// write buffer to target
 			w_size = write_all(&dfw, buffer, blocks_read * block_size, &opt);
+			if (opt.verify)
+				verify_update(&vlog, offset + opt.offset, buffer, blocks_read * block_size);
+			writeback_update(&wb, offset + opt.offset, blocks_read * block_size);
 			if (w_size != (int)(blocks_read * block_size)) {
 				if (opt.skip_write_error)
 					log_mesg(0, 0, 1, debug, "skip write block %lli error:%s\n", block_id, strerror(errno));
 				else
 					log_mesg(0, 1, 1, debug, "write block %lli ERROR:%s\n", block_id, strerror(errno));
+				/// the failed write left the target anywhere in the run, go on after it
+				if (!target_stdout &&
+				    lseek(dfw, opt.offset + offset + (off_t)(blocks_read * block_size), SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 			}
 
 			/// count copied block
@@ -1011,6 +1264,7 @@ int main(int argc, char **argv) {
 
 			/// next block
 			block_id += blocks_read;
+			progress_publish(copied, block_id);
 
 			/// read or write error
 			if (r_size != w_size) {
@@ -1021,7 +1275,7 @@ int main(int argc, char **argv) {
 			}
 		} while (1);
 
-		free(buffer);
+		io_buffer_free(buffer);
 		if (empty_buffer) {
 			if (block_id < blocks_total && skip_blocks(&dfw, empty_buffer, block_size, blocks_total - block_id, &opt, &block_id) < 0) {
 				log_mesg(0, 0, 1, debug, "write empty ERROR:%s\n", strerror(errno));
@@ -1044,29 +1298,37 @@ int main(int argc, char **argv) {
 
 		int cmp, nx_current = 0;
 		unsigned long long next_block_id = 0;
+		/// with --metadata-first only the metadata is in the domain, for a first ddrescue pass
+		unsigned long *domain = metadata ? metadata : bitmap;
 		log_mesg(0, 0, 0, debug, "Total block %i\n", fs_info.totalblock);
 		log_mesg(1, 0, 0, debug, "start writing domain log...\n");
 		// write domain log comment and status line
 		dprintf(dfw, "# Domain logfile created by %s v%s\n", get_exec_name(), VERSION);
 		dprintf(dfw, "# Source: %s\n", opt.source);
 		dprintf(dfw, "# Offset: 0x%08llX\n", (unsigned long long)opt.offset_domain);
+		if (metadata)
+			dprintf(dfw, "# Domain: file system metadata\n");
 		dprintf(dfw, "# current_pos  current_status\n");
 		dprintf(dfw, "0x%08llX     ?\n", opt.offset_domain + (fs_info.totalblock * fs_info.block_size));
 		dprintf(dfw, "#      pos        size  status\n");
-		// start logging the used/unused areas
-		cmp = pc_test_bit(0, bitmap, fs_info.totalblock);
+		// start logging the used/unused areas, and the known bad ones for ddrescue to leave alone
 		for (block_id = 0; block_id <= fs_info.totalblock; block_id++) {
-			if (block_id < fs_info.totalblock) {
-				nx_current = pc_test_bit(block_id, bitmap, fs_info.totalblock);
-				if (nx_current)
-					copied++;
-			} else
+			if (block_id == fs_info.totalblock)
 				nx_current = -1;
+			else if (bad_blocks && pc_test_bit(block_id, bad_blocks, fs_info.totalblock))
+				nx_current = '-';
+			else if (pc_test_bit(block_id, domain, fs_info.totalblock)) {
+				nx_current = '+';
+				copied++;
+			} else
+				nx_current = '?';
+			if (block_id == 0)
+				cmp = nx_current;
 			if (nx_current != cmp) {
 				dprintf(dfw, "0x%08llX  0x%08llX  %c\n",
 					opt.offset_domain + (next_block_id * fs_info.block_size),
 					(block_id - next_block_id) * fs_info.block_size,
-					cmp ? '+' : '?');
+					cmp);
 				next_block_id = block_id;
 				cmp = nx_current;
 			}
@@ -1082,15 +1344,7 @@ int main(int argc, char **argv) {
 		// SHA1 for torrent info
 		FILE *tinfo = NULL;
 		torrent_generator torrent;
-                if ((opt.read_direct_io == 1) || (opt.write_direct_io == 1)){
-                    ret = posix_memalign((void **)&buffer, BSIZE, (blocks_in_buffer * block_size));
-                    if ( ret < 0 ){
-                        log_mesg(0, 1, 1, debug, "%s, %i, memory for read posix_memalign error\n", __func__, __LINE__);
-                    }
-                    memset(buffer, 0, (blocks_in_buffer * block_size));
-                } else {
-                    buffer = (char*)malloc(blocks_in_buffer * block_size);
-                }
+		buffer = io_buffer_alloc(blocks_in_buffer * block_size);
 
 		if (buffer == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
@@ -1132,7 +1386,7 @@ int main(int argc, char **argv) {
                         assert(buffer != NULL);
 						memset(buffer, 0, blocks_read * block_size);
 						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, r_size, buffer + r_size, &opt);
+							rescue_sector(&dfr, copied * block_size + r_size, buffer + r_size, &opt);
 					} else
 						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 				} else if (r_size == 0){ // done for ddd
@@ -1157,6 +1411,9 @@ int main(int argc, char **argv) {
 					}
                                     } else {
                                         w_size = write_all(&dfw, buffer, rescue_write_size, &opt);
+                                        if (opt.verify)
+                                            verify_update(&vlog, copied * block_size, buffer, rescue_write_size);
+                                        writeback_update(&wb, copied * block_size, rescue_write_size);
                                     }
 				    break;
 				} else
@@ -1184,12 +1441,19 @@ int main(int argc, char **argv) {
 			    }
 			} else {
 			    w_size = write_all(&dfw, buffer, blocks_read * block_size, &opt);
+			    if (opt.verify)
+				verify_update(&vlog, copied * block_size, buffer, blocks_read * block_size);
+			    writeback_update(&wb, copied * block_size, blocks_read * block_size);
 			}
 			if (w_size != (int)(blocks_read * block_size)) {
 				if (opt.skip_write_error)
 					log_mesg(0, 0, 1, debug, "skip write block %lli error:%s\n", block_id, strerror(errno));
 				else
 					log_mesg(0, 1, 1, debug, "write block %lli ERROR:%s\n", block_id, strerror(errno));
+				/// the failed write left the target anywhere in the run, go on after it
+				if (opt.blockfile == 0 && !target_stdout &&
+				    lseek(dfw, (off_t)((copied + blocks_read) * block_size), SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 			}
 
 			/// count copied block
@@ -1197,6 +1461,7 @@ int main(int argc, char **argv) {
 
 			/// next block
 			block_id += blocks_read;
+			progress_publish(copied, block_id);
 
 			/// read or write error
 			if (r_size != w_size) {
@@ -1212,7 +1477,7 @@ int main(int argc, char **argv) {
 			torrent_final(&torrent);
 		}
 
-		free(buffer);
+		io_buffer_free(buffer);
 
 		/// restore_raw_file option
 		if (opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
@@ -1224,28 +1489,50 @@ int main(int argc, char **argv) {
 
 
 
+	} else if (opt.compare) {
+
+		if (compare_image(dfr, dfw, fs_info, img_opt, bitmap, img_bitmap, &opt))
+			log_mesg(0, 1, 1, debug, "The image does not match the device.\n");
 	}
 
-	done = 1;
+	progress_stop();
 	pres = pthread_join(prog_thread, &p_result);
 	if(pres)
 	    log_mesg(0, 1, 1, debug, "%s, %i, thread join error\n", __func__, __LINE__);
-	update_pui(&prog, copied, block_id, done);
+	update_pui(&prog, copied, block_id, 1);
 #ifndef CHKIMG
-	sync_data(dfw, &opt);
+	/// the volumes are synced by their threads when closed
+	if (opt.clone && volset_wanted(&opt)) {
+		if (volset_close(dfw))
+			log_mesg(0, 1, 1, debug, "volume: close error: %s\n", strerror(errno));
+		dfw = -1;
+	} else if (!opt.compare)
+		sync_data(dfw, &opt);
+	if (opt.verify) {
+		if (verify_target(&vlog, target, &opt))
+			log_mesg(0, 1, 1, debug, "The target does not match the written data.\n");
+		verify_free(&vlog);
+	}
 #endif
 	print_finish_info(opt);
 
 	/// close source
-	close(dfr);
+	if (opt.restore && volset_wanted(&opt))
+		volset_close(dfr);
+	else
+		close(dfr);
 	/// close target
 	if (dfw != -1)
 		close_target(dfw);
 	/// free bitmp
 	free(bitmap);
+	free(img_bitmap);
+	free(metadata);
+	free(bad_blocks);
+	io_buffer_pool_destroy();
 	close_pui(pui);
 #ifndef CHKIMG
-	fprintf(stderr, "Cloned successfully.\n");
+	fprintf(stderr, opt.compare ? "Compared successfully.\n" : "Cloned successfully.\n");
 #else
 	printf("Checked successfully.\n");
 #endif
@@ -1262,10 +1549,12 @@ int main(int argc, char **argv) {
 
 void *thread_update_pui(void *arg) {
 
-	while (!done) {
+	unsigned long long done_blocks, current;
+
+	do {
+		progress_peek(&done_blocks, &current);
 		if (!opt.quiet)
-			update_pui(&prog, copied, block_id, done);
-		sleep(opt.fresh);
-	}
+			update_pui(&prog, done_blocks, current, 0);
+	} while (!progress_wait(opt.fresh));
 	pthread_exit("exit");
 }
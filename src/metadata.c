@@ -0,0 +1,160 @@
+/**
+ * metadata.c - Part of Partclone project.
+ *
+ * copy the file system metadata before the data, for --metadata-first
+ *
+ * On a failing disk the super blocks, descriptors, allocation maps and inode
+ * tables are worth more than the data they describe. The module marks them
+ * with read_metadata_bitmap(), they are read first and written where they go
+ * in the image, then the clone loop copies the blocks in order as usual but
+ * takes the metadata back from the image, so the source is read once and
+ * the image is the same as without the option.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "partclone.h"
+#include "bufpool.h"
+#include "metadata.h"
+
+unsigned long* metadata_read_bitmap(char* device, file_system_info* fs_info, unsigned long* bitmap, unsigned long* bad, cmd_opt* opt) {
+
+	unsigned long long block, count = 0;
+	unsigned long* metadata = pc_alloc_bitmap(fs_info->totalblock);
+
+	if (metadata == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	if (!read_metadata_bitmap(device, *fs_info, metadata)) {
+		log_mesg(0, 0, 1, opt->debug, "The file system does not tell its metadata apart, --metadata-first is ignored\n");
+		free(metadata);
+		return NULL;
+	}
+
+	/// only the blocks going into the image and read from the device
+	for (block = 0; block < fs_info->totalblock; block++) {
+		if (!pc_test_bit(block, metadata, fs_info->totalblock))
+			continue;
+		if (pc_test_bit(block, bitmap, fs_info->totalblock) &&
+		    !(bad && pc_test_bit(block, bad, fs_info->totalblock)))
+			count++;
+		else
+			pc_clear_bit(block, metadata, fs_info->totalblock);
+	}
+	log_mesg(0, 0, 1, opt->debug, "%llu of the %llu used blocks are metadata\n", count, fs_info->usedblocks);
+
+	return metadata;
+}
+
+/// where the block of rank among the used blocks is in the image
+static unsigned long long image_offset(unsigned long long rank, const file_system_info* fs_info,
+	const image_options* img_opt, cmd_opt* opt) {
+
+	unsigned long long offset = get_image_data_offset(fs_info, img_opt, opt) + rank * fs_info->block_size;
+
+	if (img_opt->blocks_per_checksum)
+		offset += rank / img_opt->blocks_per_checksum * get_checksum_slot(fs_info->block_size, img_opt);
+	return offset;
+}
+
+/// blocks from rank before the next checksum of the image, at most count
+static unsigned long long image_run(unsigned long long rank, unsigned long long count, const image_options* img_opt) {
+
+	unsigned long long left;
+
+	if (!img_opt->blocks_per_checksum)
+		return count;
+	left = img_opt->blocks_per_checksum - rank % img_opt->blocks_per_checksum;
+	return count < left ? count : left;
+}
+
+void metadata_copy(int* dfr, int* dfw, unsigned long* metadata, unsigned long* bitmap,
+	const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	const unsigned long long total = fs_info->totalblock;
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int capacity = opt->buffer_size > block_size ? opt->buffer_size / block_size : 1;
+	unsigned long long block = 0, counted = 0, rank = 0, copied = 0, count, i, run, done;
+	off_t position;
+	char* buffer;
+	int r_size;
+
+	position = lseek(*dfw, 0, SEEK_CUR);
+	if (position == (off_t)-1)
+		log_mesg(0, 1, 1, opt->debug, "--metadata-first needs a seekable image: %s\n", strerror(errno));
+
+	buffer = io_buffer_alloc(capacity * block_size);
+	if (buffer == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	log_mesg(0, 0, 1, opt->debug, "Copying the metadata first...\n");
+	while ((block = pc_find_next_bit(metadata, total, block, 1)) < total) {
+
+		/// the used blocks before it take their place in the image first
+		for (; counted < block; counted++)
+			rank += pc_test_bit(counted, bitmap, total);
+
+		/// metadata blocks are used, a run of them is a run of ranks
+		for (count = 0; block + count < total && count < capacity &&
+		     pc_test_bit(block + count, metadata, total); count++);
+
+		if (lseek(*dfr, (off_t)(block * block_size), SEEK_SET) == (off_t)-1)
+			log_mesg(0, 1, 1, opt->debug, "source seek ERROR:%s\n", strerror(errno));
+		r_size = read_all(dfr, buffer, count * block_size, opt);
+		if (r_size != (int)(count * block_size)) {
+			if (r_size == -1 && errno == EIO && opt->rescue) {
+				memset(buffer, 0, count * block_size);
+				for (done = 0; done < count * block_size; done += PART_SECTOR_SIZE)
+					rescue_sector(dfr, block * block_size + done, buffer + done, opt);
+			} else
+				log_mesg(0, 1, 1, opt->debug, "metadata read error at block %llu: %s\n", block, strerror(errno));
+		}
+
+		for (i = 0; i < count; i += run) {
+			run = image_run(rank + i, count - i, img_opt);
+			if (lseek(*dfw, image_offset(rank + i, fs_info, img_opt, opt), SEEK_SET) == (off_t)-1)
+				log_mesg(0, 1, 1, opt->debug, "image seek ERROR:%s\n", strerror(errno));
+			if (write_all(dfw, buffer + i * block_size, run * block_size, opt) != (int)(run * block_size))
+				log_mesg(0, 1, 1, opt->debug, "image write ERROR:%s\n", strerror(errno));
+		}
+
+		block += count;
+		counted = block;
+		rank += count;
+		copied += count;
+	}
+
+	if (lseek(*dfw, position, SEEK_SET) == (off_t)-1)
+		log_mesg(0, 1, 1, opt->debug, "image seek ERROR:%s\n", strerror(errno));
+	io_buffer_free(buffer);
+	log_mesg(0, 0, 1, opt->debug, "%llu metadata blocks copied, now the data\n", copied);
+}
+
+int metadata_read_back(int* fd, char* buffer, unsigned long long rank, unsigned long long count,
+	const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	const unsigned int block_size = fs_info->block_size;
+	unsigned long long i, run;
+
+	for (i = 0; i < count; i += run) {
+		run = image_run(rank + i, count - i, img_opt);
+		if (lseek(*fd, image_offset(rank + i, fs_info, img_opt, opt), SEEK_SET) == (off_t)-1)
+			return -1;
+		if (read_all(fd, buffer + i * block_size, run * block_size, opt) != (int)(run * block_size))
+			return -1;
+	}
+	return count * block_size;
+}
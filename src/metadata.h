@@ -0,0 +1,39 @@
+/**
+ * metadata.h - Part of Partclone project.
+ *
+ * copy the file system metadata before the data, for --metadata-first
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef METADATA_H_
+#define METADATA_H_
+
+/**
+ * return a bitmap of the used blocks of bitmap holding metadata, from
+ * read_metadata_bitmap(), but the known bad ones of bad when not NULL.
+ * Returns NULL with a warning when the file system does not tell its
+ * metadata apart.
+ */
+unsigned long* metadata_read_bitmap(char* device, file_system_info* fs_info, unsigned long* bitmap, unsigned long* bad, cmd_opt* opt);
+
+/**
+ * read the metadata blocks from dfr and write them where they go in the
+ * image dfw, once its head is written. The position of dfw is left unchanged
+ * for the clone loop, which writes them again in order with the data.
+ */
+void metadata_copy(int* dfr, int* dfw, unsigned long* metadata, unsigned long* bitmap,
+	const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+
+/**
+ * read count blocks from the image fd, the ones of rank to rank + count - 1
+ * among the used blocks, written there by metadata_copy(). Returns the bytes
+ * read, or -1 on error.
+ */
+int metadata_read_back(int* fd, char* buffer, unsigned long long rank, unsigned long long count,
+	const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+
+#endif /* METADATA_H_ */
@@ -271,4 +271,15 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     fs_close();
 }
 
+/// the boot block, the super block, the maps and the inode table, all before the first zone
+int read_metadata_bitmap(char* device, file_system_info fs_info, unsigned long* metadata) {
+    unsigned long block;
+
+    fs_open(device);
+    for (block = 0; block < get_first_zone() && block < fs_info.totalblock; block++)
+	pc_set_bit(block, metadata, fs_info.totalblock);
+    fs_close();
+    return 1;
+}
+
 
@@ -0,0 +1,1007 @@
+/**
+ * nbdserver.c - Part of Partclone project.
+ *
+ * serve an image as a read only block device over the NBD protocol
+ *
+ * Only the fixed newstyle handshake is spoken, on a unix socket or TCP.
+ * The reads go through the strip cache, the unused blocks read as zero.
+ * With structured replies the holes are sent as NBD_REPLY_TYPE_OFFSET_HOLE
+ * and the base:allocation context answers NBD_CMD_BLOCK_STATUS from the
+ * bitmap, so a client copying the disk can skip them. Every client gets a
+ * thread, the cache is shared.
+ *
+ * With --overlay the disk is writable, the writes go to a copy-on-write
+ * overlay file (overlay.c) and the image is never changed.
+ *
+ * With --restore-to the overlay is the target device: the disk is served at
+ * once while a thread restores the image to the device in bitmap order.
+ * The clients' reads copy the blocks they need first, their writes go to
+ * the device and are never overwritten by the restore.
+ *
+ * The protocol is described in doc/proto.md of the nbd project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <endian.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "stripcache.h"
+#include "overlay.h"
+#include "repository.h"
+#include "iolimit.h"
+
+/// cmd_opt structure defined in partclone.h
+cmd_opt opt;
+
+#define OPT_KEY_FILE   1000
+#define OPT_CACHE_SIZE 1001
+#define OPT_OVERLAY    1002
+#define OPT_RESTORE_TO 1003
+#define OPT_REPOSITORY 1004
+#define OPT_MAX_READ_RATE 1005
+
+#define NBD_DEFAULT_PORT "10809"
+#define NBD_MAX_OPTION   4096               /// option data we accept
+#define NBD_MAX_REQUEST  (32 * 1024 * 1024)
+#define NBD_MAX_EXTENTS  1024               /// descriptors in a block status reply
+
+/// handshake
+#define NBD_MAGIC                  0x4e42444d41474943ULL   /// "NBDMAGIC"
+#define NBD_OPTS_MAGIC             0x49484156454f5054ULL   /// "IHAVEOPT"
+#define NBD_REP_MAGIC              0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE    (1 << 0)
+#define NBD_FLAG_NO_ZEROES         (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE  (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES       (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME        1
+#define NBD_OPT_ABORT              2
+#define NBD_OPT_LIST               3
+#define NBD_OPT_INFO               6
+#define NBD_OPT_GO                 7
+#define NBD_OPT_STRUCTURED_REPLY   8
+#define NBD_OPT_LIST_META_CONTEXT  9
+#define NBD_OPT_SET_META_CONTEXT   10
+
+#define NBD_REP_ACK                1
+#define NBD_REP_SERVER             2
+#define NBD_REP_INFO               3
+#define NBD_REP_META_CONTEXT       4
+#define NBD_REP_ERR_UNSUP          (0x80000000U | 1)
+#define NBD_REP_ERR_INVALID        (0x80000000U | 3)
+#define NBD_REP_ERR_UNKNOWN        (0x80000000U | 6)
+
+#define NBD_INFO_EXPORT            0
+#define NBD_INFO_BLOCK_SIZE        3
+
+/// transmission
+#define NBD_FLAG_HAS_FLAGS         (1 << 0)
+#define NBD_FLAG_READ_ONLY         (1 << 1)
+#define NBD_FLAG_SEND_FLUSH        (1 << 2)
+#define NBD_FLAG_SEND_FUA          (1 << 3)
+#define NBD_FLAG_SEND_TRIM         (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_SEND_DF           (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN    (1 << 8)
+
+#define NBD_REQUEST_MAGIC          0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC     0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_CMD_READ               0
+#define NBD_CMD_WRITE              1
+#define NBD_CMD_DISC               2
+#define NBD_CMD_FLUSH              3
+#define NBD_CMD_TRIM               4
+#define NBD_CMD_CACHE              5
+#define NBD_CMD_WRITE_ZEROES       6
+#define NBD_CMD_BLOCK_STATUS       7
+#define NBD_CMD_FLAG_FUA           (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE       (1 << 1)
+#define NBD_CMD_FLAG_DF            (1 << 2)
+#define NBD_CMD_FLAG_REQ_ONE       (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE        (1 << 0)
+#define NBD_REPLY_TYPE_NONE        0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR       (0x8000 | 1)
+
+#define NBD_STATE_HOLE             (1 << 0)
+#define NBD_STATE_ZERO             (1 << 1)
+
+#define NBD_META_ALLOCATION        "base:allocation"
+#define NBD_ALLOCATION_ID          1
+
+/// the errors of the protocol, not the local errno
+#define NBD_EPERM                  1
+#define NBD_EIO                    5
+#define NBD_EINVAL                 22
+#define NBD_ENOSPC                 28
+#define NBD_ENOTSUP                95
+
+typedef struct {
+	int fd;
+	int no_zeroes;
+	int structured;     /// NBD_OPT_STRUCTURED_REPLY was negotiated
+	int allocation;     /// the base:allocation context was selected
+	char *buffer;       /// NBD_MAX_REQUEST bytes
+} nbd_client;
+
+static strip_cache *cache;
+static overlay *ov = NULL;               /// the writes, NULL for a read only disk
+static const char *overlay_path = NULL;
+static const char *restore_path = NULL;
+static const char *repo_dir = NULL;      /// FILE names an image in this repository
+static pthread_t restore_tid;
+static volatile sig_atomic_t stop = 0;
+static unsigned long *bitmap;
+static file_system_info fs_info;
+static unsigned long long export_size;
+static const char *export_name = NULL;   /// NULL takes any name
+static const char *unix_path = NULL;
+static const char *bind_addr = NULL;
+static const char *port = NBD_DEFAULT_PORT;
+static unsigned long long cache_size = STRIP_CACHE_DEFAULT_SIZE;
+static int serve_once = 0;
+
+void nbd_usage(void) {
+	fprintf(stderr, "partclone v%s http://partclone.org\n"
+	                "Usage: partclone.nbd [OPTIONS] [FILE]\n"
+	                "Serve an image as a read only disk over NBD\n"
+	                "\n"
+		"    -s,  --source FILE      Source image FILE\n"
+		"    -u,  --unix PATH        Listen on the unix socket PATH\n"
+		"    -b,  --bind ADDR        Listen on the TCP address ADDR (default all)\n"
+		"    -p,  --port PORT        Listen on the TCP port PORT (default %s)\n"
+		"    -n,  --name NAME        Export NAME, any name is accepted by default\n"
+		"    -1,  --once             Exit after the first client\n"
+		"    --key-file FILE         Key file of an encrypted image\n"
+		"    --cache-size SIZE       MiB of image data kept in memory (default %llu)\n"
+		"    --overlay FILE          Make the disk writable, the writes go to FILE\n"
+		"    --restore-to DEVICE     Restore to DEVICE while the disk is served from it\n"
+		"    --repository DIR        FILE is the name of an image in the repository DIR\n"
+		"    --max-read-rate RATE    Read the image at most RATE bytes/s, k, m, g for KiB..GiB\n"
+		"    -L,  --logfile FILE     Log FILE\n"
+		"    -dX, --debug=X          Set the debug level to X = [0|1|2]\n"
+		"    -v,  --version          Display partclone version\n"
+		"    -h,  --help             Display this help\n"
+		, VERSION, NBD_DEFAULT_PORT, STRIP_CACHE_DEFAULT_SIZE / 1024 / 1024);
+	exit(1);
+}
+
+void nbd_options(int argc, char **argv) {
+
+	static const char *sopt = "-hvd::L:s:u:b:p:n:1";
+	static const struct option lopt[] = {
+		{ "help",       no_argument,        NULL,   'h' },
+		{ "version",    no_argument,        NULL,   'v' },
+		{ "source",     required_argument,  NULL,   's' },
+		{ "debug",      optional_argument,  NULL,   'd' },
+		{ "logfile",    required_argument,  NULL,   'L' },
+		{ "unix",       required_argument,  NULL,   'u' },
+		{ "bind",       required_argument,  NULL,   'b' },
+		{ "port",       required_argument,  NULL,   'p' },
+		{ "name",       required_argument,  NULL,   'n' },
+		{ "once",       no_argument,        NULL,   '1' },
+		{ "key-file",   required_argument,  NULL,   OPT_KEY_FILE },
+		{ "cache-size", required_argument,  NULL,   OPT_CACHE_SIZE },
+		{ "overlay",    required_argument,  NULL,   OPT_OVERLAY },
+		{ "restore-to", required_argument,  NULL,   OPT_RESTORE_TO },
+		{ "repository", required_argument,  NULL,   OPT_REPOSITORY },
+		{ "max-read-rate", required_argument, NULL, OPT_MAX_READ_RATE },
+		{ NULL,         0,                  NULL,    0  }
+	};
+	int c;
+
+	memset(&opt, 0, sizeof(cmd_opt));
+	opt.info = 1;
+	opt.logfile = "/var/log/partclone.log";
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			nbd_usage();
+			break;
+		case 'v':
+			print_version();
+			break;
+		case 's':
+		case 1:
+			opt.source = optarg;
+			break;
+		case 'd':
+			opt.debug = optarg ? atol(optarg) : 1;
+			break;
+		case 'L':
+			opt.logfile = optarg;
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'b':
+			bind_addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'n':
+			export_name = optarg;
+			break;
+		case '1':
+			serve_once = 1;
+			break;
+		case OPT_KEY_FILE:
+			opt.key_file = optarg;
+			break;
+		case OPT_CACHE_SIZE:
+			cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case OPT_OVERLAY:
+			overlay_path = optarg;
+			break;
+		case OPT_RESTORE_TO:
+			restore_path = optarg;
+			break;
+		case OPT_REPOSITORY:
+			repo_dir = optarg;
+			break;
+		case OPT_MAX_READ_RATE:
+		{
+			int in_blocks;
+			const char *end = parse_size(optarg, &opt.max_read_rate, &in_blocks);
+
+			if (end == NULL || *end != '\0' || in_blocks || opt.max_read_rate == 0) {
+				fprintf(stderr, "Bad rate '%s'.\n", optarg);
+				nbd_usage();
+			}
+			break;
+		}
+		default:
+			fprintf(stderr, "Unknown option '%s'.\n", argv[optind-1]);
+			nbd_usage();
+		}
+	}
+
+	if (opt.source == NULL)
+		nbd_usage();
+	if (overlay_path && restore_path) {
+		fprintf(stderr, "--overlay and --restore-to can't be used together.\n");
+		nbd_usage();
+	}
+}
+
+static int recv_all(int fd, void *buf, size_t size) {
+
+	char *p = buf;
+
+	while (size) {
+		ssize_t r = read(fd, p, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t size) {
+
+	const char *p = buf;
+
+	while (size) {
+		ssize_t r = write(fd, p, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static void put16(unsigned char **p, uint16_t v) { v = htobe16(v); memcpy(*p, &v, 2); *p += 2; }
+static void put32(unsigned char **p, uint32_t v) { v = htobe32(v); memcpy(*p, &v, 4); *p += 4; }
+static void put64(unsigned char **p, uint64_t v) { v = htobe64(v); memcpy(*p, &v, 8); *p += 8; }
+static uint16_t get16(const unsigned char *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static uint32_t get32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+/// the end of the run of used or unused bytes at offset, cut at end
+static unsigned long long next_extent(unsigned long long offset, unsigned long long end, int *hole) {
+
+	const unsigned int block_size = fs_info.block_size;
+	unsigned long long block = offset / block_size;
+	unsigned long long next;
+
+	if (ov)
+		return overlay_next_extent(ov, offset, end, hole);
+	if (block >= fs_info.totalblock) {
+		*hole = 1;
+		return end;
+	}
+	*hole = !pc_test_bit(block, bitmap, fs_info.totalblock);
+	next = pc_find_next_bit(bitmap, fs_info.totalblock, block, *hole);
+	if (next == fs_info.totalblock && *hole)
+		return end;
+	return next * block_size < end ? next * block_size : end;
+}
+
+static int disk_read(char *buf, size_t size, unsigned long long offset) {
+
+	return ov ? overlay_read(ov, buf, size, offset) : strip_cache_read(cache, buf, size, offset);
+}
+
+static int option_reply(nbd_client *c, uint32_t option, uint32_t type, const void *data, uint32_t length) {
+
+	unsigned char head[20], *p = head;
+
+	put64(&p, NBD_REP_MAGIC);
+	put32(&p, option);
+	put32(&p, type);
+	put32(&p, length);
+	if (send_all(c->fd, head, sizeof(head)))
+		return -1;
+	return length ? send_all(c->fd, data, length) : 0;
+}
+
+static int name_ok(const char *name, uint32_t length) {
+
+	return export_name == NULL || (strlen(export_name) == length && memcmp(export_name, name, length) == 0);
+}
+
+static uint16_t transmission_flags(nbd_client *c) {
+
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+
+	if (ov)
+		flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
+	else
+		flags |= NBD_FLAG_READ_ONLY;
+	if (c->structured)
+		flags |= NBD_FLAG_SEND_DF;
+	return flags;
+}
+
+/// NBD_OPT_INFO and NBD_OPT_GO, returns 1 to start the transmission
+static int option_info(nbd_client *c, uint32_t option, const unsigned char *data, uint32_t length) {
+
+	unsigned char info[18], *p;
+	uint32_t name_length;
+
+	if (length < 6 || (name_length = get32(data)) > length - 6 ||
+	    6 + name_length + 2 * get16(data + 4 + name_length) != length)
+		return option_reply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+	if (!name_ok((const char *)data + 4, name_length))
+		return option_reply(c, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+	p = info;
+	put16(&p, NBD_INFO_EXPORT);
+	put64(&p, export_size);
+	put16(&p, transmission_flags(c));
+	if (option_reply(c, option, NBD_REP_INFO, info, p - info))
+		return -1;
+
+	/// any size works, the block size is the one worth using
+	p = info;
+	put16(&p, NBD_INFO_BLOCK_SIZE);
+	put32(&p, 1);
+	put32(&p, fs_info.block_size);
+	put32(&p, NBD_MAX_REQUEST);
+	if (option_reply(c, option, NBD_REP_INFO, info, p - info))
+		return -1;
+
+	if (option_reply(c, option, NBD_REP_ACK, NULL, 0))
+		return -1;
+	return option == NBD_OPT_GO;
+}
+
+/// NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT
+static int option_meta_context(nbd_client *c, uint32_t option, const unsigned char *data, uint32_t length) {
+
+	const unsigned int name_size = sizeof(NBD_META_ALLOCATION) - 1;
+	unsigned char reply[4 + sizeof(NBD_META_ALLOCATION)], *p = reply;
+	uint32_t name_length, queries, i, offset;
+	int selected = 0;
+
+	if (!c->structured || length < 8 || (name_length = get32(data)) > length - 8)
+		return option_reply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+	if (!name_ok((const char *)data + 4, name_length))
+		return option_reply(c, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+	queries = get32(data + 4 + name_length);
+	offset = 8 + name_length;
+	for (i = 0; i < queries; i++) {
+		uint32_t query_length;
+
+		if (offset + 4 > length || (query_length = get32(data + offset)) > length - offset - 4)
+			return option_reply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+		offset += 4;
+		/// a list may ask for the whole namespace
+		if ((query_length == name_size && memcmp(data + offset, NBD_META_ALLOCATION, name_size) == 0) ||
+		    (option == NBD_OPT_LIST_META_CONTEXT && query_length == 5 && memcmp(data + offset, "base:", 5) == 0))
+			selected = 1;
+		offset += query_length;
+	}
+	if (option == NBD_OPT_LIST_META_CONTEXT && queries == 0)
+		selected = 1;
+	if (option == NBD_OPT_SET_META_CONTEXT)
+		c->allocation = selected;
+
+	if (selected) {
+		put32(&p, NBD_ALLOCATION_ID);
+		memcpy(p, NBD_META_ALLOCATION, name_size);
+		if (option_reply(c, option, NBD_REP_META_CONTEXT, reply, 4 + name_size))
+			return -1;
+	}
+	return option_reply(c, option, NBD_REP_ACK, NULL, 0);
+}
+
+/// the fixed newstyle handshake, returns 0 when the transmission starts
+static int nbd_handshake(nbd_client *c) {
+
+	unsigned char head[18], *p = head;
+	unsigned char *data = NULL;
+	uint32_t client_flags;
+	int ret = -1;
+
+	put64(&p, NBD_MAGIC);
+	put64(&p, NBD_OPTS_MAGIC);
+	put16(&p, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (send_all(c->fd, head, p - head) || recv_all(c->fd, head, 4))
+		return -1;
+	client_flags = get32(head);
+	if (!(client_flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+		log_mesg(1, 0, 0, opt.debug, "nbd: the client does not speak fixed newstyle\n");
+		return -1;
+	}
+	c->no_zeroes = client_flags & NBD_FLAG_C_NO_ZEROES;
+
+	data = malloc(NBD_MAX_OPTION);
+	if (data == NULL)
+		return -1;
+
+	while (ret < 0) {
+		uint32_t option, length;
+		int r;
+
+		if (recv_all(c->fd, head, 16) || get64(head) != NBD_OPTS_MAGIC)
+			break;
+		option = get32(head + 8);
+		length = get32(head + 12);
+		if (length > NBD_MAX_OPTION)
+			break;
+		if (recv_all(c->fd, data, length))
+			break;
+		log_mesg(2, 0, 0, opt.debug, "nbd: option %u, %u bytes\n", option, length);
+
+		switch (option) {
+		case NBD_OPT_EXPORT_NAME:
+		{
+			unsigned char reply[10 + 124];
+
+			if (!name_ok((const char *)data, length))
+				goto out;
+			memset(reply, 0, sizeof(reply));
+			p = reply;
+			put64(&p, export_size);
+			put16(&p, transmission_flags(c));
+			if (send_all(c->fd, reply, c->no_zeroes ? 10 : sizeof(reply)) == 0)
+				ret = 0;
+			goto out;
+		}
+		case NBD_OPT_ABORT:
+			option_reply(c, option, NBD_REP_ACK, NULL, 0);
+			goto out;
+		case NBD_OPT_LIST:
+		{
+			const char *name = export_name ? export_name : "";
+			unsigned char reply[4 + NBD_MAX_OPTION];
+			uint32_t name_length = strlen(name) < NBD_MAX_OPTION ? strlen(name) : NBD_MAX_OPTION;
+
+			p = reply;
+			put32(&p, name_length);
+			memcpy(p, name, name_length);
+			r = length ? option_reply(c, option, NBD_REP_ERR_INVALID, NULL, 0) :
+				option_reply(c, option, NBD_REP_SERVER, reply, 4 + name_length) ||
+				option_reply(c, option, NBD_REP_ACK, NULL, 0);
+			break;
+		}
+		case NBD_OPT_STRUCTURED_REPLY:
+			if (length) {
+				r = option_reply(c, option, NBD_REP_ERR_INVALID, NULL, 0);
+				break;
+			}
+			c->structured = 1;
+			r = option_reply(c, option, NBD_REP_ACK, NULL, 0);
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			r = option_info(c, option, data, length);
+			if (r == 1)
+				ret = 0;
+			break;
+		case NBD_OPT_LIST_META_CONTEXT:
+		case NBD_OPT_SET_META_CONTEXT:
+			r = option_meta_context(c, option, data, length);
+			break;
+		default:
+			r = option_reply(c, option, NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		}
+		if (r < 0)
+			break;
+	}
+
+out:
+	free(data);
+	return ret;
+}
+
+static int simple_reply(nbd_client *c, uint64_t cookie, uint32_t error, const char *data, uint32_t length) {
+
+	unsigned char head[16], *p = head;
+
+	put32(&p, NBD_SIMPLE_REPLY_MAGIC);
+	put32(&p, error);
+	put64(&p, cookie);
+	if (send_all(c->fd, head, sizeof(head)))
+		return -1;
+	return length ? send_all(c->fd, data, length) : 0;
+}
+
+/// the head of a structured reply chunk, the payload follows
+static int chunk_head(nbd_client *c, uint64_t cookie, uint16_t flags, uint16_t type, uint32_t length) {
+
+	unsigned char head[20], *p = head;
+
+	put32(&p, NBD_STRUCTURED_REPLY_MAGIC);
+	put16(&p, flags);
+	put16(&p, type);
+	put64(&p, cookie);
+	put32(&p, length);
+	return send_all(c->fd, head, sizeof(head));
+}
+
+static int error_reply(nbd_client *c, uint64_t cookie, uint32_t error) {
+
+	unsigned char payload[6], *p = payload;
+
+	if (!c->structured)
+		return simple_reply(c, cookie, error, NULL, 0);
+
+	put32(&p, error);
+	put16(&p, 0);
+	if (chunk_head(c, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, sizeof(payload)))
+		return -1;
+	return send_all(c->fd, payload, sizeof(payload));
+}
+
+static int done_reply(nbd_client *c, uint64_t cookie) {
+
+	if (!c->structured)
+		return simple_reply(c, cookie, 0, NULL, 0);
+	return chunk_head(c, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, 0);
+}
+
+static int nbd_read(nbd_client *c, uint64_t cookie, uint16_t flags, uint64_t offset, uint32_t length) {
+
+	unsigned long long pos, end = offset + length;
+	unsigned char head[12], *p;
+
+	/// one chunk or a simple reply, all the data
+	if (!c->structured || (flags & NBD_CMD_FLAG_DF)) {
+		if (disk_read(c->buffer, length, offset))
+			return error_reply(c, cookie, NBD_EIO);
+		if (!c->structured)
+			return simple_reply(c, cookie, 0, c->buffer, length);
+		p = head;
+		put64(&p, offset);
+		if (chunk_head(c, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, 8 + length) ||
+		    send_all(c->fd, head, 8))
+			return -1;
+		return send_all(c->fd, c->buffer, length);
+	}
+
+	/// a chunk per run, the holes without data
+	for (pos = offset; pos < end; ) {
+		int hole;
+		unsigned long long next = next_extent(pos, end, &hole);
+		uint16_t done = next == end ? NBD_REPLY_FLAG_DONE : 0;
+
+		p = head;
+		put64(&p, pos);
+		if (hole) {
+			put32(&p, next - pos);
+			if (chunk_head(c, cookie, done, NBD_REPLY_TYPE_OFFSET_HOLE, 12) || send_all(c->fd, head, 12))
+				return -1;
+		} else {
+			if (disk_read(c->buffer, next - pos, pos)) {
+				/// the chunks sent stand, the error ends the reply
+				unsigned char payload[6];
+
+				p = payload;
+				put32(&p, NBD_EIO);
+				put16(&p, 0);
+				if (chunk_head(c, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, sizeof(payload)))
+					return -1;
+				return send_all(c->fd, payload, sizeof(payload));
+			}
+			if (chunk_head(c, cookie, done, NBD_REPLY_TYPE_OFFSET_DATA, 8 + next - pos) ||
+			    send_all(c->fd, head, 8) || send_all(c->fd, c->buffer, next - pos))
+				return -1;
+		}
+		pos = next;
+	}
+	return 0;
+}
+
+static int nbd_block_status(nbd_client *c, uint64_t cookie, uint16_t flags, uint64_t offset, uint32_t length) {
+
+	unsigned char payload[4 + 8 * NBD_MAX_EXTENTS], *p = payload;
+	unsigned long long pos, end = offset + length;
+	unsigned int extents = 0, max = flags & NBD_CMD_FLAG_REQ_ONE ? 1 : NBD_MAX_EXTENTS;
+
+	if (!c->allocation)
+		return error_reply(c, cookie, NBD_EINVAL);
+
+	put32(&p, NBD_ALLOCATION_ID);
+	for (pos = offset; pos < end && extents < max; extents++) {
+		int hole;
+		unsigned long long next = next_extent(pos, end, &hole);
+
+		put32(&p, next - pos);
+		put32(&p, hole ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0);
+		pos = next;
+	}
+
+	if (chunk_head(c, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS, p - payload))
+		return -1;
+	return send_all(c->fd, payload, p - payload);
+}
+
+/// NBD_CMD_WRITE, NBD_CMD_TRIM and NBD_CMD_WRITE_ZEROES, buf is NULL for zeroes
+static int nbd_write(nbd_client *c, uint64_t cookie, uint16_t flags, const char *buf, uint64_t offset,
+	uint32_t length, int punch) {
+
+	int ret;
+
+	if (ov == NULL)
+		return error_reply(c, cookie, NBD_EPERM);
+
+	ret = overlay_write(ov, buf, length, offset, punch);
+	if (!ret && (flags & NBD_CMD_FLAG_FUA))
+		ret = overlay_flush(ov);
+	if (ret)
+		return error_reply(c, cookie, ret == -ENOSPC ? NBD_ENOSPC : NBD_EIO);
+	return done_reply(c, cookie);
+}
+
+static void nbd_transmission(nbd_client *c) {
+
+	unsigned char request[28];
+
+	while (recv_all(c->fd, request, sizeof(request)) == 0) {
+		uint16_t flags = get16(request + 4);
+		uint16_t type = get16(request + 6);
+		uint64_t cookie = get64(request + 8);
+		uint64_t offset = get64(request + 16);
+		uint32_t length = get32(request + 24);
+		int bad_range = offset > export_size || length > export_size - offset;
+		int r;
+
+		if (get32(request) != NBD_REQUEST_MAGIC)
+			break;
+		log_mesg(2, 0, 0, opt.debug, "nbd: command %u offset %llu length %u\n", type,
+			(unsigned long long)offset, length);
+
+		switch (type) {
+		case NBD_CMD_READ:
+			if (bad_range || length > NBD_MAX_REQUEST)
+				r = error_reply(c, cookie, NBD_EINVAL);
+			else
+				r = nbd_read(c, cookie, flags, offset, length);
+			break;
+		case NBD_CMD_DISC:
+			if (ov)
+				overlay_flush(ov);
+			return;
+		case NBD_CMD_WRITE:
+			/// the data follows, read it even when it is refused
+			if (length > NBD_MAX_REQUEST || recv_all(c->fd, c->buffer, length))
+				return;
+			if (bad_range)
+				r = error_reply(c, cookie, ov ? NBD_ENOSPC : NBD_EPERM);
+			else
+				r = nbd_write(c, cookie, flags, c->buffer, offset, length, 0);
+			break;
+		case NBD_CMD_TRIM:
+		case NBD_CMD_WRITE_ZEROES:
+			if (bad_range)
+				r = error_reply(c, cookie, ov ? NBD_ENOSPC : NBD_EPERM);
+			else
+				r = nbd_write(c, cookie, flags, NULL, offset, length,
+					type == NBD_CMD_TRIM || !(flags & NBD_CMD_FLAG_NO_HOLE));
+			break;
+		case NBD_CMD_FLUSH:
+			if (ov && overlay_flush(ov))
+				r = error_reply(c, cookie, NBD_EIO);
+			else
+				r = done_reply(c, cookie);
+			break;
+		case NBD_CMD_CACHE:
+			r = done_reply(c, cookie);
+			break;
+		case NBD_CMD_BLOCK_STATUS:
+			if (bad_range || !length)
+				r = error_reply(c, cookie, NBD_EINVAL);
+			else
+				r = nbd_block_status(c, cookie, flags, offset, length);
+			break;
+		default:
+			r = error_reply(c, cookie, NBD_ENOTSUP);
+			break;
+		}
+		if (r)
+			break;
+	}
+}
+
+static void *nbd_client_thread(void *arg) {
+
+	nbd_client *c = (nbd_client *)arg;
+
+	c->buffer = malloc(NBD_MAX_REQUEST);
+	if (c->buffer == NULL)
+		log_mesg(1, 0, 0, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	else if (nbd_handshake(c) == 0)
+		nbd_transmission(c);
+
+	log_mesg(1, 0, 0, opt.debug, "nbd: client %i closed\n", c->fd);
+	close(c->fd);
+	free(c->buffer);
+	free(c);
+	return NULL;
+}
+
+static int nbd_listen(void) {
+
+	int fd = -1, one = 1;
+
+	if (unix_path) {
+		struct sockaddr_un addr;
+
+		if (strlen(unix_path) >= sizeof(addr.sun_path))
+			log_mesg(0, 1, 1, opt.debug, "nbd: socket path too long: %s\n", unix_path);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, unix_path);
+		unlink(unix_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			log_mesg(0, 1, 1, opt.debug, "nbd: bind %s error: %s\n", unix_path, strerror(errno));
+	} else {
+		struct addrinfo hints, *res, *ai;
+		int err;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		err = getaddrinfo(bind_addr, port, &hints, &res);
+		if (err)
+			log_mesg(0, 1, 1, opt.debug, "nbd: %s:%s: %s\n", bind_addr ? bind_addr : "*", port, gai_strerror(err));
+		for (ai = res; ai; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd < 0)
+			log_mesg(0, 1, 1, opt.debug, "nbd: bind %s:%s error: %s\n", bind_addr ? bind_addr : "*", port, strerror(errno));
+	}
+
+	if (listen(fd, 16) < 0)
+		log_mesg(0, 1, 1, opt.debug, "nbd: listen error: %s\n", strerror(errno));
+	return fd;
+}
+
+/// the background restore, copies the image to the device in bitmap order
+static void *restore_thread(void *arg) {
+
+	const unsigned long long step = STRIP_CACHE_LINE_SIZE;
+	const unsigned long long total = overlay_left(ov);
+	unsigned long long offset, left = total, tenth = 0;
+
+	(void)arg;
+	for (offset = 0; offset < export_size && left && !stop; offset += step) {
+		unsigned long long size = export_size - offset < step ? export_size - offset : step;
+
+		if (overlay_fill(ov, offset, size)) {
+			log_mesg(0, 0, 1, opt.debug, "Restore to %s failed, the clients still read the image\n", restore_path);
+			return NULL;
+		}
+		left = overlay_left(ov);
+		if ((total - left) * 10 / total > tenth) {
+			tenth = (total - left) * 10 / total;
+			log_mesg(0, 0, 1, opt.debug, "Restored %llu0%% to %s\n", tenth, restore_path);
+		}
+	}
+	if (left)
+		return NULL;
+
+	if (overlay_flush(ov) == 0)
+		log_mesg(0, 0, 1, opt.debug, "Restore to %s done, the device can be used directly\n", restore_path);
+	return NULL;
+}
+
+static int repo_reader(void *ctx, char *buf, size_t size, unsigned long long offset) {
+
+	return repo_image_pread((repo_image *)ctx, buf, size, offset);
+}
+
+static void stop_handler(int sig) {
+
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char **argv) {
+
+	image_head_v2 img_head;
+	image_options img_opt;
+	repo_image *repo_img = NULL;
+	struct sigaction sa;
+	int dfr, listen_fd;
+
+	nbd_options(argc, argv);
+	open_log(opt.logfile);
+	io_limit_init(&opt);
+	signal(SIGPIPE, SIG_IGN);
+
+	/// no SA_RESTART, accept() returns to see stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (repo_dir) {
+		/// the head and the bitmap are read from a copy, the data from the chunks
+		repo_img = repo_image_open(repo_dir, opt.source, opt.debug);
+		if (repo_img == NULL)
+			log_mesg(0, 1, 1, opt.debug, "nbd: Can't open %s in %s\n", opt.source, repo_dir);
+		dfr = repo_image_prefix_fd(repo_img);
+	} else {
+		dfr = open(opt.source, O_RDONLY | O_LARGEFILE);
+	}
+	if (dfr == -1)
+		log_mesg(0, 1, 1, opt.debug, "nbd: Can't open file(%s)\n", opt.source);
+
+	load_image_desc(&dfr, &opt, &img_head, &fs_info, &img_opt);
+	bitmap = pc_alloc_bitmap(fs_info.totalblock);
+	if (bitmap == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
+	if (img_opt.checksum_mode == CSM_AES256_GCM)
+		load_image_cipher(&dfr, &img_head, fs_info, img_opt, bitmap, &opt);
+	load_image_padding(&dfr, fs_info, img_opt, &opt);
+
+	cache = strip_cache_open(dfr, lseek(dfr, 0, SEEK_CUR), &fs_info, &img_opt, bitmap, cache_size, opt.debug);
+	if (cache == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	if (repo_img)
+		strip_cache_set_reader(cache, repo_reader, repo_img);
+
+	export_size = fs_info.device_size;
+	if (export_size < fs_info.totalblock * fs_info.block_size)
+		export_size = fs_info.totalblock * fs_info.block_size;
+
+	if (overlay_path) {
+		ov = overlay_open(overlay_path, &fs_info, bitmap, cache, export_size, opt.debug);
+		if (ov == NULL)
+			log_mesg(0, 1, 1, opt.debug, "nbd: Can't use overlay %s\n", overlay_path);
+	}
+	if (restore_path) {
+		ov = overlay_open_device(restore_path, &fs_info, bitmap, cache, export_size, opt.debug);
+		if (ov == NULL)
+			log_mesg(0, 1, 1, opt.debug, "nbd: Can't restore to %s\n", restore_path);
+		if (pthread_create(&restore_tid, NULL, restore_thread, NULL))
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+
+	listen_fd = nbd_listen();
+	log_mesg(0, 0, 1, opt.debug, "Serving %s, %llu bytes, on %s%s%s\n", opt.source, export_size,
+		unix_path ? unix_path : bind_addr ? bind_addr : "*", unix_path ? "" : ":", unix_path ? "" : port);
+
+	while (!stop) {
+		nbd_client *c;
+		pthread_t thread;
+		int fd, one = 1;
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_mesg(0, 1, 1, opt.debug, "nbd: accept error: %s\n", strerror(errno));
+		}
+		if (!unix_path)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		log_mesg(1, 0, 0, opt.debug, "nbd: client %i connected\n", fd);
+
+		c = calloc(1, sizeof(nbd_client));
+		if (c == NULL)
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		c->fd = fd;
+
+		if (serve_once) {
+			nbd_client_thread(c);
+			break;
+		}
+		if (pthread_create(&thread, NULL, nbd_client_thread, c))
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+		pthread_detach(thread);
+	}
+
+	close(listen_fd);
+	if (unix_path)
+		unlink(unix_path);
+	if (!serve_once) {
+		/// the clients may still run, only save what they wrote
+		if (ov && overlay_flush(ov) == 0 && overlay_path)
+			log_mesg(0, 0, 1, opt.debug, "Overlay %s saved\n", overlay_path);
+		if (restore_path && overlay_left(ov))
+			log_mesg(0, 0, 1, opt.debug, "Restore to %s not finished, %llu blocks left\n",
+				restore_path, overlay_left(ov));
+		close_log();
+		return 0;
+	}
+	if (restore_path) {
+		/// the client is gone, finish the restore unless told to stop
+		pthread_join(restore_tid, NULL);
+		if (overlay_left(ov))
+			log_mesg(0, 0, 1, opt.debug, "Restore to %s not finished, %llu blocks left\n",
+				restore_path, overlay_left(ov));
+	}
+	overlay_close(ov);
+	strip_cache_close(cache);
+	repo_image_close(repo_img);
+	free(bitmap);
+	close(dfr);
+	close_log();
+	return 0;
+}
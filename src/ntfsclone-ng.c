@@ -34,14 +34,19 @@
 #include <ntfs-3g/volume.h>
 #include <ntfs-3g/bitmap.h>
 #include <ntfs-3g/misc.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/attrib.h>
 #else
 #include <ntfs/device.h>
 #include <ntfs/volume.h>
 #include <ntfs/bitmap.h>
 #include <ntfs/support.h>
+#include <ntfs/inode.h>
+#include <ntfs/attrib.h>
 #endif
 
 #include <assert.h>
+#include <openssl/sha.h>
 
 #include "partclone.h"
 #include "ntfsclone-ng.h"
@@ -58,6 +63,14 @@
 
 ntfs_volume *ntfs;
 
+/// the boot sector and the restart pages of $LogFile, little endian
+#define BOOT_OFF_SERIAL         0x48
+#define RSTR_MAGIC              "RSTR"
+#define RSTR_OFF_CHKDSK_LSN     0x08
+#define RSTR_OFF_PAGE_SIZE      0x10
+#define RSTR_OFF_AREA           0x18
+#define RSTR_READ_SIZE          512     /// the fields are before the first update sequence fixup
+
 
 /********************************************************
  * Routines for counting attributes free bits.
@@ -304,6 +317,108 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
 }
 
+/// the clusters of $BadClus:$Bad, allocated in the bitmap but not to be read
+unsigned long long read_bad_blocks(char* device, file_system_info fs_info, unsigned long* bad)
+{
+    static ntfschar Bad[4] = {
+        const_cpu_to_le16('$'), const_cpu_to_le16('B'), const_cpu_to_le16('a'), const_cpu_to_le16('d')
+    };
+    ntfs_inode *ni;
+    ntfs_attr *na = NULL;
+    runlist_element *rl;
+    unsigned long long count = 0;
+    long long lcn;
+
+    fs_open(device);
+    ni = ntfs_inode_open(ntfs, FILE_BadClus);
+    if (ni)
+        na = ntfs_attr_open(ni, AT_DATA, Bad, 4);
+    if (na == NULL || ntfs_attr_map_whole_runlist(na)) {
+        log_mesg(0, 0, 1, fs_opt.debug, "%s: can't read $BadClus, the bad clusters are read\n", __FILE__);
+    } else {
+        /// the sparse runs are the good clusters
+        for (rl = na->rl; rl->length; rl++) {
+            if (rl->lcn < 0)
+                continue;
+            for (lcn = rl->lcn; lcn < rl->lcn + rl->length && lcn < (long long)fs_info.totalblock; lcn++) {
+                pc_set_bit(lcn, bad, fs_info.totalblock);
+                count++;
+            }
+        }
+    }
+    if (na)
+        ntfs_attr_close(na);
+    if (ni)
+        ntfs_inode_close(ni);
+    fs_close();
+    return count;
+}
+
+/// the current LSN of the restart page at pos of $LogFile, 0 when it is not one
+static unsigned long long restart_page_lsn(ntfs_attr *na, long long pos, unsigned int *page_size)
+{
+    unsigned char page[RSTR_READ_SIZE];
+    uint16_t area;
+    uint64_t lsn = 0, chkdsk;
+    uint32_t size;
+
+    if (ntfs_attr_pread(na, pos, sizeof(page), page) != sizeof(page) || memcmp(page, RSTR_MAGIC, 4))
+        return 0;
+    memcpy(&size, page + RSTR_OFF_PAGE_SIZE, sizeof(size));
+    memcpy(&area, page + RSTR_OFF_AREA, sizeof(area));
+    memcpy(&chkdsk, page + RSTR_OFF_CHKDSK_LSN, sizeof(chkdsk));
+    *page_size = le32_to_cpu(size);
+    area = le16_to_cpu(area);
+    if (area + sizeof(lsn) <= sizeof(page))
+        memcpy(&lsn, page + area, sizeof(lsn));
+    lsn = le64_to_cpu(lsn);
+    chkdsk = le64_to_cpu(chkdsk);
+    return lsn > chkdsk ? lsn : chkdsk;
+}
+
+/**
+ * the volume serial number and the current LSN of $LogFile, which Windows
+ * moves on every change. ntfs-3g empties $LogFile when it mounts read-write,
+ * then there is no LSN and no identity until Windows mounts the volume again.
+ */
+int get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity)
+{
+    unsigned char boot[512];
+    struct {
+        uint64_t serial;
+        uint64_t lsn[2];
+    } __attribute__((packed)) id;
+    unsigned int page_size = 4096, next_size;
+    ntfs_inode *ni;
+    ntfs_attr *na = NULL;
+    int ret = 0;
+
+    fs_open(device);
+    memset(&id, 0, sizeof(id));
+    ni = ntfs_inode_open(ntfs, FILE_LogFile);
+    if (ni)
+        na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+    if (na && ntfs_pread(ntfs->dev, 0, sizeof(boot), boot) == sizeof(boot)) {
+        memcpy(&id.serial, boot + BOOT_OFF_SERIAL, sizeof(id.serial));
+        /// the restart page and its copy, one page further
+        id.lsn[0] = restart_page_lsn(na, 0, &page_size);
+        if (page_size >= RSTR_READ_SIZE)
+            id.lsn[1] = restart_page_lsn(na, page_size, &next_size);
+        ret = id.lsn[0] || id.lsn[1];
+    }
+    if (!ret)
+        log_mesg(0, 0, 1, fs_opt.debug, "%s: $LogFile has no restart page, it was emptied by ntfs-3g\n", __FILE__);
+    else
+        SHA256((unsigned char*)&id, sizeof(id), identity);
+
+    if (na)
+        ntfs_attr_close(na);
+    if (ni)
+        ntfs_inode_close(ni);
+    fs_close();
+    return ret;
+}
+
 void read_super_blocks(char* device, file_system_info* fs_info)
 {
     fs_open(device);
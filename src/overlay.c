@@ -0,0 +1,505 @@
+/**
+ * overlay.c - Part of Partclone project.
+ *
+ * a copy-on-write overlay file to make an image writable
+ *
+ * The image is never written. The blocks written to the exported disk go to
+ * a sparse overlay file at data_offset + their offset, and a bitmap of them
+ * is kept after the head of the file. The reads take the written blocks
+ * from the overlay and the others from the image. A block partly written
+ * is first copied from the image.
+ *
+ * The bitmap is written by overlay_flush(), after the data is synced. Bits
+ * are only ever set, so a bitmap torn by a crash still names only blocks
+ * whose data is on the disk.
+ *
+ * overlay_open_device() is the instant restore: the overlay is the target
+ * device itself, the data at the offset of the disk and the bitmap only in
+ * memory. The reads copy the used blocks they touch from the image first,
+ * and overlay_fill() copies the others in the background. When no used
+ * block is left the device holds what partclone.restore would write.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "stripcache.h"
+#include "overlay.h"
+
+#define OVERLAY_ALIGN 4096   /// of data_offset, at least a block
+
+struct overlay {
+	int fd;
+	unsigned long *bitmap;           /// the written blocks
+	unsigned long long blocks;
+	unsigned long long size;
+	unsigned long long data_offset;
+	unsigned int block_size;
+	unsigned long *base_bitmap;      /// the blocks of the image
+	unsigned long long base_blocks;
+	strip_cache *base;
+	char *block;                     /// read-modify-write buffer, under the write lock
+	char *zero;                      /// a block of zeroes
+	char *fill;                      /// copy buffer of a device overlay, NULL otherwise
+	unsigned long long left;         /// used blocks not yet on the device
+	int dirty;
+	pthread_rwlock_t lock;
+	int debug;
+};
+
+static int pread_all(int fd, char *buf, size_t size, unsigned long long offset) {
+
+	while (size) {
+		ssize_t r = pread(fd, buf, size, offset);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r < 0 ? -errno : -EIO;
+		buf += r;
+		offset += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t size, unsigned long long offset) {
+
+	while (size) {
+		ssize_t r = pwrite(fd, buf, size, offset);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return r < 0 ? -errno : -EIO;
+		buf += r;
+		offset += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static uint32_t head_crc(overlay_head *head) {
+
+	uint32_t crc;
+
+	init_crc32(&crc);
+	return crc32(crc, head, sizeof(overlay_head) - CRC32_SIZE);
+}
+
+static void overlay_free(overlay *ov) {
+
+	if (ov->fd > 0)
+		close(ov->fd);
+	free(ov->bitmap);
+	free(ov->block);
+	free(ov->zero);
+	free(ov->fill);
+	free(ov);
+}
+
+static overlay *overlay_new(const file_system_info *fs_info, unsigned long *bitmap,
+	strip_cache *base, unsigned long long size, int debug) {
+
+	const unsigned int block_size = fs_info->block_size;
+	overlay *ov;
+
+	ov = calloc(1, sizeof(overlay));
+	if (ov == NULL)
+		return NULL;
+	ov->blocks = (size + block_size - 1) / block_size;
+	ov->size = size;
+	ov->block_size = block_size;
+	ov->base_bitmap = bitmap;
+	ov->base_blocks = fs_info->totalblock;
+	ov->base = base;
+	ov->debug = debug;
+	ov->bitmap = pc_alloc_bitmap(ov->blocks);
+	ov->block = malloc(block_size);
+	ov->zero = calloc(1, block_size);
+	if (ov->bitmap == NULL || ov->block == NULL || ov->zero == NULL) {
+		log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		overlay_free(ov);
+		return NULL;
+	}
+	return ov;
+}
+
+overlay *overlay_open(const char *path, const file_system_info *fs_info, unsigned long *bitmap,
+	strip_cache *base, unsigned long long size, int debug) {
+
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int align = block_size > OVERLAY_ALIGN ? block_size : OVERLAY_ALIGN;
+	overlay_head head, expect;
+	unsigned long long bitmap_size;
+	struct stat st;
+	overlay *ov;
+	uint32_t crc;
+	int ret;
+
+	ov = overlay_new(fs_info, bitmap, base, size, debug);
+	if (ov == NULL)
+		return NULL;
+	bitmap_size = BITS_TO_BYTES(ov->blocks);
+
+	/// what the head must be, the overlay belongs to this image
+	memset(&expect, 0, sizeof(expect));
+	memcpy(expect.magic, OVERLAY_MAGIC, OVERLAY_MAGIC_SIZE);
+	expect.endianess = ENDIAN_MAGIC;
+	init_crc32(&crc);
+	expect.image_crc = crc32(crc, bitmap, BITS_TO_BYTES(fs_info->totalblock));
+	expect.fs_info = *fs_info;
+	expect.blocks = ov->blocks;
+	expect.data_offset = (sizeof(overlay_head) + bitmap_size + align - 1) / align * align;
+	expect.crc = head_crc(&expect);
+	ov->data_offset = expect.data_offset;
+
+	ov->fd = open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (ov->fd == -1 || fstat(ov->fd, &st) == -1) {
+		log_mesg(0, 0, 1, debug, "Can't open overlay %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+
+	if (st.st_size == 0) {
+		/// a new overlay, sparse up to the end of the disk
+		if ((ret = pwrite_all(ov->fd, (char *)&expect, sizeof(expect), 0)) ||
+		    (ret = pwrite_all(ov->fd, (char *)ov->bitmap, bitmap_size, sizeof(expect))) ||
+		    (ret = ftruncate(ov->fd, ov->data_offset + ov->blocks * block_size) ? -errno : 0)) {
+			log_mesg(0, 0, 1, debug, "Can't create overlay %s: %s\n", path, strerror(-ret));
+			goto error;
+		}
+		log_mesg(0, 0, 1, debug, "Created overlay %s\n", path);
+		pthread_rwlock_init(&ov->lock, NULL);
+		return ov;
+	}
+
+	if (pread_all(ov->fd, (char *)&head, sizeof(head), 0) ||
+	    memcmp(head.magic, OVERLAY_MAGIC, OVERLAY_MAGIC_SIZE)) {
+		log_mesg(0, 0, 1, debug, "%s is not an overlay file\n", path);
+		goto error;
+	}
+	if (head.crc != head_crc(&head) || head.endianess != ENDIAN_MAGIC) {
+		log_mesg(0, 0, 1, debug, "The head of overlay %s is damaged or from another machine\n", path);
+		goto error;
+	}
+	if (memcmp(&head, &expect, sizeof(head))) {
+		log_mesg(0, 0, 1, debug, "Overlay %s is not for this image\n", path);
+		goto error;
+	}
+	if (pread_all(ov->fd, (char *)ov->bitmap, bitmap_size, sizeof(head))) {
+		log_mesg(0, 0, 1, debug, "Overlay %s is truncated\n", path);
+		goto error;
+	}
+
+	log_mesg(0, 0, 1, debug, "Overlay %s: %llu blocks written\n", path,
+		pc_count_bits(ov->bitmap, 0, ov->blocks));
+	pthread_rwlock_init(&ov->lock, NULL);
+	return ov;
+
+error:
+	overlay_free(ov);
+	return NULL;
+}
+
+overlay *overlay_open_device(const char *path, const file_system_info *fs_info, unsigned long *bitmap,
+	strip_cache *base, unsigned long long size, int debug) {
+
+	const unsigned int block_size = fs_info->block_size;
+	struct stat st;
+	overlay *ov;
+
+	ov = overlay_new(fs_info, bitmap, base, size, debug);
+	if (ov == NULL)
+		return NULL;
+	ov->fill = malloc(block_size > STRIP_CACHE_LINE_SIZE ? block_size : STRIP_CACHE_LINE_SIZE);
+	if (ov->fill == NULL) {
+		log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		goto error;
+	}
+	ov->left = pc_count_bits(bitmap, 0, fs_info->totalblock);
+
+	ov->fd = open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (ov->fd == -1 || fstat(ov->fd, &st) == -1) {
+		log_mesg(0, 0, 1, debug, "Can't open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if (S_ISREG(st.st_mode) && (unsigned long long)st.st_size < size && ftruncate(ov->fd, size)) {
+		log_mesg(0, 0, 1, debug, "Can't grow %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if (get_partition_size(&ov->fd) < size) {
+		log_mesg(0, 0, 1, debug, "%s is smaller than the disk, %llu bytes\n", path, size);
+		goto error;
+	}
+
+	log_mesg(0, 0, 1, debug, "Restoring %llu blocks to %s\n", ov->left, path);
+	pthread_rwlock_init(&ov->lock, NULL);
+	return ov;
+
+error:
+	overlay_free(ov);
+	return NULL;
+}
+
+/// the first used block in [block, end) not yet on the device, end when none
+static unsigned long long next_missing(overlay *ov, unsigned long long block, unsigned long long end) {
+
+	if (end > ov->base_blocks)
+		end = ov->base_blocks;
+	while (block < end) {
+		block = pc_find_next_bit(ov->base_bitmap, ov->base_blocks, block, 1);
+		if (block >= end || !pc_test_bit(block, ov->bitmap, ov->blocks))
+			break;
+		block = pc_find_next_bit(ov->bitmap, ov->blocks, block, 0);
+	}
+	return block < end ? block : end;
+}
+
+int overlay_fill(overlay *ov, unsigned long long offset, size_t size) {
+
+	const unsigned int block_size = ov->block_size;
+	const unsigned long long max_run = ov->fill ?
+		(block_size > STRIP_CACHE_LINE_SIZE ? 1 : STRIP_CACHE_LINE_SIZE / block_size) : 0;
+	unsigned long long block = offset / block_size;
+	unsigned long long end = (offset + size + block_size - 1) / block_size;
+	int ret = 0;
+
+	if (ov->fill == NULL)
+		return 0;
+
+	/// most of the time there is nothing to copy, look under the read lock
+	pthread_rwlock_rdlock(&ov->lock);
+	block = ov->left ? next_missing(ov, block, end) : end;
+	pthread_rwlock_unlock(&ov->lock);
+	if (block >= end || block >= ov->base_blocks)
+		return 0;
+
+	pthread_rwlock_wrlock(&ov->lock);
+	while (!ret && (block = next_missing(ov, block, end)) < end && block < ov->base_blocks) {
+		unsigned long long run = pc_find_next_bit(ov->base_bitmap, ov->base_blocks, block, 0);
+		unsigned long long written = pc_find_next_bit(ov->bitmap, ov->blocks, block, 1);
+		unsigned long long b;
+
+		if (run > written)
+			run = written;
+		if (run > end)
+			run = end;
+		if (run > block + max_run)
+			run = block + max_run;
+
+		ret = strip_cache_read(ov->base, ov->fill, (run - block) * block_size, block * block_size);
+		if (!ret)
+			ret = pwrite_all(ov->fd, ov->fill, (run - block) * block_size, block * block_size);
+		for (b = block; !ret && b < run; b++)
+			pc_set_bit(b, ov->bitmap, ov->blocks);
+		if (!ret) {
+			ov->left -= run - block;
+			ov->dirty = 1;
+		}
+		block = run;
+	}
+	pthread_rwlock_unlock(&ov->lock);
+
+	if (ret)
+		log_mesg(0, 0, 1, ov->debug, "overlay: restore error at block %llu: %s\n", block, strerror(-ret));
+	return ret;
+}
+
+unsigned long long overlay_left(overlay *ov) {
+
+	unsigned long long left;
+
+	pthread_rwlock_rdlock(&ov->lock);
+	left = ov->left;
+	pthread_rwlock_unlock(&ov->lock);
+	return left;
+}
+
+int overlay_read(overlay *ov, char *buf, size_t size, unsigned long long offset) {
+
+	const unsigned int block_size = ov->block_size;
+	int ret;
+
+	/// a device overlay copies the blocks through, they are read from it
+	ret = overlay_fill(ov, offset, size);
+
+	pthread_rwlock_rdlock(&ov->lock);
+	while (size && !ret) {
+		unsigned long long block = offset / block_size;
+		int written = pc_test_bit(block, ov->bitmap, ov->blocks);
+		unsigned long long next = pc_find_next_bit(ov->bitmap, ov->blocks, block, !written);
+		unsigned long long len = next * block_size - offset;
+
+		if (len > size)
+			len = size;
+		if (written)
+			ret = pread_all(ov->fd, buf, len, ov->data_offset + offset);
+		else
+			ret = strip_cache_read(ov->base, buf, len, offset);
+
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+	pthread_rwlock_unlock(&ov->lock);
+
+	return ret;
+}
+
+/// zeroes at offset of the overlay file
+static int write_zeroes(overlay *ov, unsigned long long size, unsigned long long offset, int punch) {
+
+	int ret = 0;
+
+	if (punch && fallocate(ov->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+		return 0;
+
+	while (size && !ret) {
+		unsigned int len = size < ov->block_size ? size : ov->block_size;
+
+		ret = pwrite_all(ov->fd, ov->zero, len, offset);
+		offset += len;
+		size -= len;
+	}
+	return ret;
+}
+
+static void mark_written(overlay *ov, unsigned long long block) {
+
+	if (pc_test_bit(block, ov->bitmap, ov->blocks))
+		return;
+	pc_set_bit(block, ov->bitmap, ov->blocks);
+	if (block < ov->base_blocks && pc_test_bit(block, ov->base_bitmap, ov->base_blocks))
+		ov->left--;
+}
+
+int overlay_write(overlay *ov, const char *buf, size_t size, unsigned long long offset, int punch) {
+
+	const unsigned int block_size = ov->block_size;
+	unsigned long long pos = offset, end = offset + size;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&ov->lock);
+	while (pos < end && !ret) {
+		unsigned long long block = pos / block_size;
+		unsigned long long block_start = block * block_size;
+		unsigned long long len, b;
+
+		if (pos == block_start && end - pos >= block_size) {
+			/// whole blocks, written as they come
+			len = (end - pos) / block_size * block_size;
+			if (buf)
+				ret = pwrite_all(ov->fd, buf + (pos - offset), len, ov->data_offset + pos);
+			else
+				ret = write_zeroes(ov, len, ov->data_offset + pos, punch);
+			for (b = block; !ret && b < block + len / block_size; b++)
+				mark_written(ov, b);
+		} else {
+			/// a part of a block, copied from the image the first time
+			len = block_start + block_size - pos;
+			if (len > end - pos)
+				len = end - pos;
+			if (!pc_test_bit(block, ov->bitmap, ov->blocks)) {
+				ret = strip_cache_read(ov->base, ov->block, block_size, block_start);
+				if (!ret) {
+					if (buf)
+						memcpy(ov->block + (pos - block_start), buf + (pos - offset), len);
+					else
+						memset(ov->block + (pos - block_start), 0, len);
+					ret = pwrite_all(ov->fd, ov->block, block_size, ov->data_offset + block_start);
+				}
+				if (!ret)
+					mark_written(ov, block);
+			} else {
+				ret = pwrite_all(ov->fd, buf ? buf + (pos - offset) : ov->zero, len, ov->data_offset + pos);
+			}
+		}
+		pos += len;
+	}
+	ov->dirty = 1;
+	pthread_rwlock_unlock(&ov->lock);
+
+	return ret;
+}
+
+int overlay_flush(overlay *ov) {
+
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&ov->lock);
+	if (ov->dirty) {
+		/// the data first, then the bitmap naming it, a device keeps none
+		if (fdatasync(ov->fd) ||
+		    (!ov->fill && (ret = pwrite_all(ov->fd, (char *)ov->bitmap, BITS_TO_BYTES(ov->blocks), sizeof(overlay_head)))) ||
+		    fdatasync(ov->fd))
+			ret = ret ? ret : -errno;
+		if (!ret)
+			ov->dirty = 0;
+	}
+	pthread_rwlock_unlock(&ov->lock);
+
+	if (ret)
+		log_mesg(0, 0, 1, ov->debug, "overlay: flush error: %s\n", strerror(-ret));
+	return ret;
+}
+
+unsigned long long overlay_next_extent(overlay *ov, unsigned long long offset, unsigned long long end, int *hole) {
+
+	const unsigned int block_size = ov->block_size;
+	unsigned long long block = offset / block_size;
+	unsigned long long next = block;
+
+	pthread_rwlock_rdlock(&ov->lock);
+	if (pc_test_bit(block, ov->bitmap, ov->blocks) ||
+	    (block < ov->base_blocks && pc_test_bit(block, ov->base_bitmap, ov->base_blocks))) {
+		/// allocated up to a block in neither bitmap
+		*hole = 0;
+		while (next < ov->blocks && next * block_size < end) {
+			if (pc_test_bit(next, ov->bitmap, ov->blocks))
+				next = pc_find_next_bit(ov->bitmap, ov->blocks, next, 0);
+			else if (next < ov->base_blocks && pc_test_bit(next, ov->base_bitmap, ov->base_blocks))
+				next = pc_find_next_bit(ov->base_bitmap, ov->base_blocks, next, 0);
+			else
+				break;
+		}
+	} else {
+		*hole = 1;
+		next = pc_find_next_bit(ov->bitmap, ov->blocks, block, 1);
+		if (block < ov->base_blocks) {
+			unsigned long long base_next = pc_find_next_bit(ov->base_bitmap, ov->base_blocks, block, 1);
+
+			if (base_next < ov->base_blocks && base_next < next)
+				next = base_next;
+		}
+	}
+	pthread_rwlock_unlock(&ov->lock);
+
+	return next * block_size < end ? next * block_size : end;
+}
+
+void overlay_close(overlay *ov) {
+
+	if (ov == NULL)
+		return;
+
+	overlay_flush(ov);
+	pthread_rwlock_destroy(&ov->lock);
+	overlay_free(ov);
+}
@@ -0,0 +1,52 @@
+/**
+ * overlay.h - Part of Partclone project.
+ *
+ * a copy-on-write overlay file to make an image writable
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include <stddef.h>
+#include "stripcache.h"
+
+typedef struct overlay overlay;
+
+/**
+ * open the overlay at path, created when it does not exist, for the image
+ * read through base. size is the size of the exported disk. returns NULL
+ * when the file can not be used, the reason is logged.
+ */
+overlay *overlay_open(const char *path, const file_system_info *fs_info, unsigned long *bitmap,
+	strip_cache *base, unsigned long long size, int debug);
+
+/**
+ * instant restore: the overlay is the device at path, at least size bytes,
+ * a regular file is grown. the used blocks are copied from the image when
+ * they are read, or by overlay_fill(). nothing is kept when it is closed.
+ */
+overlay *overlay_open_device(const char *path, const file_system_info *fs_info, unsigned long *bitmap,
+	strip_cache *base, unsigned long long size, int debug);
+
+/// copy the used blocks of the range still missing on a device overlay, 0 or -errno
+int overlay_fill(overlay *ov, unsigned long long offset, size_t size);
+/// the used blocks of the image not yet on a device overlay
+unsigned long long overlay_left(overlay *ov);
+
+/// read from the overlay, or from the image where it was not written, 0 or -errno
+int overlay_read(overlay *ov, char *buf, size_t size, unsigned long long offset);
+/// write to the overlay, zeroes when buf is NULL, punch is 0 to allocate them, 0 or -errno
+int overlay_write(overlay *ov, const char *buf, size_t size, unsigned long long offset, int punch);
+/// make the data written so far durable, 0 or -errno
+int overlay_flush(overlay *ov);
+/// the end of the run of allocated or unallocated bytes at offset, cut at end
+unsigned long long overlay_next_extent(overlay *ov, unsigned long long offset, unsigned long long end, int *hole);
+/// flush and close
+void overlay_close(overlay *ov);
+
+#endif /* OVERLAY_H_ */
@@ -44,11 +44,21 @@
 #include <linux/fs.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 #define _(STRING) gettext(STRING)
 //#define PACKAGE "partclone"
+#include <stddef.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 #include "version.h"
 #include "partclone.h"
 #include "checksum.h"
+#include "iolimit.h"
+#include "volset.h"
+#include "faultio.h"
 
 #if defined(linux) && defined(_IO) && !defined(BLKGETSIZE)
 #define BLKGETSIZE      _IO(0x12,96)  /* Get device size in 512-byte blocks. */
@@ -60,6 +70,16 @@
 unsigned long long      rescue_write_size;
 
 FILE* msg = NULL;
+
+/// what log_mesg needs from the options, set before any thread is started
+static struct {
+	int ncurses;
+	int force;
+	const char* logfile;
+} log_opt;
+
+static pthread_mutex_t log_mutex;
+static pthread_once_t log_mutex_once = PTHREAD_ONCE_INIT;
 unsigned long long rescue_write_size;
 #ifdef HAVE_LIBNCURSESW
 #include <ncurses.h>
@@ -78,6 +98,24 @@ int log_y_line = 0;
 #define OPT_READ_DIRECT_IO 1002
 #define OPT_BINARY_PREFIX 1003
 #define OPT_PROG_SEC 1004
+#define OPT_RANGE 1005
+#define OPT_KEY_FILE 1006
+#define OPT_VERIFY 1007
+#define OPT_COMPARE 1008
+#define OPT_SAVE_BITMAP 1009
+#define OPT_LOAD_BITMAP 1010
+#define OPT_WRITEBACK_WINDOW 1011
+#define OPT_MAX_RATE 1012
+#define OPT_MAX_READ_RATE 1013
+#define OPT_MAX_WRITE_RATE 1014
+#define OPT_IONICE 1015
+#define OPT_SKIP_UNUSED_ITABLE 1016
+#define OPT_SKIP_CLEAN_JOURNAL 1017
+#define OPT_ALIGNED 1018
+#define OPT_SPLIT 1019
+#define OPT_STRIPE 1020
+#define OPT_FAULT_INJECT 1021
+#define OPT_METADATA_FIRST 1022
 //
 //enum {
 //	OPT_OFFSET_DOMAIN = 1000
@@ -241,19 +279,33 @@ void usage(void) {
 		"    -c,  --clone            Save to the special image format\n"
 		"    -r,  --restore          Restore from the special image format\n"
 		"    -b,  --dev-to-dev       Local device to device copy mode\n"
+		"         --compare          Compare the source device with the image given as output\n"
 		"    -x,  --compresscmd CMD  Start CMD as an output pipe to compress the cloned image\n"
 		"    -n,  --note NOTE        Display Message Note (128 words)\n"
 #endif
 		"    -D,  --domain           Create ddrescue domain log from source device\n"
 		"         --offset_domain=X  Add offset X (bytes) to domain log values\n"
 		"    -R,  --rescue           Continue clone while disk read errors\n"
+		"         --metadata-first   Copy the file system metadata before the data, or\n"
+		"                            map only the metadata with --domain\n"
+		"         --save-bitmap FILE Save the bitmap of the file system to FILE\n"
+		"         --load-bitmap FILE Use the bitmap saved in FILE instead of reading it\n"
+#ifdef EXTFS
+		"         --skip-unused-itable\n"
+		"                            Leave the never used inode tables out of the image\n"
+		"         --skip-clean-journal\n"
+		"                            Leave the journal out of the image when it is clean\n"
+#endif
 		"    -aX  --checksum-mode=X  Checksum formula to use to add error detection\n"
 		"                            where X:\n"
 		"                            0: No checksum (no slowdown, smallest image)\n"
 		"                            1: CRC32 (Fast to compute, basic detection)\n"
+		"                            2: AES-256-GCM (Encrypt and authenticate, needs --key-file)\n"
 		"    -kX  --blocks-per-checksum=X\n"
 		"                            Write one checksum for every X blocks\n"
 		"    -K,  --no-reseed        Do not reseed the checksum at each write (TEST)\n"
+		"         --aligned          Write an image of version 0003, its data aligned on\n"
+		"                            4 KiB so it can be read with direct I/O\n"
 #endif
 		"    -w,  --skip_write_error Continue restore while write errors\n"
 #endif
@@ -267,6 +319,7 @@ void usage(void) {
                 "         --write-direct-io  Writing data to TARGET partition without cache\n"
                 "         --read-direct-io   Reading data from SOURCE partition without cache\n"
 #endif
+		"         --key-file FILE    Key or passphrase FILE of encrypted images\n"
 		"    -i,  --ignore_crc       Ignore checksum error\n"
 		"    -F,  --force            Force progress\n"
 		"    -f,  --UI-fresh         Fresh times of progress\n"
@@ -274,11 +327,32 @@ void usage(void) {
 		"         --binary-prefix    Show progress with bit size (default is MB, GB...)\n"
 		"         --prog-second      Show progress in seconds (default is minute)\n"
 		"    -z,  --buffer_size SIZE Read/write buffer size (default: %d)\n"
+		"         --max-rate=RATE    Read and write at most RATE bytes per second each\n"
+		"                            (suffix k, m, g)\n"
+		"         --max-read-rate=RATE, --max-write-rate=RATE\n"
+		"                            Limit only the reads or the writes\n"
+		"         --ionice=CLASS[:LEVEL]\n"
+		"                            I/O priority, CLASS is idle or be (best effort,\n"
+		"                            LEVEL 0 to 7, default 7)\n"
+		"         --split=SIZE       The image is in volumes FILE.000, FILE.001... of SIZE\n"
+		"                            bytes (suffix k, m, g)\n"
+		"         --stripe=DIR,...   The image is striped over the file FILE of each DIR,\n"
+		"                            written and read in parallel\n"
+#ifdef FAULT_INJECT
+		"         --fault-inject=FILE\n"
+		"                            Inject the I/O faults of FILE, for the tests\n"
+#endif
 #ifndef CHKIMG
 		"    -q,  --quiet            Disable progress message\n"
 		"    -E,  --offset=X         Add offset X (bytes) to OUTPUT\n"
 		"    -T,  --btfiles          Restore block as file for ClonezillaBT\n"
 		"    -t,  --btfiles_torrent  Restore block as file for ClonezillaBT but only generate torrent\n"
+		"         --range=START:LEN  Restore only LEN bytes from offset START of the device.\n"
+		"                            Suffix k, m, g, t for KiB..TiB, b for file system blocks\n"
+		"         --verify           Read the written data back from TARGET and compare it\n"
+		"         --writeback-window=SIZE\n"
+		"                            Write back to TARGET while writing, leaving at most\n"
+		"                            SIZE bytes (suffix k, m, g) unsynced behind\n"
 #endif
 		"    -v,  --version          Display partclone version\n"
 		"    -h,  --help             Display this help\n"
@@ -303,6 +377,10 @@ int convert_to_checksum_mode(unsigned long mode) {
 		return CSM_CRC32;
 		break;
 
+	case 2:
+		return CSM_AES256_GCM;
+		break;
+
 	// note: we do not allow the user to use CSM_CRC32_0001. That mode exist only
 	// to support image created in format 0001.
 
@@ -315,6 +393,120 @@ int convert_to_checksum_mode(unsigned long mode) {
 }
 
 
+/**
+ * parse a size with an optional k, m, g or t suffix (powers of 1024),
+ * or b for file system blocks, which the caller has to convert
+ *
+ * the number is decimal, a leading 0 is not octal
+ *
+ * return a pointer past the parsed text, or NULL on a syntax error or
+ * when the size does not fit
+ */
+const char *parse_size(const char *str, unsigned long long *value, int *in_blocks) {
+
+	char *end;
+	int shift = 0;
+
+	*in_blocks = 0;
+	/// strtoull takes a minus sign and negates, -1 would be ULLONG_MAX
+	if (*str < '0' || *str > '9')
+		return NULL;
+	errno = 0;
+	*value = strtoull(str, &end, 10);
+	if (end == str || errno)
+		return NULL;
+
+	switch (*end) {
+	case 't': case 'T':
+		shift++;
+		/* fall through */
+	case 'g': case 'G':
+		shift++;
+		/* fall through */
+	case 'm': case 'M':
+		shift++;
+		/* fall through */
+	case 'k': case 'K':
+		shift++;
+		end++;
+		break;
+	case 'b': case 'B':
+		*in_blocks = 1;
+		end++;
+		break;
+	}
+	for (; shift > 0; shift--) {
+		if (*value > (ULLONG_MAX >> 10))
+			return NULL;
+		*value <<= 10;
+	}
+	return end;
+}
+
+/// parse a --max-*-rate, bytes per second with an optional k, m, g suffix
+static unsigned long long parse_rate(const char *arg) {
+
+	unsigned long long rate;
+	int in_blocks;
+	const char *end = parse_size(arg, &rate, &in_blocks);
+
+	if (end == NULL || *end != '\0' || in_blocks || rate == 0) {
+		fprintf(stderr, "Bad rate '%s'.\n", arg);
+		usage();
+	}
+	return rate;
+}
+
+/// parse --ionice CLASS[:LEVEL], CLASS is idle or be
+static void parse_ionice(const char *arg, cmd_opt *opt) {
+
+	const char *level = strchr(arg, ':');
+	size_t len = level ? (size_t)(level - arg) : strlen(arg);
+
+	opt->ioprio_level = 0;
+	if (len == 4 && !strncmp(arg, "idle", 4) && !level)
+		opt->ioprio_class = IOPRIO_CLASS_IDLE;
+	else if ((len == 2 && !strncmp(arg, "be", 2)) || (len == 11 && !strncmp(arg, "best-effort", 11))) {
+		opt->ioprio_class = IOPRIO_CLASS_BE;
+		opt->ioprio_level = 7;
+		if (level) {
+			char *end;
+
+			opt->ioprio_level = strtol(level + 1, &end, 10);
+			if (end == level + 1 || *end != '\0' || opt->ioprio_level < 0 || opt->ioprio_level > 7) {
+				fprintf(stderr, "Bad I/O priority level '%s', expected 0 to 7.\n", level + 1);
+				usage();
+			}
+		}
+	} else {
+		fprintf(stderr, "Bad I/O priority '%s', expected idle or be[:LEVEL].\n", arg);
+		usage();
+	}
+}
+
+#ifndef CHKIMG
+/// parse --range START:LEN, an empty or zero LEN means up to the end of the device
+static void parse_range(const char *arg, cmd_opt *opt) {
+
+	const char *p = parse_size(arg, &opt->range_start, &opt->range_start_blocks);
+
+	if (p == NULL || *p != ':') {
+		fprintf(stderr, "Bad range '%s', expected START:LEN.\n", arg);
+		usage();
+	}
+	opt->range_length = 0;
+	opt->range_length_blocks = 0;
+	if (*++p != '\0') {
+		p = parse_size(p, &opt->range_length, &opt->range_length_blocks);
+		if (p == NULL || *p != '\0') {
+			fprintf(stderr, "Bad range '%s', expected START:LEN.\n", arg);
+			usage();
+		}
+	}
+	opt->range = 1;
+}
+#endif
+
 const char *exec_name = "unset_name";
 
 const char* get_exec_name() {
@@ -363,6 +555,16 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "prog-second",        no_argument,	        NULL,   OPT_PROG_SEC },
 		{ "write-direct-io",	no_argument,	        NULL,   OPT_WRITE_DIRECT_IO },
 		{ "read-direct-io",	no_argument,	        NULL,   OPT_READ_DIRECT_IO },
+		{ "key-file",		required_argument,	NULL,   OPT_KEY_FILE },
+		{ "max-rate",		required_argument,	NULL,   OPT_MAX_RATE },
+		{ "max-read-rate",	required_argument,	NULL,   OPT_MAX_READ_RATE },
+		{ "max-write-rate",	required_argument,	NULL,   OPT_MAX_WRITE_RATE },
+		{ "ionice",		required_argument,	NULL,   OPT_IONICE },
+		{ "split",		required_argument,	NULL,   OPT_SPLIT },
+		{ "stripe",		required_argument,	NULL,   OPT_STRIPE },
+#ifdef FAULT_INJECT
+		{ "fault-inject",	required_argument,	NULL,   OPT_FAULT_INJECT },
+#endif
 // not RESTORE and not CHKIMG
 #ifndef CHKIMG
 #ifndef RESTORE
@@ -371,13 +573,22 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "compresscmd",	required_argument,	NULL,	'x' },
 		{ "restore",		no_argument,		NULL,   'r' },
 		{ "dev-to-dev",		no_argument,		NULL,   'b' },
+		{ "compare",		no_argument,		NULL,   OPT_COMPARE },
 #endif
 		{ "domain",		no_argument,		NULL,   'D' },
 		{ "offset_domain",	required_argument,	NULL,   OPT_OFFSET_DOMAIN },
 		{ "rescue",		no_argument,		NULL,   'R' },
+		{ "metadata-first",	no_argument,		NULL,   OPT_METADATA_FIRST },
+		{ "save-bitmap",	required_argument,	NULL,   OPT_SAVE_BITMAP },
+		{ "load-bitmap",	required_argument,	NULL,   OPT_LOAD_BITMAP },
+#ifdef EXTFS
+		{ "skip-unused-itable",	no_argument,		NULL,   OPT_SKIP_UNUSED_ITABLE },
+		{ "skip-clean-journal",	no_argument,		NULL,   OPT_SKIP_CLEAN_JOURNAL },
+#endif
 		{ "checksum-mode",       required_argument, NULL, 'a' },
 		{ "blocks-per-checksum", required_argument, NULL, 'k' },
 		{ "no-reseed",           no_argument,       NULL, 'K' },
+		{ "aligned",             no_argument,       NULL, OPT_ALIGNED },
 #endif
 #endif
 // not CHKIMG
@@ -391,6 +602,9 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "offset",		required_argument,	NULL,   'E' },
 		{ "btfiles",		no_argument,		NULL,   'T' },
 		{ "btfiles_torrent",	no_argument,		NULL,   't' },
+		{ "range",		required_argument,	NULL,   OPT_RANGE },
+		{ "verify",		no_argument,		NULL,   OPT_VERIFY },
+		{ "writeback-window",	required_argument,	NULL,   OPT_WRITEBACK_WINDOW },
 #endif
 #ifdef HAVE_LIBNCURSESW
 		{ "ncurses",		no_argument,		NULL,   'N' },
@@ -465,6 +679,40 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
                         case OPT_READ_DIRECT_IO:
                                 opt->read_direct_io = 1;
                                 break;
+			case OPT_KEY_FILE:
+				opt->key_file = optarg;
+				break;
+			case OPT_MAX_RATE:
+				opt->max_read_rate = opt->max_write_rate = parse_rate(optarg);
+				break;
+			case OPT_MAX_READ_RATE:
+				opt->max_read_rate = parse_rate(optarg);
+				break;
+			case OPT_MAX_WRITE_RATE:
+				opt->max_write_rate = parse_rate(optarg);
+				break;
+			case OPT_IONICE:
+				parse_ionice(optarg, opt);
+				break;
+			case OPT_SPLIT:
+			{
+				int in_blocks;
+				const char *end = parse_size(optarg, &opt->split_size, &in_blocks);
+
+				if (end == NULL || *end != '\0' || in_blocks || opt->split_size < VOLSET_MIN_SPLIT) {
+					fprintf(stderr, "Bad split size '%s', it must be at least 1m.\n", optarg);
+					usage();
+				}
+				break;
+			}
+			case OPT_STRIPE:
+				opt->stripe = optarg;
+				break;
+#ifdef FAULT_INJECT
+			case OPT_FAULT_INJECT:
+				opt->fault_spec = optarg;
+				break;
+#endif
 			case 'n':
 				memcpy(opt->note, optarg, NOTE_SIZE);
 				break;
@@ -515,6 +763,10 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 				opt->dd++;
 				mode=1;
 				break;
+			case OPT_COMPARE:
+				opt->compare++;
+				mode=1;
+				break;
 #endif
 			case 'D':
 				opt->domain++;
@@ -527,6 +779,21 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 			case 'R':
 				opt->rescue++;
 				break;
+			case OPT_METADATA_FIRST:
+				opt->metadata_first = 1;
+				break;
+			case OPT_SAVE_BITMAP:
+				opt->save_bitmap = optarg;
+				break;
+			case OPT_LOAD_BITMAP:
+				opt->load_bitmap = optarg;
+				break;
+			case OPT_SKIP_UNUSED_ITABLE:
+				opt->skip_unused_itable = 1;
+				break;
+			case OPT_SKIP_CLEAN_JOURNAL:
+				opt->skip_clean_journal = 1;
+				break;
 			case 'a':
                 assert(optarg != NULL);
 				opt->checksum_mode = convert_to_checksum_mode(atol(optarg));
@@ -538,6 +805,9 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 			case 'K':
 				opt->reseed_checksum = 0;
 				break;
+			case OPT_ALIGNED:
+				opt->aligned = 1;
+				break;
 #endif
 #endif
 #ifndef CHKIMG
@@ -569,6 +839,23 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
                 assert(optarg != NULL);
 				opt->offset = (off_t)atol(optarg);
 				break;
+			case OPT_RANGE:
+				parse_range(optarg, opt);
+				break;
+			case OPT_VERIFY:
+				opt->verify = 1;
+				break;
+			case OPT_WRITEBACK_WINDOW:
+			{
+				int in_blocks;
+				const char *end = parse_size(optarg, &opt->writeback_window, &in_blocks);
+
+				if (end == NULL || *end != '\0' || in_blocks || opt->writeback_window == 0) {
+					fprintf(stderr, "Bad writeback window '%s'.\n", optarg);
+					usage();
+				}
+				break;
+			}
 #endif
 #ifdef HAVE_LIBNCURSESW
 			case 'N':
@@ -623,15 +910,136 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	if (!opt->source)
 		opt->source = "-";
 
-	if (opt->clone || opt->domain) {
+	if (opt->clone || opt->domain || opt->compare) {
 		if ((!strcmp(opt->source, "-")) || (!opt->source)) {
 			fprintf(stderr, "Partclone can't %s from stdin.\nFor help, type: %s -h\n",
-				opt->clone ? "clone" : "make domain log",
+				opt->clone ? "clone" : opt->compare ? "compare" : "make domain log",
 				get_exec_name());
 			exit(1);
 		}
 	}
 
+	if (opt->range) {
+		if (!opt->restore || opt->chkimg) {
+			fprintf(stderr, "--range can only be used to restore an image.\n");
+			exit(1);
+		}
+		if (opt->blockfile || !strcmp(opt->target, "-")) {
+			fprintf(stderr, "--range needs a seekable target, not standard output or block files.\n");
+			exit(1);
+		}
+	}
+
+	if (volset_wanted(opt)) {
+		const char *image = opt->clone ? opt->target : opt->source;
+		const char *c;
+		int dirs = 1;
+
+		if (opt->split_size && opt->stripe) {
+			fprintf(stderr, "--split and --stripe can not be used together.\n");
+			exit(1);
+		}
+		if (!(opt->clone || opt->restore || opt->chkimg) || opt->dd || opt->domain || opt->compare) {
+			fprintf(stderr, "--split and --stripe can only be used to clone, restore or check an image.\n");
+			exit(1);
+		}
+		if (!strcmp(image, "-") || opt->compresscmd || opt->blockfile) {
+			fprintf(stderr, "--split and --stripe need an image name, not standard input or output, --compresscmd or block files.\n");
+			exit(1);
+		}
+		for (c = opt->stripe; c && *c; c++)
+			dirs += *c == ',';
+		if (dirs > VOLSET_MAX) {
+			fprintf(stderr, "--stripe takes at most %i directories.\n", VOLSET_MAX);
+			exit(1);
+		}
+	}
+
+	if (opt->verify) {
+		if (!(opt->restore || opt->dd || opt->ddd) || opt->chkimg) {
+			fprintf(stderr, "--verify can only be used to restore an image or to copy a device.\n");
+			exit(1);
+		}
+		if (opt->blockfile || !strcmp(opt->target, "-")) {
+			fprintf(stderr, "--verify needs a readable target, not standard output or block files.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->writeback_window) {
+		if (!(opt->restore || opt->dd || opt->ddd) || opt->chkimg) {
+			fprintf(stderr, "--writeback-window can only be used to restore an image or to copy a device.\n");
+			exit(1);
+		}
+		if (opt->blockfile || !strcmp(opt->target, "-")) {
+			fprintf(stderr, "--writeback-window needs a target file or device, not standard output or block files.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->save_bitmap || opt->load_bitmap) {
+		if (!(opt->clone || opt->dd || opt->domain || opt->compare)) {
+			fprintf(stderr, "--save-bitmap and --load-bitmap can only be used when the file system is read.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->skip_unused_itable || opt->skip_clean_journal) {
+		if (!opt->clone) {
+			fprintf(stderr, "--skip-unused-itable and --skip-clean-journal can only be used with --clone.\n");
+			exit(1);
+		}
+		/// the metadata is changed while the bitmap is read
+		if (opt->save_bitmap || opt->load_bitmap) {
+			fprintf(stderr, "--skip-unused-itable and --skip-clean-journal can not be used with --save-bitmap or --load-bitmap.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->metadata_first) {
+		if (!(opt->clone || opt->domain) || opt->dd || opt->compare) {
+			fprintf(stderr, "--metadata-first can only be used to clone or to make a domain log.\n");
+			exit(1);
+		}
+		/// the metadata is written ahead in the image and read back
+		if (opt->clone && (!strcmp(opt->target, "-") || opt->compresscmd || opt->blockfile || volset_wanted(opt))) {
+			fprintf(stderr, "--metadata-first needs an image file, not standard output, --compresscmd, block files, --split or --stripe.\n");
+			exit(1);
+		}
+		/// the metadata would be written in clear until its turn comes
+		if (opt->clone && opt->checksum_mode == CSM_AES256_GCM) {
+			fprintf(stderr, "--metadata-first can not be used to write encrypted images.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->checksum_mode == CSM_AES256_GCM) {
+
+		if (!opt->key_file) {
+			fprintf(stderr, "Encrypted images need a --key-file\n"
+				"Use --help to get more info.\n");
+			exit(1);
+		}
+
+		if (!opt->reseed_checksum) {
+			fprintf(stderr, "Encrypted images can not be created with --no-reseed\n"
+				"Use --help to get more info.\n");
+			exit(1);
+		}
+
+		if (opt->blockfile) {
+			fprintf(stderr, "Encrypted images can not be written as block files\n"
+				"Use --help to get more info.\n");
+			exit(1);
+		}
+	}
+
+	if (opt->aligned && opt->blockfile) {
+		fprintf(stderr, "Aligned images can not be written as block files\n"
+			"Use --help to get more info.\n");
+		exit(1);
+	}
+
 	if (opt->checksum_mode == CSM_NONE) {
 
 		if (opt->blocks_per_checksum > 0) {
@@ -702,7 +1110,7 @@ unsigned long long cnv_blocks_to_bytes(unsigned long long block_offset, unsigned
 		unsigned long copied_cs = get_checksum_count(block_offset, img_opt);
 		unsigned long newer_cs  = total_cs - copied_cs;
 
-		bytes_count += newer_cs * img_opt->checksum_size;
+		bytes_count += newer_cs * get_checksum_slot(block_size, img_opt);
 	}
 
 	return bytes_count;
@@ -853,22 +1261,47 @@ void open_log(char* source) {
 		fprintf(stderr, "open logfile %s error\n", source);
 		exit(1);
 	}
+	log_opt.logfile = source;
+}
+
+void log_set_options(const cmd_opt* opt) {
+	log_opt.ncurses = opt->ncurses;
+	log_opt.force = opt->force;
+	log_opt.logfile = opt->logfile;
+}
+
+static void log_mutex_init(void) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&log_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void log_lock(void) {
+	pthread_once(&log_mutex_once, log_mutex_init);
+	pthread_mutex_lock(&log_mutex);
+}
+
+void log_unlock(void) {
+	pthread_mutex_unlock(&log_mutex);
 }
 
 void log_mesg(int log_level, int log_exit, int log_stderr, int debug, const char *fmt, ...) {
 
 	va_list args;
-	extern cmd_opt opt;
 	char tmp_str[512];
 
-	if (log_level > debug && (!log_exit || opt.force))
+	if (log_level > debug && (!log_exit || log_opt.force))
 		return;
 
 	va_start(args, fmt);
 	vsnprintf(tmp_str, sizeof(tmp_str), fmt, args);
 	va_end(args);
 
-	if (opt.ncurses) {
+	log_lock();
+	if (log_opt.ncurses) {
 #ifdef HAVE_LIBNCURSESW
 		setlocale(LC_ALL, "");
 		bindtextdomain(PACKAGE, LOCALEDIR);
@@ -900,12 +1333,13 @@ void log_mesg(int log_level, int log_exit, int log_stderr, int debug, const char
 	/// clear message
 	fflush(msg);
 
-	/// exit if lexit true
-	if ((!opt.force) && log_exit) {
+	/// exit if lexit true, the lock is kept so no other thread writes after this
+	if ((!log_opt.force) && log_exit) {
 		close_ncurses();
-		fprintf(stderr, "Partclone fail, please check %s !\n", opt.logfile);
+		fprintf(stderr, "Partclone fail, please check %s !\n", log_opt.logfile);
 		exit(1);
 	}
+	log_unlock();
 }
 
 void close_log(void) {
@@ -984,7 +1418,8 @@ void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_syste
 		break;
 	}
 
-	case 0x0002: {
+	case 0x0002:
+	case 0x0003: {
 		uint32_t crc;
 
 		// Verify checksum
@@ -995,6 +1430,8 @@ void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_syste
 
 		load_image_desc_v2(fs_info, img_opt, buf_v2.head, buf_v2.fs_info, buf_v2.options, opt);
 		memcpy(img_head, &(buf_v2.head), sizeof(image_head_v2));
+		/// the layout of the data follows the version of the head
+		img_opt->image_version = img_version;
 		break;
 	}
 
@@ -1010,17 +1447,29 @@ void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_syste
 	} //switch
 }
 
-void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt) {
+/// fill the image description as written, with a new head when img_head is NULL
+static void init_image_desc_v2(image_desc_v2* buf_v2, const image_head_v2* img_head, file_system_info fs_info, image_options img_opt) {
 
-	image_desc_v2 buf_v2;
+	if (img_head)
+		memcpy(&buf_v2->head, img_head, sizeof(image_head_v2));
+	else {
+		init_image_head_v2(&buf_v2->head);
+		if (img_opt.image_version == 0x0003)
+			memcpy(buf_v2->head.version, IMAGE_VERSION_0003, IMAGE_VERSION_SIZE);
+	}
+
+	memcpy(&buf_v2->fs_info, &fs_info, sizeof(file_system_info));
+	memcpy(&buf_v2->options, &img_opt, sizeof(image_options));
+
+	init_crc32(&buf_v2->crc);
+	buf_v2->crc = crc32(buf_v2->crc, buf_v2, sizeof(image_desc_v2) - CRC32_SIZE);
+}
 
-	init_image_head_v2(&buf_v2.head);
+void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt) {
 
-	memcpy(&buf_v2.fs_info, &fs_info, sizeof(file_system_info));
-	memcpy(&buf_v2.options, &img_opt, sizeof(image_options));
+	image_desc_v2 buf_v2;
 
-	init_crc32(&buf_v2.crc);
-	buf_v2.crc = crc32(buf_v2.crc, &buf_v2, sizeof(image_desc_v2) - CRC32_SIZE);
+	init_image_desc_v2(&buf_v2, NULL, fs_info, img_opt);
 
 	if (write_all(ret, (char*)&buf_v2, sizeof(image_desc_v2), opt) != sizeof(image_desc_v2))
 		log_mesg(0, 1, 1, opt->debug, "error writing image header to image: %s\n", strerror(errno));
@@ -1082,7 +1531,8 @@ void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_op
 				log_mesg(0, 1, 1, debug, "write bitmap to image error: %s\n", strerror(errno));
 			break;
 
-		case 0x0002: {
+		case 0x0002:
+		case 0x0003: {
 
 			uint32_t crc;
 
@@ -1245,6 +1695,36 @@ unsigned long get_checksum_count(unsigned long long block_count, const image_opt
 		return block_count / blocks_per_cs;
 }
 
+/**
+ * return the bytes taken by each checksum in the image. In a version 0003
+ * image, zeros follow the checksum up to the next IMAGE_ALIGN boundary, so
+ * every strip of blocks_per_checksum blocks starts aligned.
+ */
+unsigned int get_checksum_slot(unsigned int block_size, const image_options *img_opt) {
+
+	unsigned long long strip = (unsigned long long)img_opt->blocks_per_checksum * block_size;
+
+	if (img_opt->image_version != 0x0003 || img_opt->blocks_per_checksum == 0)
+		return img_opt->checksum_size;
+
+	return (strip + img_opt->checksum_size + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN - strip;
+}
+
+/// return where the data starts in the image: after the head, the bitmap and the cipher head, aligned in version 0003
+unsigned long long get_image_data_offset(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	unsigned long long offset = sizeof(image_desc_v2) + get_bitmap_size_on_disk(fs_info, img_opt, opt);
+
+	if (img_opt->bitmap_mode != BM_NONE)
+		offset += CRC32_SIZE;
+	if (img_opt->checksum_mode == CSM_AES256_GCM)
+		offset += sizeof(image_cipher_head);
+	if (img_opt->image_version == 0x0003)
+		offset = (offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+	return offset;
+}
+
 void update_used_blocks_count(file_system_info* fs_info, unsigned long* bitmap) {
 
 	unsigned long long used = 0;
@@ -1258,6 +1738,23 @@ void update_used_blocks_count(file_system_info* fs_info, unsigned long* bitmap)
 	fs_info->usedblocks = used;
 }
 
+/// default for the file systems that keep nothing open between calls
+void __attribute__((weak)) fs_session_close(void) {
+}
+
+/// default for the file systems that store the blocks as they are
+void __attribute__((weak)) fs_patch_blocks(unsigned long long block, unsigned long long count, char* buffer) {
+}
+
+/// default for the file systems that do not tell their metadata apart
+int __attribute__((weak)) read_metadata_bitmap(char* device, file_system_info fs_info, unsigned long* metadata) {
+	return 0;
+}
+
+/// default for the file systems that keep no list of bad blocks
+unsigned long long __attribute__((weak)) read_bad_blocks(char* device, file_system_info fs_info, unsigned long* bad) {
+	return 0;
+}
 
 unsigned long long get_bitmap_size_on_disk(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt)
 {
@@ -1364,14 +1861,15 @@ void check_mem_size(file_system_info fs_info, image_options img_opt, cmd_opt opt
 	const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
 
 	const unsigned long long raw_io_size = buffer_capacity * block_size;
-	unsigned long long cs_size = 0, needed_size = 0;
-	void *test_bitmap, *test_read, *test_write;
+	unsigned long long cs_size = 0, needed_size = 0, available = 0;
+	char line[128];
+	FILE *meminfo;
 
 	if (img_opt.checksum_mode != CSM_NONE) {
 
 		unsigned long long cs_in_buffer = buffer_capacity / blkcs;
 
-		cs_size = cs_in_buffer * img_opt.checksum_size;
+		cs_size = cs_in_buffer * get_checksum_slot(block_size, &img_opt);
 	}
 
 	needed_size = bitmap_size + 2 * raw_io_size + cs_size;
@@ -1379,16 +1877,22 @@ void check_mem_size(file_system_info fs_info, image_options img_opt, cmd_opt opt
 	log_mesg(0, 0, 0, 1, "memory needed: %llu bytes\nbitmap %llu bytes, blocks 2*%llu bytes, checksum %llu bytes\n",
 		needed_size, bitmap_size, raw_io_size, cs_size);
 
-	test_bitmap = malloc(bitmap_size);
-	test_read   = malloc(raw_io_size);
-	test_write  = malloc(raw_io_size + cs_size);
+	/// ask the kernel instead of trial allocations, which always succeed with overcommit
+	meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo == NULL)
+		return;
+	while (fgets(line, sizeof(line), meminfo)) {
+		unsigned long long kb;
+
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1 || sscanf(line, "SwapFree: %llu kB", &kb) == 1)
+			available += kb * 1024;
+	}
+	fclose(meminfo);
 
-    free(test_bitmap);
-    free(test_read);
-    free(test_write);
-	if (test_bitmap == NULL || test_read == NULL || test_write == NULL) {
-        log_mesg(0, 1, 1, opt.debug, "There is not enough free memory, partclone suggests you should have %llu bytes memory\n", needed_size);
-    }
+	log_mesg(1, 0, 0, opt.debug, "memory available: %llu bytes\n", available);
+	if (available && needed_size > available) {
+		log_mesg(0, 1, 1, opt.debug, "There is not enough free memory, partclone suggests you should have %llu bytes memory\n", needed_size);
+	}
 }
 
 void load_image_bitmap_bits(int* ret, cmd_opt opt, file_system_info fs_info, unsigned long* bitmap) {
@@ -1483,6 +1987,164 @@ void load_image_bitmap(int* ret, cmd_opt opt, file_system_info fs_info, image_op
 	}
 }
 
+/// fill the key check of the cipher head from the derived key
+static void get_cipher_key_check(const unsigned char* key, unsigned char* check) {
+
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+
+	SHA256(key, CIPHER_KEY_SIZE, digest);
+	memcpy(check, digest, sizeof(((image_cipher_head*)0)->key_check));
+}
+
+/**
+ * HMAC-SHA256 of the image description, the bitmap and the cipher head up to
+ * head_mac, with a key derived from the data key. GCM authenticates the data
+ * only, the CRC32s of the head and the bitmap catch damage but not changes.
+ */
+static int get_cipher_head_mac(const unsigned char* key, const image_head_v2* img_head, file_system_info fs_info,
+	image_options img_opt, const unsigned long* bitmap, const image_cipher_head* head, unsigned char* mac) {
+
+	static const char label[] = "partclone image head";
+	unsigned char mac_key[SHA256_DIGEST_LENGTH], digest[SHA256_DIGEST_LENGTH];
+	const unsigned char* bits = (const unsigned char*)bitmap;
+	unsigned long long bytes = BITS_TO_BYTES(fs_info.totalblock);
+	unsigned char last;
+	unsigned int size;
+	image_desc_v2 desc;
+	EVP_MD_CTX* ctx;
+	int ok;
+
+	init_image_desc_v2(&desc, img_head, fs_info, img_opt);
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL)
+		return -1;
+	ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+	     EVP_DigestUpdate(ctx, &desc, sizeof(desc)) == 1;
+	/// the bits past the last block are not stored the same way in every bitmap mode
+	if (ok && bytes) {
+		last = bits[bytes - 1];
+		if (fs_info.totalblock % 8)
+			last &= (1 << (fs_info.totalblock % 8)) - 1;
+		ok = EVP_DigestUpdate(ctx, bits, bytes - 1) == 1 &&
+		     EVP_DigestUpdate(ctx, &last, 1) == 1;
+	}
+	ok = ok && EVP_DigestUpdate(ctx, head, offsetof(image_cipher_head, head_mac)) == 1 &&
+	     EVP_DigestFinal_ex(ctx, digest, NULL) == 1;
+	EVP_MD_CTX_free(ctx);
+
+	ok = ok && HMAC(EVP_sha256(), key, CIPHER_KEY_SIZE, (const unsigned char*)label, sizeof(label) - 1, mac_key, &size) &&
+	     HMAC(EVP_sha256(), mac_key, sizeof(mac_key), digest, sizeof(digest), mac, &size);
+	memset(mac_key, 0, sizeof(mac_key));
+	return ok ? 0 : -1;
+}
+
+/**
+ * Write the cipher head of a CSM_AES256_GCM image after the bitmap, and load
+ * the key and nonce into the checksum module to encrypt the data.
+ */
+void write_image_cipher(int* ret, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt) {
+
+	image_cipher_head head;
+	unsigned char key[CIPHER_KEY_SIZE];
+	uint32_t crc;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, CIPHER_MAGIC, CIPHER_MAGIC_SIZE);
+	head.kdf_iterations = CIPHER_KDF_ITERATIONS;
+	if (RAND_bytes(head.salt, sizeof(head.salt)) != 1 || RAND_bytes(head.nonce, sizeof(head.nonce)) != 1)
+		log_mesg(0, 1, 1, opt->debug, "Unable to get random bytes for the cipher\n");
+
+	if (derive_cipher_key(opt->key_file, head.salt, sizeof(head.salt), head.kdf_iterations, key) != 0)
+		log_mesg(0, 1, 1, opt->debug, "Unable to read key file %s, or it is larger than %i bytes\n", opt->key_file, CIPHER_KEY_FILE_MAX);
+	get_cipher_key_check(key, head.key_check);
+	if (get_cipher_head_mac(key, NULL, fs_info, img_opt, bitmap, &head, head.head_mac) != 0)
+		log_mesg(0, 1, 1, opt->debug, "Unable to authenticate the image head\n");
+
+	init_crc32(&crc);
+	head.crc = crc32(crc, &head, sizeof(head) - sizeof(head.crc));
+
+	if (write_all(ret, (char*)&head, sizeof(head), opt) != sizeof(head))
+		log_mesg(0, 1, 1, opt->debug, "write cipher head to image error: %s\n", strerror(errno));
+
+	init_cipher(key, head.nonce, 1);
+	memset(key, 0, sizeof(key));
+}
+
+/**
+ * Read the cipher head of a CSM_AES256_GCM image, check the key from the key
+ * file and the head and bitmap loaded before, then load the key into the
+ * checksum module to decrypt the data.
+ */
+void load_image_cipher(int* ret, const image_head_v2* img_head, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt) {
+
+	image_cipher_head head;
+	unsigned char key[CIPHER_KEY_SIZE];
+	unsigned char check[sizeof(head.key_check)];
+	unsigned char mac[sizeof(head.head_mac)];
+	uint32_t crc;
+
+	if (read_all(ret, (char*)&head, sizeof(head), opt) != sizeof(head))
+		log_mesg(0, 1, 1, opt->debug, "read cipher head from image error: %s\n", strerror(errno));
+
+	init_crc32(&crc);
+	crc = crc32(crc, &head, sizeof(head) - sizeof(head.crc));
+	if (memcmp(head.magic, CIPHER_MAGIC, CIPHER_MAGIC_SIZE) || crc != head.crc ||
+	    head.kdf_iterations == 0 || head.kdf_iterations > CIPHER_KDF_ITERATIONS_MAX)
+		log_mesg(0, 1, 1, opt->debug, "Invalid cipher head in image\n");
+
+	if (!opt->key_file)
+		log_mesg(0, 1, 1, opt->debug, "The image is encrypted, use --key-file\n");
+	if (derive_cipher_key(opt->key_file, head.salt, sizeof(head.salt), head.kdf_iterations, key) != 0)
+		log_mesg(0, 1, 1, opt->debug, "Unable to read key file %s, or it is larger than %i bytes\n", opt->key_file, CIPHER_KEY_FILE_MAX);
+
+	get_cipher_key_check(key, check);
+	if (memcmp(check, head.key_check, sizeof(check)))
+		log_mesg(0, 1, 1, opt->debug, "The key file does not match the image\n");
+
+	/// the key is right, a different head or bitmap has been changed since
+	if (get_cipher_head_mac(key, img_head, fs_info, img_opt, bitmap, &head, mac) != 0 ||
+	    CRYPTO_memcmp(mac, head.head_mac, sizeof(mac)))
+		log_mesg(0, 1, 1, opt->debug, "The image head or bitmap has been modified, it does not match the key\n");
+
+	init_cipher(key, head.nonce, 0);
+	memset(key, 0, sizeof(key));
+}
+
+/**
+ * Write the zeros that align the data of a version 0003 image, after the
+ * bitmap and the cipher head.
+ */
+void write_image_padding(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt) {
+
+	char zeros[IMAGE_ALIGN];
+	unsigned long long offset = get_image_data_offset(&fs_info, &img_opt, opt);
+
+	if (img_opt.image_version != 0x0003)
+		return;
+
+	img_opt.image_version = 0x0002;
+	offset -= get_image_data_offset(&fs_info, &img_opt, opt);
+	memset(zeros, 0, sizeof(zeros));
+	if (offset && write_all(ret, zeros, offset, opt) != (int)offset)
+		log_mesg(0, 1, 1, opt->debug, "write padding to image error: %s\n", strerror(errno));
+}
+
+/// skip the zeros that align the data of a version 0003 image, the image may be a pipe
+void load_image_padding(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt) {
+
+	char pad[IMAGE_ALIGN];
+	unsigned long long offset = get_image_data_offset(&fs_info, &img_opt, opt);
+
+	if (img_opt.image_version != 0x0003)
+		return;
+
+	img_opt.image_version = 0x0002;
+	offset -= get_image_data_offset(&fs_info, &img_opt, opt);
+	if (offset && read_all(ret, pad, offset, opt) != (int)offset)
+		log_mesg(0, 1, 1, opt->debug, "read padding from image error: %s\n", strerror(errno));
+}
+
 /**
  * for open and close
  * open_source	- open device or image or stdin
@@ -1565,7 +2227,7 @@ int open_source(char* source, cmd_opt* opt) {
 	    }
 	    log_mesg(1, 0, 0, debug, "ddd source file(0) or device(1) ? %i \n", ddd_block_device);
 	}
-	if ((opt->clone) || (opt->dd) || (opt->domain) || (ddd_block_device == 1)) { /// always is device, clone from device=source
+	if ((opt->clone) || (opt->dd) || (opt->domain) || (opt->compare) || (ddd_block_device == 1)) { /// always is device, clone from device=source
 
 		mp = malloc(PATH_MAX + 1);
 		if (!mp)
@@ -1675,9 +2337,8 @@ int open_target(char* target, cmd_opt* opt) {
 		    mp = NULL;
 		}
 
-		/// check block device
-		stat(target, &st_dev);
-		if (!S_ISBLK(st_dev.st_mode)) {
+		/// check block device, a missing target is created
+		if (stat(target, &st_dev) == -1 || !S_ISBLK(st_dev.st_mode)) {
                     if ((opt->dd) && (!opt->overwrite)){
                         log_mesg(1, 0, 1, debug, "Warning, device(%s) not exist?! Use option --overwrite if you want to CREATE special file\n", target);
 			log_mesg(0, 1, 1, debug, "error exit\n");
@@ -1733,14 +2394,16 @@ int write_block_file(char* target, char *buf, unsigned long long count, unsigned
 	//extern unsigned long long rescue_write_size;
 	int flags = O_WRONLY | O_LARGEFILE | O_CREAT ;
         int torrent_fd = 0;
-	char *block_filename = malloc(PATH_MAX + 1);
+	char block_filename[PATH_MAX + 1];
 	log_mesg(0, 0, 0,debug,  "offset %lld, size %lld\n", offset, count);
-	sprintf(block_filename,"%s/%032llx", target, offset);
+	snprintf(block_filename, sizeof(block_filename), "%s/%032llx", target, offset);
 	
 	if ((torrent_fd = open (block_filename, flags, S_IRUSR)) == -1) {
 	    log_mesg(0, 0, 1, debug, "%s,%s,%i: open %s error(%i)\n", __FILE__, __func__, __LINE__, block_filename, errno);
 	}
 
+	io_limit(1, count);
+
 	// for sync I/O buffer, when use stdin or pipe.
 	while (count > 0) {
 	    i = write(torrent_fd, buf, count);
@@ -1748,12 +2411,14 @@ int write_block_file(char* target, char *buf, unsigned long long count, unsigned
 	    if (i < 0) {
 		log_mesg(1, 0, 1, debug, "%s: errno = %i(%s)\n",__func__, errno, strerror(errno));
 		if (errno != EAGAIN && errno != EINTR) {
+		    close(torrent_fd);
 		    return -1;
 		}
 	    } else if (i == 0) {
 		log_mesg(1, 0, 1, debug, "%s: nothing to read. errno = %i(%s)\n",__func__, errno, strerror(errno));
 		rescue_write_size = size - count;
 		log_mesg(1, 0, 0, debug, "%s: rescue write size = %llu\n",__func__, rescue_write_size);
+		close(torrent_fd);
 		return 0;
 	    } else {
 		count -= i;
@@ -1772,13 +2437,21 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 	unsigned long long size = count;
 	//extern unsigned long long rescue_write_size;
 
+	io_limit(do_write, count);
+
 	// for sync I/O buffer, when use stdin or pipe.
 	while (count > 0) {
 		if (do_write) {
-			i = write(*fd, buf, count);
+			i = fault_write(*fd, buf, count);
                 } else {
-			i = read(*fd, buf, count);
+			i = fault_read(*fd, buf, count);
                 }
+		if (i < 0 && errno == EINVAL && (fcntl(*fd, F_GETFL) & O_DIRECT)) {
+			/// an unaligned buffer, size or offset, go on through the cache
+			log_mesg(1, 0, 0, debug, "%s: O_DIRECT refused, fall back to buffered I/O\n", __func__);
+			if (fcntl(*fd, F_SETFL, fcntl(*fd, F_GETFL) & ~O_DIRECT) == 0)
+				continue;
+		}
 		if (i < 0) {
 			log_mesg(1, 0, 1, debug, "%s: errno = %i(%s)\n",__func__, errno, strerror(errno));
 			if (errno != EAGAIN && errno != EINTR) {
@@ -1848,6 +2521,27 @@ long long skip_bytes(int *fd, char *empty_buffer, unsigned long long empty_buffe
 	return completed;
 }
 
+/// move the source forward by count bytes, reading them into buffer when the source can not seek
+int skip_source(int *fd, char *buffer, unsigned int buffer_size, unsigned long long count, cmd_opt *opt) {
+
+	unsigned int r_size;
+
+	if (count == 0)
+		return 0;
+	if (lseek(*fd, (off_t)count, SEEK_CUR) != (off_t)-1)
+		return 0;
+	if (errno != ESPIPE)
+		return -1;
+
+	while (count) {
+		r_size = count < buffer_size ? count : buffer_size;
+		if (read_all(fd, buffer, r_size, opt) != (int)r_size)
+			return -1;
+		count -= r_size;
+	}
+	return 0;
+}
+
 int skip_blocks(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt, unsigned long long *block_id) {
 	unsigned long long i;
 	int w_size;
@@ -1887,6 +2581,8 @@ void print_opt(cmd_opt opt) {
 		log_mesg(1, 0, 0, debug, "MODE: create domain log for ddrescue\n");
 	else if (opt.ddd)
 		log_mesg(1, 0, 0, debug, "MODE: work like command dd\n");
+	else if (opt.compare)
+		log_mesg(1, 0, 0, debug, "MODE: compare device with image\n");
 
 	log_mesg(1, 0, 0, debug, "DEBUG: %i\n", opt.debug);
 	log_mesg(1, 0, 0, debug, "SOURCE: %s\n", opt.source);
@@ -1941,6 +2637,8 @@ void print_partclone_info(cmd_opt opt) {
 		    log_mesg(0, 0, 1, debug, _("Starting to clone/restore (%s) to (%s) with dd mode\n"), opt.source, opt.target);
 	else if (opt.info)
 		log_mesg(0, 0, 1, debug, _("Showing info of image (%s)\n"), opt.source);
+	else if (opt.compare)
+		log_mesg(0, 0, 1, debug, _("Starting to compare device (%s) with image (%s)\n"), opt.source, opt.target);
 	else
 		log_mesg(0, 0, 1, debug, _("Unknown mode\n"));
 	if ( strlen(opt.note) > 0 ){
@@ -2046,4 +2744,6 @@ void print_finish_info(cmd_opt opt) {
 		log_mesg(0, 0, 1, debug, _("Partclone successfully cloned the device (%s) to the device (%s)\n"), opt.source, opt.target);
 	else if (opt.domain)
 		log_mesg(0, 0, 1, debug, _("Partclone successfully mapped the device (%s) to the domain log (%s)\n"), opt.source, opt.target);
+	else if (opt.compare)
+		log_mesg(0, 0, 1, debug, _("Partclone found the device (%s) and the image (%s) identical\n"), opt.source, opt.target);
 }
@@ -47,11 +47,13 @@
 #define f2fs_MAGIC "F2FS"
 #define nilfs_MAGIC "NILFS"
 #define apfs_MAGIC "APFS"
+#define swap_MAGIC "SWAP"
 #define raw_MAGIC "raw"
 
 #define IMAGE_VERSION_SIZE 4
 #define IMAGE_VERSION_0001 "0001"
 #define IMAGE_VERSION_0002 "0002"
+#define IMAGE_VERSION_0003 "0003"  /// 0002 with its data aligned, see IMAGE_ALIGN
 #define IMAGE_VERSION_CURRENT IMAGE_VERSION_0002
 #define PARTCLONE_VERSION_SIZE (FS_MAGIC_SIZE-1)
 #define DEFAULT_BUFFER_SIZE 1048576
@@ -59,6 +61,7 @@
 #define CRC32_SIZE 4
 #define NOTE_SIZE 128
 #define BSIZE 512
+#define IMAGE_ALIGN 4096           /// the data and each strip of a 0003 image start on it
 
 // Reference: ntfsclone.c
 #define KBYTE (1000)
@@ -133,6 +136,58 @@ struct cmd_opt
     int checksum_mode;
     int reseed_checksum;
     unsigned long blocks_per_checksum;
+
+    /// key file for CSM_AES256_GCM images
+    char* key_file;
+
+    /// --range: restore only a window of the device
+    int range;
+    unsigned long long range_start;
+    unsigned long long range_length;
+    int range_start_blocks;   /// range_start is in blocks, not bytes
+    int range_length_blocks;  /// range_length is in blocks, not bytes
+
+    /// --verify: read the target back after writing
+    int verify;
+
+    /// --compare: compare the source device with the image in target
+    int compare;
+
+    /// --max-rate, --max-read-rate, --max-write-rate: bytes per second, 0 for no limit
+    unsigned long long max_read_rate;
+    unsigned long long max_write_rate;
+
+    /// --ionice: IOPRIO_CLASS_* of iolimit.h and level
+    int ioprio_class;
+    int ioprio_level;
+
+    /// --writeback-window: bytes left dirty behind the writer, 0 when off
+    unsigned long long writeback_window;
+
+    /// --save-bitmap, --load-bitmap: bitmap file written or used instead of read_bitmap()
+    char* save_bitmap;
+    char* load_bitmap;
+
+    /// --skip-unused-itable: leave the never used ext4 inode tables out of the image
+    int skip_unused_itable;
+
+    /// --skip-clean-journal: leave the journal of a clean file system out of the image
+    int skip_clean_journal;
+
+    /// --aligned: write an image of version 0003
+    int aligned;
+
+    /// --split: size of the volumes of the image, 0 for a single file
+    unsigned long long split_size;
+
+    /// --stripe: the comma separated directories holding the stripes of the image
+    char* stripe;
+
+    /// --fault-inject: file of the I/O faults to inject, built with --enable-fault-inject
+    char* fault_spec;
+
+    /// --metadata-first: copy or map the file system metadata before the data
+    int metadata_first;
 };
 typedef struct cmd_opt cmd_opt;
 
@@ -256,6 +311,128 @@ typedef struct
 
 } image_desc_v2;
 
+#define CIPHER_MAGIC      "PCCIPHER"
+#define CIPHER_MAGIC_SIZE 8
+#define CIPHER_SALT_SIZE  16
+#define CIPHER_KDF_ITERATIONS 200000
+/// more rounds are refused, the head could keep the restore busy for days
+#define CIPHER_KDF_ITERATIONS_MAX (16 * CIPHER_KDF_ITERATIONS)
+
+/// follows the bitmap when checksum_mode is CSM_AES256_GCM
+typedef struct
+{
+	char     magic[CIPHER_MAGIC_SIZE];
+
+	/// PBKDF2-HMAC-SHA256 parameters to derive the key from the key file
+	uint32_t kdf_iterations;
+	unsigned char salt[CIPHER_SALT_SIZE];
+
+	/// xor'ed with the sequence number of each checksum chunk to make its IV
+	unsigned char nonce[12];
+
+	/// first bytes of SHA-256(key), to tell a wrong key from damaged data
+	unsigned char key_check[16];
+
+	/// HMAC-SHA256 of the image head, the bitmap and this head up to here
+	unsigned char head_mac[32];
+
+	uint32_t crc;
+
+} image_cipher_head;
+
+#define BITMAP_FILE_MAGIC      "PCBITMAP"
+#define BITMAP_FILE_MAGIC_SIZE 8
+#define FS_IDENTITY_SIZE       32
+
+/// head of a --save-bitmap file, the bitmap as in BM_BIT images and its crc32 follow
+typedef struct
+{
+	char     magic[BITMAP_FILE_MAGIC_SIZE];
+
+	/// 0xC0DE = little-endian, 0xDEC0 = big-endian
+	uint16_t endianess;
+
+	/// from get_fs_identity(), changes when the file system is written
+	unsigned char identity[FS_IDENTITY_SIZE];
+
+	file_system_info_v2 fs_info;
+
+	uint32_t crc;
+
+} bitmap_file_head;
+
+#define OVERLAY_MAGIC      "PCOVRLAY"
+#define OVERLAY_MAGIC_SIZE 8
+
+/// head of a partclone.nbd --overlay file, the bitmap of the written blocks
+/// follows, the blocks are at data_offset + their offset in the device
+typedef struct
+{
+	char     magic[OVERLAY_MAGIC_SIZE];
+
+	/// 0xC0DE = little-endian, 0xDEC0 = big-endian
+	uint16_t endianess;
+
+	/// crc32 of the bitmap of the image under the overlay
+	uint32_t image_crc;
+
+	file_system_info_v2 fs_info;
+
+	/// bits in the bitmap, the blocks of the exported disk
+	unsigned long long blocks;
+	unsigned long long data_offset;
+
+	uint32_t crc;
+
+} overlay_head;
+
+#define REPO_MANIFEST_MAGIC "PCREPMAN"
+#define REPO_MAGIC_SIZE     8
+#define REPO_HASH_SIZE      32
+
+/// a chunk in the packs of a repository, the entries of its index and of
+/// its manifests
+typedef struct
+{
+	/// SHA-256 of the data of the chunk
+	unsigned char hash[REPO_HASH_SIZE];
+
+	/// the chunk is length bytes at offset of packs/<pack>.pack
+	uint32_t pack;
+	uint32_t length;
+	unsigned long long offset;
+
+} repo_chunk;
+
+/// head of an image in a repository: the image up to its data, the chunks
+/// of the ranges with used blocks and the checksums of the image follow
+typedef struct
+{
+	char     magic[REPO_MAGIC_SIZE];
+
+	/// 0xC0DE = little-endian, 0xDEC0 = big-endian
+	uint16_t endianess;
+
+	/// the head, the bitmap and the cipher head of the image
+	unsigned long long prefix_size;
+
+	/// blocks of the device in each chunk
+	uint32_t chunk_blocks;
+	unsigned long long chunks;
+
+	/// the checksums of the image, the data is left out
+	unsigned long long checksums_size;
+
+	/// the size of the image it gives back
+	unsigned long long image_size;
+
+	/// crc32 of what follows the head
+	uint32_t data_crc;
+
+	uint32_t crc;
+
+} repo_manifest_head;
+
 #pragma pack(pop)
 
 // Use these typedefs when a function handles the current version and use the
@@ -269,6 +446,8 @@ extern image_options img_opt;
 extern void usage(void);
 extern void print_version(void);
 extern void parse_options(int argc, char **argv, cmd_opt* opt);
+/// parse a size with an optional k, m, g or t suffix, or b for blocks, return the end or NULL
+extern const char *parse_size(const char *str, unsigned long long *value, int *in_blocks);
 
 /** 
  * Ncurses Text User Interface
@@ -288,15 +467,26 @@ extern void close_ncurses();
 extern void open_log(char* source);
 extern void log_mesg(int lerrno, int lexit, int only_debug, int debug, const char *fmt, ...);
 extern void close_log();
+
+/**
+ * log_set_options	- give log_mesg the options it needs, once they are final
+ * log_lock		- serialise the output of log_mesg and update_pui, recursive
+ */
+extern void log_set_options(const cmd_opt* opt);
+extern void log_lock(void);
+extern void log_unlock(void);
 extern int io_all(int *fd, char *buffer, unsigned long long count, int do_write, cmd_opt *opt);
 extern void sync_data(int fd, cmd_opt* opt);
 extern void rescue_sector(int *fd, unsigned long long pos, char *buff, cmd_opt *opt);
 extern long long skip_bytes(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt);
+extern int skip_source(int *fd, char *buffer, unsigned int buffer_size, unsigned long long count, cmd_opt *opt);
 extern int skip_blocks(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt, unsigned long long *block_id);
 
 extern unsigned long long cnv_blocks_to_bytes(unsigned long long block_offset, unsigned int block_count, unsigned int block_size, const image_options* img_opt);
 extern unsigned long long get_bitmap_size_on_disk(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
 extern unsigned long get_checksum_count(unsigned long long block_count, const image_options *img_opt);
+extern unsigned int get_checksum_slot(unsigned int block_size, const image_options *img_opt);
+extern unsigned long long get_image_data_offset(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
 extern void update_used_blocks_count(file_system_info* fs_info, unsigned long* bitmap);
 
 extern void init_fs_info(file_system_info* fs_info);
@@ -305,6 +495,10 @@ extern void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, fil
 extern void load_image_bitmap(int* ret, cmd_opt opt, file_system_info fs_info, image_options img_opt, unsigned long* bitmap);
 extern void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt);
 extern void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt);
+extern void write_image_cipher(int* ret, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt);
+extern void load_image_cipher(int* ret, const image_head_v2* img_head, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt);
+extern void write_image_padding(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt);
+extern void load_image_padding(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt);
 
 extern const char *get_bitmap_mode_str(bitmap_mode_t bitmap_mode);
 
@@ -314,6 +508,48 @@ extern const char *get_bitmap_mode_str(bitmap_mode_t bitmap_mode);
  */
 extern void read_super_blocks(char* device, file_system_info* fs_info);
 extern void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui);
+
+/**
+ * A file system may stay open from read_super_blocks() to read_bitmap(), so the
+ * library state and its cached metadata are loaded once. fs_session_close()
+ * ends that session, main calls it when the bitmap is read. The default in
+ * partclone.c does nothing, for the modules that open the device in each call.
+ */
+extern void fs_session_close(void);
+
+/**
+ * Change the blocks read from the device before they go into the image,
+ * buffer holds count blocks from block. It is called by the clone loop, in
+ * block order. The default in partclone.c changes nothing.
+ */
+extern void fs_patch_blocks(unsigned long long block, unsigned long long count, char* buffer);
+
+/**
+ * Set in metadata the bits of the blocks holding the file system metadata,
+ * like the super blocks, the group descriptors, the allocation bitmaps and
+ * the inode tables, and return 1. It is called after read_bitmap(), before
+ * fs_session_close(). The default in partclone.c sets nothing and returns 0,
+ * for the file systems that do not tell their metadata apart.
+ */
+extern int read_metadata_bitmap(char* device, file_system_info fs_info, unsigned long* metadata);
+
+/**
+ * Set in bad the bits of the blocks the file system knows to be bad, like
+ * the ext2/3/4 bad blocks inode or the NTFS $BadClus, and return how many.
+ * They are not read: the used ones are copied as zeros and the domain log
+ * marks them bad. It is called after read_bitmap(), before
+ * fs_session_close(). The default in partclone.c sets nothing.
+ */
+extern unsigned long long read_bad_blocks(char* device, file_system_info fs_info, unsigned long* bad);
+
+/**
+ * Fill identity with FS_IDENTITY_SIZE bytes that change whenever the file
+ * system is written, from its UUID and the generation or write counters it
+ * keeps, and return 1. It is called after read_super_blocks() to key the
+ * bitmap files. The default in bitmapfile.c returns 0, and --save-bitmap and
+ * --load-bitmap are refused for the file system.
+ */
+extern int get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity);
 /**
  * for open and close
  * open_source	- open device or image or stdin
@@ -351,6 +587,8 @@ extern void print_image_info(image_head_v2 img_head, image_options img_opt, cmd_
 extern void print_opt(cmd_opt opt);
 /// print finish mesg
 extern void print_finish_info(cmd_opt opt);
+/// format a byte count as a short human readable string (11 bytes buffer)
+extern void print_readable_size_str(unsigned long long size_byte, char *new_size_str);
 
 /// get partition size
 extern unsigned long long get_partition_size(int* ret);
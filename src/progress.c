@@ -18,6 +18,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "config.h"
 #include "progress.h"
 #include "gettext.h"
@@ -36,6 +39,13 @@ int BUFSIZE = 50;
 #define PUI_DEBUG 1
 
 int PUI;
+
+/// the counters published by the worker and the stop flag of the progress thread
+static atomic_ullong published_copied;
+static atomic_ullong published_current;
+static int progress_stopped;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
 unsigned long RES=0;
 
 /// initial progress bar
@@ -102,10 +112,56 @@ extern void update_pui(struct progress_bar *prog, unsigned long long copied, uns
 	if ((difftime(time(0), prog->resolution_time) < prog->interval_time) && copied != 0)
 	    return;
     }
+    log_lock();
     if (prog->pui == NCURSES)
         Ncurses_progress_update(prog, copied, current, done);
     else if (prog->pui == TEXT)
         progress_update(prog, copied, current, done);
+    log_unlock();
+}
+
+/// reset the counters before a progress thread is started
+extern void progress_start(void){
+    atomic_store(&published_copied, 0);
+    atomic_store(&published_current, 0);
+    pthread_mutex_lock(&progress_lock);
+    progress_stopped = 0;
+    pthread_mutex_unlock(&progress_lock);
+}
+
+/// called by the worker, only plain stores, it may be called for each block
+extern void progress_publish(unsigned long long copied, unsigned long long current){
+    atomic_store_explicit(&published_copied, copied, memory_order_relaxed);
+    atomic_store_explicit(&published_current, current, memory_order_relaxed);
+}
+
+extern void progress_peek(unsigned long long *copied, unsigned long long *current){
+    *copied = atomic_load_explicit(&published_copied, memory_order_relaxed);
+    *current = atomic_load_explicit(&published_current, memory_order_relaxed);
+}
+
+/// sleep up to seconds, return 1 when the worker is done
+extern int progress_wait(unsigned long seconds){
+    struct timespec until;
+    int stopped;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += seconds;
+    pthread_mutex_lock(&progress_lock);
+    while (!progress_stopped)
+	if (pthread_cond_timedwait(&progress_cond, &progress_lock, &until) == ETIMEDOUT)
+	    break;
+    stopped = progress_stopped;
+    pthread_mutex_unlock(&progress_lock);
+    return stopped;
+}
+
+/// wake the progress thread up for its last round
+extern void progress_stop(void){
+    pthread_mutex_lock(&progress_lock);
+    progress_stopped = 1;
+    pthread_cond_broadcast(&progress_cond);
+    pthread_mutex_unlock(&progress_lock);
 }
 
 static void calculate_speed(struct progress_bar *prog, unsigned long long copied, unsigned long long current, int done, prog_stat_t *prog_stat){
@@ -60,3 +60,17 @@ extern void progress_init(struct progress_bar *prog, int start, unsigned long lo
 /// update number
 extern void progress_update(struct progress_bar *prog, unsigned long long copied, unsigned long long current, int done);
 extern void Ncurses_progress_update(struct progress_bar *prog, unsigned long long copied, unsigned long long current, int done);
+
+/**
+ * Threading model: the thread doing the work owns its counters and is the
+ * only one to write them. It publishes them with progress_publish(), the
+ * progress thread reads them with progress_peek() and sleeps in
+ * progress_wait(), which returns 1 as soon as progress_stop() is called.
+ * update_pui() and log_mesg() share a lock, so the screen and the log are
+ * written by one thread at a time.
+ */
+extern void progress_start(void);
+extern void progress_publish(unsigned long long copied, unsigned long long current);
+extern void progress_peek(unsigned long long *copied, unsigned long long *current);
+extern int progress_wait(unsigned long seconds);
+extern void progress_stop(void);
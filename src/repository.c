@@ -0,0 +1,811 @@
+/**
+ * repository.c - Part of Partclone project.
+ *
+ * a repository of images sharing their identical chunks
+ *
+ * A repository is a directory:
+ *
+ *   packs/<n>.pack  the chunks, each stored once, appended to the last pack
+ *   index           a repo_chunk for each chunk in the packs
+ *   images/<name>   the manifest of an image
+ *
+ * The device is cut in ranges of REPO_CHUNK_SIZE bytes and the used blocks
+ * of a range make a chunk, keyed by the SHA-256 of their data. The ranges
+ * are fixed on the device, so a block used in one image and not in the
+ * next only changes the chunk of its range, and the same file system saved
+ * every night shares all the chunks it did not write. The checksums of the
+ * image are not part of the chunks: they are kept in the manifest with the
+ * image up to its data, the image is given back byte for byte.
+ *
+ * A store appends the new chunks to the pack, syncs it, then appends them
+ * to the index and renames the manifest in place, under a lock. A crash
+ * leaves at most unused data at the end of a pack.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <openssl/sha.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "repository.h"
+
+struct repo_image {
+	char *dir;
+	repo_manifest_head head;
+	char *data;                      /// what follows the head
+	char *prefix;                    /// in data
+	repo_chunk *chunks;              /// in data
+	unsigned char *checksums;        /// in data
+	unsigned long long *first_rank;  /// of the first block of each chunk, one more at the end
+	unsigned long long used;
+	unsigned int block_size;
+	unsigned int blocks_per_cs;
+	unsigned int cs_size;
+	int *packs;                      /// opened when first read, -1 before
+	unsigned int pack_count;
+	pthread_mutex_t lock;
+	int debug;
+};
+
+/// the chunks of a repository by hash, while storing
+typedef struct {
+	repo_chunk *slots;               /// empty when length is 0
+	unsigned long long size;         /// a power of two
+	unsigned long long count;
+} chunk_table;
+
+static int read_full(int fd, char *buf, size_t size) {
+
+	while (size) {
+		ssize_t r = read(fd, buf, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t size) {
+
+	while (size) {
+		ssize_t r = write(fd, buf, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static int pread_full(int fd, char *buf, size_t size, unsigned long long offset) {
+
+	while (size) {
+		ssize_t r = pread(fd, buf, size, offset);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		offset += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static char *repo_path(const char *dir, const char *sub, const char *name) {
+
+	char *path;
+
+	if (asprintf(&path, "%s/%s%s%s", dir, sub, name ? "/" : "", name ? name : "") < 0)
+		return NULL;
+	return path;
+}
+
+static int pack_open(const char *dir, unsigned int pack, int flags) {
+
+	char name[32];
+	char *path;
+	int fd;
+
+	snprintf(name, sizeof(name), "%08u.pack", pack);
+	path = repo_path(dir, "packs", name);
+	if (path == NULL)
+		return -1;
+	fd = open(path, flags | O_LARGEFILE, 0644);
+	free(path);
+	return fd;
+}
+
+static uint32_t manifest_head_crc(repo_manifest_head *head) {
+
+	uint32_t crc;
+
+	init_crc32(&crc);
+	return crc32(crc, head, sizeof(repo_manifest_head) - CRC32_SIZE);
+}
+
+/// the image description at the start of prefix, 0 when it is one we store
+static int check_desc(const image_desc_v2 *desc, int debug) {
+
+	uint32_t crc;
+
+	if (memcmp(desc->head.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE)) {
+		log_mesg(0, 0, 1, debug, "repository: not a partclone image\n");
+		return -1;
+	}
+	if (memcmp(desc->head.version, IMAGE_VERSION_0002, IMAGE_VERSION_SIZE) ||
+	    desc->head.endianess != ENDIAN_MAGIC) {
+		log_mesg(0, 0, 1, debug, "repository: only images of version %s of this machine are stored\n",
+			IMAGE_VERSION_0002);
+		return -1;
+	}
+	init_crc32(&crc);
+	if (crc32(crc, (void *)desc, sizeof(image_desc_v2) - CRC32_SIZE) != desc->crc) {
+		log_mesg(0, 0, 1, debug, "repository: the image header is damaged\n");
+		return -1;
+	}
+	if (desc->options.bitmap_mode != BM_BIT && desc->options.bitmap_mode != BM_NONE) {
+		log_mesg(0, 0, 1, debug, "repository: unsupported bitmap mode %s\n",
+			get_bitmap_mode_str(desc->options.bitmap_mode));
+		return -1;
+	}
+	if (desc->fs_info.block_size == 0) {
+		log_mesg(0, 0, 1, debug, "repository: the image header is damaged\n");
+		return -1;
+	}
+	return 0;
+}
+
+/// the size of the image before its data
+static unsigned long long prefix_size(const image_desc_v2 *desc) {
+
+	unsigned long long size = sizeof(image_desc_v2);
+
+	if (desc->options.bitmap_mode == BM_BIT)
+		size += BITS_TO_BYTES(desc->fs_info.totalblock) + CRC32_SIZE;
+	if (desc->options.checksum_mode == CSM_AES256_GCM)
+		size += sizeof(image_cipher_head);
+	return size;
+}
+
+/// the bitmap of the image, a copy, NULL when it does not match its crc
+static unsigned long *prefix_bitmap(const char *prefix) {
+
+	const image_desc_v2 *desc = (const image_desc_v2 *)prefix;
+	const unsigned long long totalblock = desc->fs_info.totalblock;
+	unsigned long *bitmap = pc_alloc_bitmap(totalblock);
+	uint32_t crc, r_crc;
+
+	if (bitmap == NULL)
+		return NULL;
+	if (desc->options.bitmap_mode == BM_NONE) {
+		pc_init_bitmap(bitmap, 0xFF, totalblock);
+		return bitmap;
+	}
+
+	memcpy(bitmap, prefix + sizeof(image_desc_v2), BITS_TO_BYTES(totalblock));
+	memcpy(&r_crc, prefix + sizeof(image_desc_v2) + BITS_TO_BYTES(totalblock), CRC32_SIZE);
+	init_crc32(&crc);
+	if (crc32(crc, bitmap, BITS_TO_BYTES(totalblock)) != r_crc) {
+		free(bitmap);
+		return NULL;
+	}
+	return bitmap;
+}
+
+static unsigned int chunk_blocks(unsigned int block_size) {
+
+	return block_size < REPO_CHUNK_SIZE ? REPO_CHUNK_SIZE / block_size : 1;
+}
+
+static repo_chunk *table_find(chunk_table *t, const unsigned char *hash) {
+
+	unsigned long long i;
+
+	memcpy(&i, hash, sizeof(i));
+	for (i &= t->size - 1; t->slots[i].length; i = (i + 1) & (t->size - 1))
+		if (!memcmp(t->slots[i].hash, hash, REPO_HASH_SIZE))
+			return &t->slots[i];
+	return &t->slots[i];
+}
+
+static int table_add(chunk_table *t, const repo_chunk *chunk) {
+
+	repo_chunk *slot;
+
+	if ((t->count + 1) * 2 > t->size) {
+		chunk_table bigger = { NULL, t->size * 2, 0 };
+		unsigned long long i;
+
+		bigger.slots = calloc(bigger.size, sizeof(repo_chunk));
+		if (bigger.slots == NULL)
+			return -1;
+		for (i = 0; i < t->size; i++)
+			if (t->slots[i].length)
+				*table_find(&bigger, t->slots[i].hash) = t->slots[i];
+		bigger.count = t->count;
+		free(t->slots);
+		*t = bigger;
+	}
+	slot = table_find(t, chunk->hash);
+	if (!slot->length)
+		t->count++;
+	*slot = *chunk;
+	return 0;
+}
+
+/// the index of dir, its torn end cut, into t. returns the index fd or -1
+static int load_index(const char *dir, chunk_table *t, unsigned int *last_pack, int debug) {
+
+	char *path = repo_path(dir, "index", NULL);
+	repo_chunk entries[256];
+	unsigned long long count, i;
+	struct stat st;
+	int fd;
+
+	fd = path ? open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0644) : -1;
+	free(path);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		log_mesg(0, 0, 1, debug, "repository: can't open the index of %s: %s\n", dir, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	count = st.st_size / sizeof(repo_chunk);
+	if (st.st_size % sizeof(repo_chunk) && ftruncate(fd, count * sizeof(repo_chunk))) {
+		close(fd);
+		return -1;
+	}
+
+	t->size = 1024;
+	t->slots = calloc(t->size, sizeof(repo_chunk));
+	if (t->slots == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	*last_pack = 0;
+	for (i = 0; i < count; ) {
+		unsigned long long n = count - i < 256 ? count - i : 256, j;
+
+		if (pread_full(fd, (char *)entries, n * sizeof(repo_chunk), i * sizeof(repo_chunk))) {
+			log_mesg(0, 0, 1, debug, "repository: can't read the index of %s\n", dir);
+			close(fd);
+			return -1;
+		}
+		for (j = 0; j < n; j++) {
+			if (entries[j].pack > *last_pack)
+				*last_pack = entries[j].pack;
+			if (table_add(t, &entries[j])) {
+				log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+				close(fd);
+				return -1;
+			}
+		}
+		i += n;
+	}
+	log_mesg(1, 0, 0, debug, "repository: %llu chunks in %s\n", t->count, dir);
+	return fd;
+}
+
+/// read count blocks of the image data from fd into buf, the checksums into cs
+static int read_blocks(int fd, char *buf, unsigned long long count, unsigned long long *rank,
+	const image_options *img_opt, unsigned int block_size, unsigned char *cs) {
+
+	const unsigned int blocks_per_cs = img_opt->blocks_per_checksum;
+	const unsigned int cs_size = img_opt->checksum_size;
+
+	while (count) {
+		unsigned long long take = blocks_per_cs ? blocks_per_cs - *rank % blocks_per_cs : count;
+
+		if (take > count)
+			take = count;
+		if (read_full(fd, buf, take * block_size))
+			return -1;
+		buf += take * block_size;
+		count -= take;
+		*rank += take;
+		if (blocks_per_cs && *rank % blocks_per_cs == 0 &&
+		    read_full(fd, (char *)cs + (*rank / blocks_per_cs - 1) * cs_size, cs_size))
+			return -1;
+	}
+	return 0;
+}
+
+int repo_store(const char *dir, const char *name, int fd, repo_stats *stats, int debug) {
+
+	image_desc_v2 desc;
+	repo_manifest_head head;
+	chunk_table table = { NULL, 0, 0 };
+	repo_chunk *chunks = NULL, *added = NULL;
+	unsigned long long chunk_count = 0, added_count = 0, range, ranges, rank = 0, used, strips = 0;
+	unsigned long long pack_size;
+	unsigned long *bitmap = NULL;
+	unsigned int blocks_per_chunk, block_size, last_pack;
+	unsigned char *checksums = NULL;
+	char *prefix = NULL, *buf = NULL, *path = NULL, *tmp_path = NULL;
+	int lock_fd = -1, index_fd = -1, pack_fd = -1, out = -1, ret = -1;
+	struct stat st;
+	uint32_t crc;
+
+	memset(stats, 0, sizeof(repo_stats));
+	if (!*name || strchr(name, '/') || name[0] == '.') {
+		log_mesg(0, 0, 1, debug, "repository: invalid image name '%s'\n", name);
+		return -1;
+	}
+
+	/// the repository, created on the first store, and its lock
+	if ((mkdir(dir, 0755) && errno != EEXIST) ||
+	    !(path = repo_path(dir, "packs", NULL)) || (mkdir(path, 0755) && errno != EEXIST)) {
+		log_mesg(0, 0, 1, debug, "repository: can't create %s: %s\n", dir, strerror(errno));
+		goto out;
+	}
+	free(path);
+	if (!(path = repo_path(dir, "images", NULL)) || (mkdir(path, 0755) && errno != EEXIST)) {
+		log_mesg(0, 0, 1, debug, "repository: can't create %s: %s\n", dir, strerror(errno));
+		goto out;
+	}
+	free(path);
+	path = repo_path(dir, "lock", NULL);
+	lock_fd = path ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+	if (lock_fd == -1 || flock(lock_fd, LOCK_EX)) {
+		log_mesg(0, 0, 1, debug, "repository: can't lock %s: %s\n", dir, strerror(errno));
+		goto out;
+	}
+	free(path);
+	path = NULL;
+
+	index_fd = load_index(dir, &table, &last_pack, debug);
+	if (index_fd == -1)
+		goto out;
+
+	/// the image up to its data, kept as it is
+	if (read_full(fd, (char *)&desc, sizeof(desc))) {
+		log_mesg(0, 0, 1, debug, "repository: can't read the image header\n");
+		goto out;
+	}
+	if (check_desc(&desc, debug))
+		goto out;
+	memset(&head, 0, sizeof(head));
+	head.prefix_size = prefix_size(&desc);
+	prefix = malloc(head.prefix_size);
+	if (prefix == NULL) {
+		log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		goto out;
+	}
+	memcpy(prefix, &desc, sizeof(desc));
+	if (read_full(fd, prefix + sizeof(desc), head.prefix_size - sizeof(desc))) {
+		log_mesg(0, 0, 1, debug, "repository: can't read the image bitmap\n");
+		goto out;
+	}
+	bitmap = prefix_bitmap(prefix);
+	if (bitmap == NULL) {
+		log_mesg(0, 0, 1, debug, "repository: the bitmap of the image is damaged\n");
+		goto out;
+	}
+
+	block_size = desc.fs_info.block_size;
+	blocks_per_chunk = chunk_blocks(block_size);
+	used = pc_count_bits(bitmap, 0, desc.fs_info.totalblock);
+	if (desc.options.blocks_per_checksum)
+		strips = (used + desc.options.blocks_per_checksum - 1) / desc.options.blocks_per_checksum;
+	ranges = (desc.fs_info.totalblock + blocks_per_chunk - 1) / blocks_per_chunk;
+	head.checksums_size = strips * desc.options.checksum_size;
+	head.chunk_blocks = blocks_per_chunk;
+	checksums = calloc(1, head.checksums_size + 1);
+	chunks = malloc(ranges * sizeof(repo_chunk) + 1);
+	added = malloc(ranges * sizeof(repo_chunk) + 1);
+	buf = malloc((size_t)blocks_per_chunk * block_size);
+	if (checksums == NULL || chunks == NULL || added == NULL || buf == NULL) {
+		log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		goto out;
+	}
+
+	/// new chunks go to the end of the last pack
+	pack_fd = pack_open(dir, last_pack, O_WRONLY | O_CREAT | O_APPEND);
+	if (pack_fd == -1 || fstat(pack_fd, &st) == -1) {
+		log_mesg(0, 0, 1, debug, "repository: can't open pack %u: %s\n", last_pack, strerror(errno));
+		goto out;
+	}
+	pack_size = st.st_size;
+
+	for (range = 0; range < ranges; range++) {
+		unsigned long long start = range * blocks_per_chunk;
+		unsigned long long end = start + blocks_per_chunk < desc.fs_info.totalblock ?
+			start + blocks_per_chunk : desc.fs_info.totalblock;
+		unsigned long long count = pc_count_bits(bitmap, start, end);
+		repo_chunk chunk, *found;
+
+		if (count == 0)
+			continue;
+		if (read_blocks(fd, buf, count, &rank, &desc.options, block_size, checksums)) {
+			log_mesg(0, 0, 1, debug, "repository: the image ends at block %llu of %llu\n", rank, used);
+			goto out;
+		}
+
+		memset(&chunk, 0, sizeof(chunk));
+		SHA256((unsigned char *)buf, count * block_size, chunk.hash);
+		stats->chunks++;
+		stats->bytes += count * block_size;
+
+		found = table_find(&table, chunk.hash);
+		if (found->length) {
+			chunks[chunk_count++] = *found;
+			continue;
+		}
+
+		if (pack_size && pack_size + count * block_size > REPO_PACK_SIZE) {
+			if (fdatasync(pack_fd)) {
+				log_mesg(0, 0, 1, debug, "repository: can't write pack %u: %s\n", last_pack, strerror(errno));
+				goto out;
+			}
+			close(pack_fd);
+			last_pack++;
+			pack_fd = pack_open(dir, last_pack, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+			if (pack_fd == -1) {
+				log_mesg(0, 0, 1, debug, "repository: can't create pack %u: %s\n", last_pack, strerror(errno));
+				goto out;
+			}
+			pack_size = 0;
+		}
+		if (write_full(pack_fd, buf, count * block_size)) {
+			log_mesg(0, 0, 1, debug, "repository: can't write pack %u: %s\n", last_pack, strerror(errno));
+			goto out;
+		}
+		chunk.pack = last_pack;
+		chunk.length = count * block_size;
+		chunk.offset = pack_size;
+		pack_size += chunk.length;
+		if (table_add(&table, &chunk)) {
+			log_mesg(0, 0, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+			goto out;
+		}
+		chunks[chunk_count++] = chunk;
+		added[added_count++] = chunk;
+		stats->new_chunks++;
+		stats->new_bytes += chunk.length;
+	}
+
+	/// the checksum of a partial strip ends the image
+	if (desc.options.blocks_per_checksum && used % desc.options.blocks_per_checksum &&
+	    read_full(fd, (char *)checksums + (strips - 1) * desc.options.checksum_size, desc.options.checksum_size)) {
+		log_mesg(0, 0, 1, debug, "repository: can't read the last checksum of the image\n");
+		goto out;
+	}
+
+	/// the data, then the index naming it, then the manifest using it
+	if (fdatasync(pack_fd) || fstat(index_fd, &st) ||
+	    pwrite(index_fd, added, added_count * sizeof(repo_chunk), st.st_size) != (ssize_t)(added_count * sizeof(repo_chunk)) ||
+	    fdatasync(index_fd)) {
+		log_mesg(0, 0, 1, debug, "repository: can't update %s: %s\n", dir, strerror(errno));
+		goto out;
+	}
+
+	memcpy(head.magic, REPO_MANIFEST_MAGIC, REPO_MAGIC_SIZE);
+	head.endianess = ENDIAN_MAGIC;
+	head.chunks = chunk_count;
+	head.image_size = head.prefix_size + cnv_blocks_to_bytes(0, used, block_size, &desc.options);
+	if (desc.options.blocks_per_checksum && used % desc.options.blocks_per_checksum)
+		head.image_size += desc.options.checksum_size;
+	init_crc32(&crc);
+	crc = crc32(crc, prefix, head.prefix_size);
+	crc = crc32(crc, chunks, chunk_count * sizeof(repo_chunk));
+	head.data_crc = crc32(crc, checksums, head.checksums_size);
+	head.crc = manifest_head_crc(&head);
+
+	path = repo_path(dir, "images", name);
+	if (path == NULL || asprintf(&tmp_path, "%s/images/.%s.tmp", dir, name) < 0) {
+		tmp_path = NULL;
+		goto out;
+	}
+	out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out == -1 || write_full(out, (char *)&head, sizeof(head)) ||
+	    write_full(out, prefix, head.prefix_size) ||
+	    write_full(out, (char *)chunks, chunk_count * sizeof(repo_chunk)) ||
+	    write_full(out, (char *)checksums, head.checksums_size) ||
+	    fsync(out) || rename(tmp_path, path)) {
+		log_mesg(0, 0, 1, debug, "repository: can't write image %s: %s\n", name, strerror(errno));
+		unlink(tmp_path);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if (out != -1)
+		close(out);
+	if (pack_fd != -1)
+		close(pack_fd);
+	if (index_fd != -1)
+		close(index_fd);
+	if (lock_fd != -1)
+		close(lock_fd);
+	free(table.slots);
+	free(chunks);
+	free(added);
+	free(checksums);
+	free(bitmap);
+	free(prefix);
+	free(buf);
+	free(path);
+	free(tmp_path);
+	return ret;
+}
+
+repo_image *repo_image_open(const char *dir, const char *name, int debug) {
+
+	const image_desc_v2 *desc;
+	repo_image *ri;
+	unsigned long *bitmap = NULL;
+	unsigned long long data_size, range, ranges, c = 0, rank = 0;
+	unsigned int i;
+	char *path;
+	uint32_t crc;
+	int fd;
+
+	ri = calloc(1, sizeof(repo_image));
+	if (ri == NULL)
+		return NULL;
+	ri->debug = debug;
+	ri->dir = strdup(dir);
+	pthread_mutex_init(&ri->lock, NULL);
+
+	path = repo_path(dir, "images", name);
+	fd = path ? open(path, O_RDONLY) : -1;
+	free(path);
+	if (fd == -1) {
+		log_mesg(0, 0, 1, debug, "repository: no image %s in %s\n", name, dir);
+		goto error;
+	}
+	if (read_full(fd, (char *)&ri->head, sizeof(ri->head)) ||
+	    memcmp(ri->head.magic, REPO_MANIFEST_MAGIC, REPO_MAGIC_SIZE) ||
+	    ri->head.endianess != ENDIAN_MAGIC || ri->head.crc != manifest_head_crc(&ri->head)) {
+		log_mesg(0, 0, 1, debug, "repository: the manifest of %s is damaged\n", name);
+		close(fd);
+		goto error;
+	}
+
+	data_size = ri->head.prefix_size + ri->head.chunks * sizeof(repo_chunk) + ri->head.checksums_size;
+	ri->data = malloc(data_size);
+	if (ri->data == NULL || read_full(fd, ri->data, data_size)) {
+		log_mesg(0, 0, 1, debug, "repository: can't read the manifest of %s\n", name);
+		close(fd);
+		goto error;
+	}
+	close(fd);
+	init_crc32(&crc);
+	if (crc32(crc, ri->data, data_size) != ri->head.data_crc || ri->head.prefix_size < sizeof(image_desc_v2)) {
+		log_mesg(0, 0, 1, debug, "repository: the manifest of %s is damaged\n", name);
+		goto error;
+	}
+	ri->prefix = ri->data;
+	ri->chunks = (repo_chunk *)(ri->data + ri->head.prefix_size);
+	ri->checksums = (unsigned char *)ri->chunks + ri->head.chunks * sizeof(repo_chunk);
+
+	desc = (const image_desc_v2 *)ri->prefix;
+	if (check_desc(desc, debug) || prefix_size(desc) != ri->head.prefix_size ||
+	    (bitmap = prefix_bitmap(ri->prefix)) == NULL) {
+		log_mesg(0, 0, 1, debug, "repository: the manifest of %s is damaged\n", name);
+		goto error;
+	}
+	ri->block_size = desc->fs_info.block_size;
+	ri->blocks_per_cs = desc->options.blocks_per_checksum;
+	ri->cs_size = ri->blocks_per_cs ? desc->options.checksum_size : 0;
+
+	/// the ranks where the chunks start, from the ranges with used blocks
+	ri->first_rank = malloc((ri->head.chunks + 1) * sizeof(unsigned long long));
+	if (ri->first_rank == NULL)
+		goto error;
+	ranges = (desc->fs_info.totalblock + ri->head.chunk_blocks - 1) / ri->head.chunk_blocks;
+	for (range = 0; range < ranges; range++) {
+		unsigned long long start = range * ri->head.chunk_blocks;
+		unsigned long long end = start + ri->head.chunk_blocks < desc->fs_info.totalblock ?
+			start + ri->head.chunk_blocks : desc->fs_info.totalblock;
+		unsigned long long count = pc_count_bits(bitmap, start, end);
+
+		if (count == 0)
+			continue;
+		if (c == ri->head.chunks || ri->chunks[c].length != count * ri->block_size)
+			break;
+		ri->first_rank[c++] = rank;
+		rank += count;
+	}
+	free(bitmap);
+	bitmap = NULL;
+	if (range != ranges || c != ri->head.chunks) {
+		log_mesg(0, 0, 1, debug, "repository: the chunks of %s do not match its bitmap\n", name);
+		goto error;
+	}
+	ri->first_rank[c] = rank;
+	ri->used = rank;
+
+	for (c = 0; c < ri->head.chunks; c++)
+		if (ri->chunks[c].pack >= ri->pack_count)
+			ri->pack_count = ri->chunks[c].pack + 1;
+	ri->packs = malloc((ri->pack_count + 1) * sizeof(int));
+	if (ri->packs == NULL)
+		goto error;
+	for (i = 0; i < ri->pack_count; i++)
+		ri->packs[i] = -1;
+
+	log_mesg(1, 0, 0, debug, "repository: %s, %llu chunks, %llu bytes\n", name, ri->head.chunks, ri->head.image_size);
+	return ri;
+
+error:
+	free(bitmap);
+	repo_image_close(ri);
+	return NULL;
+}
+
+unsigned long long repo_image_size(const repo_image *ri) {
+
+	return ri->head.image_size;
+}
+
+/// the chunk holding the block of rank
+static unsigned long long find_chunk(const repo_image *ri, unsigned long long rank) {
+
+	unsigned long long lo = 0, hi = ri->head.chunks;
+
+	while (hi - lo > 1) {
+		unsigned long long mid = lo + (hi - lo) / 2;
+
+		if (ri->first_rank[mid] <= rank)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/// read chunk c into buf and check its hash
+static int read_chunk(repo_image *ri, unsigned long long c, char *buf) {
+
+	const repo_chunk *chunk = &ri->chunks[c];
+	unsigned char hash[REPO_HASH_SIZE];
+	int fd;
+
+	pthread_mutex_lock(&ri->lock);
+	if (ri->packs[chunk->pack] == -1)
+		ri->packs[chunk->pack] = pack_open(ri->dir, chunk->pack, O_RDONLY);
+	fd = ri->packs[chunk->pack];
+	pthread_mutex_unlock(&ri->lock);
+
+	if (fd == -1) {
+		log_mesg(0, 0, 1, ri->debug, "repository: can't open pack %u: %s\n", chunk->pack, strerror(errno));
+		return -EIO;
+	}
+	if (pread_full(fd, buf, chunk->length, chunk->offset)) {
+		log_mesg(0, 0, 1, ri->debug, "repository: can't read chunk %llu from pack %u\n", c, chunk->pack);
+		return -EIO;
+	}
+	SHA256((unsigned char *)buf, chunk->length, hash);
+	if (memcmp(hash, chunk->hash, REPO_HASH_SIZE)) {
+		log_mesg(0, 0, 1, ri->debug, "repository: chunk %llu in pack %u is damaged\n", c, chunk->pack);
+		return -EIO;
+	}
+	return 0;
+}
+
+int repo_image_pread(repo_image *ri, char *buf, size_t size, unsigned long long offset) {
+
+	const unsigned int block_size = ri->block_size;
+	const unsigned long long strip_size = (unsigned long long)ri->blocks_per_cs * block_size + ri->cs_size;
+	unsigned long long loaded = ri->head.chunks;
+	char *chunk_buf = NULL;
+	int ret = 0;
+
+	if (offset > ri->head.image_size || size > ri->head.image_size - offset)
+		return -EIO;
+
+	if (offset < ri->head.prefix_size) {
+		size_t len = ri->head.prefix_size - offset < size ? ri->head.prefix_size - offset : size;
+
+		memcpy(buf, ri->prefix + offset, len);
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+
+	while (size && !ret) {
+		unsigned long long pos = offset - ri->head.prefix_size;
+		unsigned long long strip = ri->blocks_per_cs ? pos / strip_size : 0;
+		unsigned long long in = ri->blocks_per_cs ? pos % strip_size : pos;
+		unsigned long long strip_blocks = ri->blocks_per_cs ?
+			(ri->used - strip * ri->blocks_per_cs < ri->blocks_per_cs ? ri->used - strip * ri->blocks_per_cs : ri->blocks_per_cs) :
+			ri->used;
+		unsigned long long len;
+
+		if (in < strip_blocks * block_size) {
+			unsigned long long rank = strip * ri->blocks_per_cs + in / block_size;
+			unsigned long long c = find_chunk(ri, rank);
+			unsigned long long at = (rank - ri->first_rank[c]) * block_size + in % block_size;
+
+			if (chunk_buf == NULL && (chunk_buf = malloc((size_t)ri->head.chunk_blocks * block_size)) == NULL) {
+				ret = -EIO;
+				break;
+			}
+			if (c != loaded) {
+				ret = read_chunk(ri, c, chunk_buf);
+				loaded = c;
+			}
+			len = ri->chunks[c].length - at;
+			if (len > strip_blocks * block_size - in)
+				len = strip_blocks * block_size - in;
+			if (len > size)
+				len = size;
+			if (!ret)
+				memcpy(buf, chunk_buf + at, len);
+		} else {
+			unsigned long long at = in - strip_blocks * block_size;
+
+			len = ri->cs_size - at < size ? ri->cs_size - at : size;
+			memcpy(buf, ri->checksums + strip * ri->cs_size + at, len);
+		}
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+
+	free(chunk_buf);
+	return ret;
+}
+
+int repo_image_prefix_fd(repo_image *ri) {
+
+	FILE *tmp = tmpfile();
+	int fd;
+
+	if (tmp == NULL)
+		return -1;
+	fd = dup(fileno(tmp));
+	fclose(tmp);
+	if (fd == -1)
+		return -1;
+	if (write_full(fd, ri->prefix, ri->head.prefix_size) || lseek(fd, 0, SEEK_SET)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void repo_image_close(repo_image *ri) {
+
+	unsigned int i;
+
+	if (ri == NULL)
+		return;
+	for (i = 0; ri->packs && i < ri->pack_count; i++)
+		if (ri->packs[i] != -1)
+			close(ri->packs[i]);
+	pthread_mutex_destroy(&ri->lock);
+	free(ri->packs);
+	free(ri->first_rank);
+	free(ri->data);
+	free(ri->dir);
+	free(ri);
+}
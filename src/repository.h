@@ -0,0 +1,53 @@
+/**
+ * repository.h - Part of Partclone project.
+ *
+ * a repository of images sharing their identical chunks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef REPOSITORY_H_
+#define REPOSITORY_H_
+
+#include <stddef.h>
+
+#define REPO_CHUNK_SIZE (256 * 1024)                  /// device bytes in a chunk
+#define REPO_PACK_SIZE  (1024ULL * 1024 * 1024)       /// a new pack is started after
+
+typedef struct repo_image repo_image;
+
+typedef struct {
+	unsigned long long chunks;       /// in the image
+	unsigned long long new_chunks;   /// not found in the repository
+	unsigned long long bytes;        /// of data in the image
+	unsigned long long new_bytes;    /// added to the packs
+} repo_stats;
+
+/**
+ * store the image read from fd as name in the repository dir, created when
+ * it does not exist. only images of version 0002 are stored. returns 0, or
+ * -1 when the image was not stored, the reason is logged.
+ */
+int repo_store(const char *dir, const char *name, int fd, repo_stats *stats, int debug);
+
+/// open the image name of the repository dir, NULL when it can not be read, the reason is logged
+repo_image *repo_image_open(const char *dir, const char *name, int debug);
+
+/// the size of the image given back
+unsigned long long repo_image_size(const repo_image *ri);
+
+/**
+ * read the image as it was stored, size bytes at offset. each chunk read is
+ * checked against its hash. thread safe. returns 0 or -EIO.
+ */
+int repo_image_pread(repo_image *ri, char *buf, size_t size, unsigned long long offset);
+
+/// an unlinked file holding the image up to its data, for load_image_desc(), -1 on error
+int repo_image_prefix_fd(repo_image *ri);
+
+void repo_image_close(repo_image *ri);
+
+#endif /* REPOSITORY_H_ */
@@ -0,0 +1,425 @@
+/**
+ * stripcache.c - Part of Partclone project.
+ *
+ * random access to the blocks of an image, through a cache of verified strips
+ *
+ * The blocks of an image are stored in bitmap order, a checksum after each
+ * blocks_per_checksum of them. A block is found by its rank in the bitmap,
+ * counted from a table of the ranks of every RANK_GROUP_WORDS words. The
+ * image is read by lines of whole checksum strips: each line is read with
+ * one pread, its checksums verified or its data decrypted once, and kept
+ * without the checksums in a LRU cache shared by the threads. The lines of an
+ * image of version 0003 start aligned and are read with O_DIRECT.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "stripcache.h"
+#include "iolimit.h"
+
+#define RANK_GROUP_WORDS 8       /// bitmap words counted at most for a rank
+#define STRIP_CACHE_MIN_LINES 4
+
+typedef enum { LINE_LOADING, LINE_READY } line_state;
+
+typedef struct strip_line {
+	unsigned long long index;        /// ranks index * line_blocks and up
+	char *data;                      /// the blocks, checksums removed
+	line_state state;
+	unsigned int users;
+	struct strip_line *hash_next;
+	struct strip_line *lru_prev, *lru_next;
+} strip_line;
+
+struct strip_cache {
+	int fd;
+	strip_cache_reader reader;       /// NULL to pread fd
+	void *reader_ctx;
+	unsigned long long data_offset;
+	unsigned long *bitmap;
+	unsigned long long total_blocks;
+	unsigned long long blocks_used;
+	unsigned int block_size;
+	image_options img_opt;
+	unsigned int cs_slot;            /// bytes of each checksum in the image
+	int direct;                      /// fd is read with O_DIRECT
+	int verify;
+	unsigned int line_blocks;        /// a multiple of blocks_per_checksum
+	unsigned long long line_bytes;   /// in the image, checksums included
+	unsigned long long *rank_index;
+	strip_line **hash;
+	unsigned int hash_size;
+	strip_line lru;                  /// lru.lru_next is the most recent line
+	unsigned int lines, max_lines;
+	unsigned long long hits, misses;
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	int debug;
+};
+
+unsigned long long strip_cache_rank(const strip_cache *sc, unsigned long long block) {
+
+	unsigned long long word = block / PART_BITS_PER_LONG;
+	unsigned long long group = word / RANK_GROUP_WORDS;
+	unsigned long long rank = sc->rank_index[group];
+	unsigned long long i;
+	unsigned int bit = block & (PART_BITS_PER_LONG - 1);
+
+	for (i = group * RANK_GROUP_WORDS; i < word; i++)
+		rank += __builtin_popcountl(sc->bitmap[i]);
+	if (bit)
+		rank += __builtin_popcountl(sc->bitmap[word] & ~(~0UL << bit));
+	return rank;
+}
+
+static void lru_unlink(strip_line *line) {
+
+	line->lru_prev->lru_next = line->lru_next;
+	line->lru_next->lru_prev = line->lru_prev;
+}
+
+static void lru_push(strip_cache *sc, strip_line *line) {
+
+	line->lru_prev = &sc->lru;
+	line->lru_next = sc->lru.lru_next;
+	sc->lru.lru_next->lru_prev = line;
+	sc->lru.lru_next = line;
+}
+
+static void hash_remove(strip_cache *sc, strip_line *line) {
+
+	strip_line **p = &sc->hash[line->index % sc->hash_size];
+
+	while (*p != line)
+		p = &(*p)->hash_next;
+	*p = line->hash_next;
+}
+
+/// read and decode a line, the cache is not locked
+static int load_line(strip_cache *sc, strip_line *line) {
+
+	const unsigned int block_size = sc->block_size;
+	const unsigned int blocks_per_cs = sc->img_opt.blocks_per_checksum;
+	const unsigned int cs_size = sc->img_opt.checksum_size;
+	unsigned long long first = line->index * sc->line_blocks;
+	unsigned int count = sc->blocks_used - first < sc->line_blocks ? sc->blocks_used - first : sc->line_blocks;
+	unsigned long long size = cnv_blocks_to_bytes(first, count, block_size, &sc->img_opt);
+	unsigned long long offset = sc->data_offset + first * block_size +
+		get_checksum_count(first, &sc->img_opt) * sc->cs_slot;
+	unsigned long long done = 0, want;
+	unsigned char checksum[CIPHER_TAG_SIZE];
+	unsigned int in = 0, out = 0;
+
+	/// the checksum of a partial strip ends the image
+	if (blocks_per_cs && count % blocks_per_cs)
+		size += sc->cs_slot;
+
+	/// O_DIRECT reads whole IMAGE_ALIGN units, the image ends in the last one
+	want = sc->direct ? (size + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN : size;
+
+	io_limit(0, want);
+	if (sc->reader && sc->reader(sc->reader_ctx, line->data, size, offset)) {
+		log_mesg(1, 0, 0, sc->debug, "strip cache: read error at %llu\n", offset);
+		return -EIO;
+	}
+	while (!sc->reader && done < size) {
+		ssize_t r = pread(sc->fd, line->data + done, want - done, offset + done);
+
+		if (r < 0 && errno == EINVAL && sc->direct) {
+			log_mesg(1, 0, 0, sc->debug, "strip cache: O_DIRECT read refused, fall back to buffered reads\n");
+			pthread_mutex_lock(&sc->lock);
+			if (sc->direct && fcntl(sc->fd, F_SETFL, fcntl(sc->fd, F_GETFL) & ~O_DIRECT) == 0)
+				sc->direct = 0;
+			pthread_mutex_unlock(&sc->lock);
+			if (!sc->direct)
+				continue;
+		}
+		if (r <= 0) {
+			log_mesg(1, 0, 0, sc->debug, "strip cache: read error at %llu: %s\n", offset + done,
+				r < 0 ? strerror(errno) : "end of image");
+			return -EIO;
+		}
+		done += r;
+	}
+
+	if (!blocks_per_cs)
+		return 0;
+
+	/// verify each strip and move its data over the checksums before it
+	while (out < count * block_size) {
+		unsigned int strip = count - out / block_size < blocks_per_cs ? count - out / block_size : blocks_per_cs;
+		unsigned int bytes = strip * block_size;
+
+		if (sc->verify) {
+			set_checksum_sequence((first + out / block_size) / blocks_per_cs);
+			init_checksum(sc->img_opt.checksum_mode, checksum, sc->debug);
+			update_checksum(checksum, line->data + in, bytes);
+			finish_checksum(checksum, (unsigned char *)line->data + in + bytes);
+			if (memcmp(line->data + in + bytes, checksum, cs_size)) {
+				log_mesg(0, 0, 1, sc->debug, "strip cache: CRC error in the image, block %llu\n",
+					first + out / block_size);
+				return -EIO;
+			}
+		}
+		if (in != out)
+			memmove(line->data + out, line->data + in, bytes);
+		in += bytes + sc->cs_slot;
+		out += bytes;
+	}
+
+	return 0;
+}
+
+/// the line holding rank, loaded when needed, NULL on error
+static strip_line *get_line(strip_cache *sc, unsigned long long rank) {
+
+	unsigned long long index = rank / sc->line_blocks;
+	strip_line *line;
+	int ret;
+
+	pthread_mutex_lock(&sc->lock);
+	while (1) {
+		for (line = sc->hash[index % sc->hash_size]; line; line = line->hash_next)
+			if (line->index == index)
+				break;
+		if (line == NULL)
+			break;
+		if (line->state == LINE_READY) {
+			line->users++;
+			lru_unlink(line);
+			lru_push(sc, line);
+			sc->hits++;
+			pthread_mutex_unlock(&sc->lock);
+			return line;
+		}
+		/// another thread reads it, wait and look again
+		pthread_cond_wait(&sc->loaded, &sc->lock);
+	}
+
+	/// reuse the least recent line nobody reads, or add one
+	line = &sc->lru;
+	if (sc->lines >= sc->max_lines)
+		for (line = sc->lru.lru_prev; line != &sc->lru; line = line->lru_prev)
+			if (line->state == LINE_READY && !line->users)
+				break;
+	if (line != &sc->lru) {
+		lru_unlink(line);
+		hash_remove(sc, line);
+	} else {
+		line = calloc(1, sizeof(strip_line));
+		if (line && posix_memalign((void **)&line->data, IMAGE_ALIGN,
+				(sc->line_bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN))
+			line->data = NULL;
+		if (line == NULL || line->data == NULL) {
+			free(line);
+			pthread_mutex_unlock(&sc->lock);
+			log_mesg(1, 0, 0, sc->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+			return NULL;
+		}
+		sc->lines++;
+	}
+
+	line->index = index;
+	line->state = LINE_LOADING;
+	line->users = 1;
+	line->hash_next = sc->hash[index % sc->hash_size];
+	sc->hash[index % sc->hash_size] = line;
+	lru_push(sc, line);
+	sc->misses++;
+	pthread_mutex_unlock(&sc->lock);
+
+	ret = load_line(sc, line);
+
+	pthread_mutex_lock(&sc->lock);
+	if (ret) {
+		lru_unlink(line);
+		hash_remove(sc, line);
+		sc->lines--;
+		free(line->data);
+		free(line);
+		line = NULL;
+	} else {
+		line->state = LINE_READY;
+	}
+	pthread_cond_broadcast(&sc->loaded);
+	pthread_mutex_unlock(&sc->lock);
+
+	return line;
+}
+
+static void put_line(strip_cache *sc, strip_line *line) {
+
+	pthread_mutex_lock(&sc->lock);
+	line->users--;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+int strip_cache_read(strip_cache *sc, char *buf, size_t size, unsigned long long offset) {
+
+	const unsigned int block_size = sc->block_size;
+
+	while (size) {
+		unsigned long long block = offset / block_size;
+		unsigned long long next, len;
+
+		if (block >= sc->total_blocks) {
+			memset(buf, 0, size);
+			return 0;
+		}
+
+		if (!pc_test_bit(block, sc->bitmap, sc->total_blocks)) {
+			/// a hole, up to the next used block
+			next = pc_find_next_bit(sc->bitmap, sc->total_blocks, block, 1);
+			len = next * block_size - offset;
+			if (len > size)
+				len = size;
+			memset(buf, 0, len);
+		} else {
+			/// a run of used blocks, cut at the end of the line
+			unsigned long long rank = strip_cache_rank(sc, block);
+			unsigned long long line_end = (rank / sc->line_blocks + 1) * sc->line_blocks;
+			strip_line *line;
+
+			next = pc_find_next_bit(sc->bitmap, sc->total_blocks, block, 0);
+			if (next - block > line_end - rank)
+				next = block + line_end - rank;
+			len = next * block_size - offset;
+			if (len > size)
+				len = size;
+
+			line = get_line(sc, rank);
+			if (line == NULL)
+				return -EIO;
+			memcpy(buf, line->data + (rank % sc->line_blocks) * block_size + offset % block_size, len);
+			put_line(sc, line);
+		}
+
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+void strip_cache_set_reader(strip_cache *sc, strip_cache_reader reader, void *ctx) {
+
+	sc->reader = reader;
+	sc->reader_ctx = ctx;
+}
+
+strip_cache *strip_cache_open(int fd, unsigned long long data_offset, const file_system_info *fs_info,
+	const image_options *img_opt, unsigned long *bitmap, unsigned long long cache_size, int debug) {
+
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int blocks_per_cs = img_opt->blocks_per_checksum;
+	unsigned long long words = BITS_TO_LONGS(fs_info->totalblock);
+	unsigned long long groups = words / RANK_GROUP_WORDS + 1;
+	unsigned long long g, rank = 0;
+	unsigned int strips;
+	strip_cache *sc;
+
+	sc = calloc(1, sizeof(strip_cache));
+	if (sc == NULL)
+		return NULL;
+	sc->rank_index = malloc(groups * sizeof(unsigned long long));
+	if (sc->rank_index == NULL) {
+		free(sc);
+		return NULL;
+	}
+
+	sc->fd = fd;
+	sc->data_offset = data_offset;
+	sc->bitmap = bitmap;
+	sc->total_blocks = fs_info->totalblock;
+	sc->block_size = block_size;
+	sc->img_opt = *img_opt;
+	sc->cs_slot = get_checksum_slot(block_size, img_opt);
+	sc->debug = debug;
+
+	for (g = 0; g < groups; g++) {
+		unsigned long long i, end = (g + 1) * RANK_GROUP_WORDS < words ? (g + 1) * RANK_GROUP_WORDS : words;
+
+		sc->rank_index[g] = rank;
+		for (i = g * RANK_GROUP_WORDS; i < end; i++)
+			rank += __builtin_popcountl(bitmap[i]);
+	}
+	sc->blocks_used = rank;
+
+	/// the chained crc of an image without reseed or of version 0001 can
+	/// only be checked from the start, chkimg does that
+	sc->verify = img_opt->checksum_mode == CSM_AES256_GCM ||
+		(img_opt->checksum_mode == CSM_CRC32 && img_opt->reseed_checksum);
+	if (blocks_per_cs == 0)
+		sc->verify = 0;
+	if (!sc->verify && img_opt->checksum_mode != CSM_NONE)
+		log_mesg(1, 0, 0, debug, "strip cache: the checksums of this image are not verified\n");
+
+	if (blocks_per_cs) {
+		strips = STRIP_CACHE_LINE_SIZE / block_size / blocks_per_cs;
+		sc->line_blocks = (strips ? strips : 1) * blocks_per_cs;
+	} else {
+		sc->line_blocks = STRIP_CACHE_LINE_SIZE / block_size ? STRIP_CACHE_LINE_SIZE / block_size : 1;
+	}
+	sc->line_bytes = cnv_blocks_to_bytes(0, sc->line_blocks, block_size, img_opt);
+
+	sc->max_lines = cache_size / sc->line_bytes;
+	if (sc->max_lines < STRIP_CACHE_MIN_LINES)
+		sc->max_lines = STRIP_CACHE_MIN_LINES;
+	sc->hash_size = sc->max_lines * 2 + 1;
+	sc->hash = calloc(sc->hash_size, sizeof(strip_line *));
+	if (sc->hash == NULL) {
+		free(sc->rank_index);
+		free(sc);
+		return NULL;
+	}
+	sc->lru.lru_next = sc->lru.lru_prev = &sc->lru;
+
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->loaded, NULL);
+
+	/// the data of an aligned image is read past the page cache
+	if (img_opt->image_version == 0x0003 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0)
+		sc->direct = 1;
+
+	log_mesg(1, 0, 0, debug, "strip cache: %llu blocks used, %u blocks a line, %u lines\n",
+		sc->blocks_used, sc->line_blocks, sc->max_lines);
+	return sc;
+}
+
+void strip_cache_close(strip_cache *sc) {
+
+	strip_line *line, *next;
+
+	if (sc == NULL)
+		return;
+
+	log_mesg(1, 0, 0, sc->debug, "strip cache: %llu hits, %llu misses\n", sc->hits, sc->misses);
+	for (line = sc->lru.lru_next; line != &sc->lru; line = next) {
+		next = line->lru_next;
+		free(line->data);
+		free(line);
+	}
+	pthread_mutex_destroy(&sc->lock);
+	pthread_cond_destroy(&sc->loaded);
+	free(sc->hash);
+	free(sc->rank_index);
+	free(sc);
+}
@@ -0,0 +1,49 @@
+/**
+ * stripcache.h - Part of Partclone project.
+ *
+ * random access to the blocks of an image, through a cache of verified strips
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STRIPCACHE_H_
+#define STRIPCACHE_H_
+
+#include <stddef.h>
+
+#define STRIP_CACHE_LINE_SIZE    (1024 * 1024)        /// data read from the image at once
+#define STRIP_CACHE_DEFAULT_SIZE (64ULL * 1024 * 1024)
+
+typedef struct strip_cache strip_cache;
+
+/// reads the image instead of pread() on its fd, 0 or -errno
+typedef int (*strip_cache_reader)(void *ctx, char *buf, size_t size, unsigned long long offset);
+
+/**
+ * fd is the image, data_offset where its first block is stored, after the
+ * bitmap and the cipher head. the bitmap is kept, not copied. cache_size is
+ * the memory used for the decoded strips. the cipher must be loaded before
+ * for encrypted images. returns NULL when out of memory.
+ */
+strip_cache *strip_cache_open(int fd, unsigned long long data_offset, const file_system_info *fs_info,
+	const image_options *img_opt, unsigned long *bitmap, unsigned long long cache_size, int debug);
+
+/**
+ * read size bytes of the device at offset, the unused blocks read as zero.
+ * thread safe. returns 0 or -EIO when the image can not be read or a strip
+ * fails its checksum.
+ */
+int strip_cache_read(strip_cache *sc, char *buf, size_t size, unsigned long long offset);
+
+/// read the image through reader, before the first read
+void strip_cache_set_reader(strip_cache *sc, strip_cache_reader reader, void *ctx);
+
+/// the position of a used block in the image data
+unsigned long long strip_cache_rank(const strip_cache *sc, unsigned long long block);
+
+void strip_cache_close(strip_cache *sc);
+
+#endif /* STRIPCACHE_H_ */
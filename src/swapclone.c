@@ -0,0 +1,115 @@
+/**
+ * swapclone.c - part of Partclone project
+ *
+ * read the header of a linux swap area
+ *
+ * The pages of a swap area hold nothing once it is switched off, only the
+ * header page is used: the signature, the size, the uuid, the label and
+ * the list of bad pages. A swap area holding a hibernation image is copied
+ * whole, else the image would be resumed from garbage.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <byteswap.h>
+
+#include "partclone.h"
+#include "progress.h"
+#include "fs_common.h"
+#include "swapclone.h"
+
+/// signatures left by the hibernation code in place of SWAPSPACE2
+static const char *hibernation_signatures[] = {
+	"S1SUSPEND", "S2SUSPEND", "ULSUSPEND", "LINHIB0001", "\xed\xc3\x02\xe9\x98\x56\xe5\x0c", NULL
+};
+
+static int hibernated;
+
+static int swap_signature_at(const char *page, unsigned int page_size) {
+	const char *sig = page + page_size - SWAP_SIGNATURE_SIZE;
+	int i;
+
+	if (!memcmp(sig, SWAP_SIGNATURE, SWAP_SIGNATURE_SIZE)) {
+		hibernated = 0;
+		return 1;
+	}
+	for (i = 0; hibernation_signatures[i]; i++) {
+		if (!memcmp(sig, hibernation_signatures[i], strlen(hibernation_signatures[i]))) {
+			hibernated = 1;
+			return 1;
+		}
+	}
+	if (!memcmp(sig, SWAP_SIGNATURE_V0, SWAP_SIGNATURE_SIZE))
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: swap area of version 0 is not supported, run mkswap\n", __FILE__);
+	return 0;
+}
+
+void read_super_blocks(char* device, file_system_info* fs_info)
+{
+	struct swap_header_v1 *header;
+	unsigned long long device_size, last_page;
+	unsigned int page_size;
+	char *page;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd == -1)
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: open %s error\n", __FILE__, device);
+	device_size = get_partition_size(&fd);
+
+	page = calloc(1, SWAP_MAX_PAGE_SIZE);
+	if (page == NULL)
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: unable to alloc buffer for the header\n", __FILE__);
+	if (pread(fd, page, SWAP_MAX_PAGE_SIZE, 0) < SWAP_MIN_PAGE_SIZE)
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: unable to read the header\n", __FILE__);
+	close(fd);
+
+	for (page_size = SWAP_MIN_PAGE_SIZE; page_size <= SWAP_MAX_PAGE_SIZE; page_size <<= 1)
+		if (swap_signature_at(page, page_size))
+			break;
+	if (page_size > SWAP_MAX_PAGE_SIZE)
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: no swap signature found\n", __FILE__);
+
+	header = (struct swap_header_v1 *)(page + SWAP_HEADER_OFFSET);
+	last_page = header->last_page;
+	if (header->version == bswap_32(1))
+		last_page = bswap_32(header->last_page);
+	else if (header->version != 1)
+		log_mesg(0, 1, 1, fs_opt.debug, "%s: unknown swap header version %u\n", __FILE__, header->version);
+
+	if (device_size < page_size || (last_page + 1) * page_size > device_size)
+		log_mesg(0, 0, 1, fs_opt.debug, "%s: swap area of %llu pages is larger than the device\n", __FILE__, last_page + 1);
+
+	log_mesg(0, 0, 0, fs_opt.debug, "%s: page size %u, last page %llu%s\n", __FILE__, page_size, last_page,
+		hibernated ? ", holds a hibernation image" : "");
+	if (hibernated)
+		log_mesg(0, 0, 1, fs_opt.debug, "The swap area holds a hibernation image, all of it will be copied.\n");
+
+	strncpy(fs_info->fs, swap_MAGIC, FS_MAGIC_SIZE);
+	fs_info->block_size  = page_size;
+	fs_info->device_size = device_size;
+	fs_info->totalblock  = device_size / page_size;
+	fs_info->usedblocks  = hibernated ? fs_info->totalblock : 1;
+	fs_info->superBlockUsedBlocks = fs_info->usedblocks;
+	free(page);
+}
+
+void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
+{
+	if (hibernated) {
+		pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
+	} else {
+		/// the header page, bad page list included
+		pc_init_bitmap(bitmap, 0, fs_info.totalblock);
+		pc_set_bit(0, bitmap, fs_info.totalblock);
+	}
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: used blocks %llu\n", __FILE__, fs_info.usedblocks);
+}
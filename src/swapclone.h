@@ -0,0 +1,33 @@
+/**
+ * swapclone.h - part of Partclone project
+ *
+ * read the header of a linux swap area
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdint.h>
+
+/* the signature ends the first page, whatever the page size */
+#define SWAP_SIGNATURE_SIZE   10
+#define SWAP_SIGNATURE        "SWAPSPACE2"
+#define SWAP_SIGNATURE_V0     "SWAP-SPACE"
+
+#define SWAP_MIN_PAGE_SIZE    4096
+#define SWAP_MAX_PAGE_SIZE    65536
+
+/* the header after the boot sectors, written in the byte order of the host */
+#define SWAP_HEADER_OFFSET    1024
+
+struct swap_header_v1 {
+	uint32_t version;
+	uint32_t last_page;
+	uint32_t nr_badpages;
+	unsigned char uuid[16];
+	unsigned char volume_name[16];
+	uint32_t padding[117];
+	uint32_t badpages[1];
+};
@@ -0,0 +1,255 @@
+/**
+ * verify.c - Part of Partclone project.
+ *
+ * read back the written data and compare it with what was written
+ *
+ * While restoring, every write is recorded as extents with the crc32 of
+ * the data. After the target is synced the extents are read back by a few
+ * threads, with O_DIRECT when possible so the page cache can not answer
+ * for the device, and the crc32 are compared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "verify.h"
+#include "bufpool.h"
+#include "iolimit.h"
+
+#define VERIFY_ALIGN       IO_BUFFER_ALIGN  /// O_DIRECT alignment, fits 4Kn devices too
+#define VERIFY_MAX_THREADS 8
+#define VERIFY_BATCH       16    /// extents taken by a thread at once
+
+typedef struct {
+	verify_log *vlog;
+	const char *target;
+	unsigned char *bad;
+	unsigned long long next;
+	pthread_mutex_t lock;
+	int direct;
+	int debug;
+} verify_job;
+
+void verify_init(verify_log *vlog, unsigned int chunk_size) {
+	uint32_t seed;
+
+	memset(vlog, 0, sizeof(verify_log));
+	vlog->chunk_size = chunk_size ? chunk_size : DEFAULT_BUFFER_SIZE;
+	init_crc32(&seed);
+}
+
+static verify_extent *verify_new_extent(verify_log *vlog, unsigned long long offset) {
+	verify_extent *ext;
+
+	if (vlog->count == vlog->capacity) {
+		unsigned long long capacity = vlog->capacity ? vlog->capacity * 2 : 4096;
+		ext = realloc(vlog->extents, capacity * sizeof(verify_extent));
+		if (ext == NULL)
+			log_mesg(0, 1, 1, 0, "%s, %i, not enough memory\n", __func__, __LINE__);
+		vlog->extents = ext;
+		vlog->capacity = capacity;
+	}
+
+	ext = &vlog->extents[vlog->count++];
+	ext->offset = offset;
+	ext->length = 0;
+	init_crc32(&ext->crc);
+	return ext;
+}
+
+void verify_update(verify_log *vlog, unsigned long long offset, const char *buffer, unsigned long long length) {
+
+	while (length) {
+		verify_extent *ext = vlog->count ? &vlog->extents[vlog->count - 1] : NULL;
+		unsigned long long chunk_end;
+		unsigned int size;
+
+		/// extend the last extent when the data follows it in the same chunk
+		if (ext == NULL || ext->offset + ext->length != offset || offset % vlog->chunk_size == 0)
+			ext = verify_new_extent(vlog, offset);
+
+		chunk_end = (offset / vlog->chunk_size + 1) * vlog->chunk_size;
+		size = chunk_end - offset < length ? chunk_end - offset : length;
+
+		ext->crc = crc32(ext->crc, (void *)buffer, size);
+		ext->length += size;
+
+		offset += size;
+		buffer += size;
+		length -= size;
+	}
+}
+
+static void *verify_thread(void *arg) {
+	verify_job *job = (verify_job *)arg;
+	verify_log *vlog = job->vlog;
+	unsigned int buffer_size = vlog->chunk_size + 2 * VERIFY_ALIGN;
+	char *buffer = NULL;
+	int direct = job->direct;
+	int fd = -1;
+
+	buffer = io_buffer_alloc(buffer_size);
+	if (buffer == NULL)
+		log_mesg(0, 1, 1, job->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	if (direct)
+		fd = open(job->target, O_RDONLY | O_LARGEFILE | O_DIRECT);
+	if (fd == -1) {
+		direct = 0;
+		fd = open(job->target, O_RDONLY | O_LARGEFILE);
+	}
+	if (fd == -1)
+		log_mesg(0, 1, 1, job->debug, "verify: open %s error: %s\n", job->target, strerror(errno));
+
+	while (1) {
+		unsigned long long first, last, i;
+
+		pthread_mutex_lock(&job->lock);
+		first = job->next;
+		last = first + VERIFY_BATCH < vlog->count ? first + VERIFY_BATCH : vlog->count;
+		job->next = last;
+		pthread_mutex_unlock(&job->lock);
+
+		if (first >= last)
+			break;
+
+		for (i = first; i < last; i++) {
+			verify_extent *ext = &vlog->extents[i];
+			unsigned long long start = ext->offset;
+			unsigned long long end = ext->offset + ext->length;
+			uint32_t crc;
+			ssize_t got;
+
+			if (direct) {
+				start -= start % VERIFY_ALIGN;
+				end += (VERIFY_ALIGN - end % VERIFY_ALIGN) % VERIFY_ALIGN;
+			}
+
+			io_limit(0, end - start);
+			got = pread(fd, buffer, end - start, start);
+			if (got == -1 && direct && errno == EINVAL) {
+				/// the device wants another alignment, read it through the cache
+				log_mesg(1, 0, 0, job->debug, "verify: O_DIRECT read refused, fall back to buffered reads\n");
+				close(fd);
+				fd = open(job->target, O_RDONLY | O_LARGEFILE);
+				if (fd == -1)
+					log_mesg(0, 1, 1, job->debug, "verify: open %s error: %s\n", job->target, strerror(errno));
+				direct = 0;
+				i--;
+				continue;
+			}
+			if (got < 0 || (unsigned long long)got < ext->offset + ext->length - start) {
+				log_mesg(1, 0, 0, job->debug, "verify: read error at %llu: %s\n", ext->offset,
+					got < 0 ? strerror(errno) : "short read");
+				job->bad[i] = 1;
+				continue;
+			}
+
+			init_crc32(&crc);
+			crc = crc32(crc, buffer + (ext->offset - start), ext->length);
+			if (crc != ext->crc)
+				job->bad[i] = 1;
+		}
+	}
+
+	close(fd);
+	io_buffer_free(buffer);
+	pthread_exit(NULL);
+}
+
+unsigned long long verify_target(verify_log *vlog, const char *target, cmd_opt *opt) {
+	pthread_t threads[VERIFY_MAX_THREADS];
+	verify_job job;
+	unsigned long long i, bad_ranges = 0, bad_bytes = 0, total_bytes = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads, t;
+	int fd;
+
+	log_mesg(0, 0, 1, opt->debug, "Verifying... ");
+
+	if (vlog->count == 0) {
+		log_mesg(0, 0, 1, opt->debug, "OK!\n");
+		return 0;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.vlog = vlog;
+	job.target = target;
+	job.debug = opt->debug;
+	job.direct = 1;
+	job.bad = calloc(vlog->count, 1);
+	if (job.bad == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	pthread_mutex_init(&job.lock, NULL);
+
+	/// without O_DIRECT, at least drop what the writes left in the cache
+	fd = open(target, O_RDONLY | O_LARGEFILE);
+	if (fd != -1) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	nthreads = cpus < 1 ? 1 : cpus > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : cpus;
+	if ((unsigned long long)nthreads > vlog->count / VERIFY_BATCH + 1)
+		nthreads = vlog->count / VERIFY_BATCH + 1;
+	log_mesg(1, 0, 0, opt->debug, "verify: %llu extents, %i threads\n", vlog->count, nthreads);
+
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&threads[t], NULL, verify_thread, &job))
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	/// report the bad extents, merged when they touch
+	for (i = 0; i < vlog->count; i++) {
+		unsigned long long start, end;
+
+		total_bytes += vlog->extents[i].length;
+		if (!job.bad[i])
+			continue;
+
+		start = vlog->extents[i].offset;
+		end = start + vlog->extents[i].length;
+		while (i + 1 < vlog->count && job.bad[i + 1] && vlog->extents[i + 1].offset == end) {
+			i++;
+			total_bytes += vlog->extents[i].length;
+			end += vlog->extents[i].length;
+		}
+
+		if (!bad_ranges)
+			log_mesg(0, 0, 1, opt->debug, "FAILED!\n");
+		log_mesg(0, 0, 1, opt->debug, "verify: data differ at offset %llu, %llu bytes\n", start, end - start);
+		bad_ranges++;
+		bad_bytes += end - start;
+	}
+
+	if (bad_ranges)
+		log_mesg(0, 0, 1, opt->debug, "verify: %llu of %llu bytes differ in %llu ranges\n", bad_bytes, total_bytes, bad_ranges);
+	else
+		log_mesg(0, 0, 1, opt->debug, "OK!\n");
+
+	free(job.bad);
+	return bad_ranges;
+}
+
+void verify_free(verify_log *vlog) {
+	free(vlog->extents);
+	memset(vlog, 0, sizeof(verify_log));
+}
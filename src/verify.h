@@ -0,0 +1,42 @@
+/**
+ * verify.h - Part of Partclone project.
+ *
+ * read back the written data and compare it with what was written
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <stdint.h>
+
+/// one written extent of the target, never crossing a chunk boundary
+typedef struct {
+	unsigned long long offset;  /// byte offset in the target
+	uint32_t length;            /// bytes
+	uint32_t crc;               /// crc32 of the written data
+} verify_extent;
+
+typedef struct {
+	verify_extent *extents;
+	unsigned long long count;
+	unsigned long long capacity;
+	unsigned int chunk_size;    /// extents are cut at multiples of chunk_size
+} verify_log;
+
+struct cmd_opt;
+
+// init, chunk_size is the largest extent read back at once
+void verify_init(verify_log *vlog, unsigned int chunk_size);
+// remember data written at offset of the target
+void verify_update(verify_log *vlog, unsigned long long offset, const char *buffer, unsigned long long length);
+// read the target back and compare, returns the number of bad ranges
+unsigned long long verify_target(verify_log *vlog, const char *target, struct cmd_opt *opt);
+// free the log
+void verify_free(verify_log *vlog);
+
+#endif /* VERIFY_H_ */
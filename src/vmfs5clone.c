@@ -28,9 +28,8 @@ vmfs_fs_t *fs;
 vmfs_dir_t *root_dir;
 unsigned long *blk_bitmap;
 extern progress_bar   prog;        /// progress_bar structure defined in progress.h
-unsigned long long checked;
+static unsigned long long checked;   /// written by read_bitmap's thread only, see progress.h
 void *thread_update_bitmap_pui(void *arg);
-int bitmap_done = 0;
 unsigned long long total_block = 0;
 
 /* Forward declarations */
@@ -186,6 +185,7 @@ void print_pos_by_id (const vmfs_fs_t *fs, uint32_t blk_id)
     }
     if (checked < total_block)
 	checked++;
+    progress_publish(checked, checked);
     current = pos/vmfs_fs_get_blocksize(fs);
     if ( current > total_block )
 	log_mesg(3, 0, 0, fs_opt.debug, "total_block Error Blockid = 0x%8.8x, Type = 0x%2.2x, Pos: %llu, bitmapid: %llu, c: %llu\n", blk_id, blk_type, pos, current, checked);
@@ -360,6 +360,7 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     progress_init(&prog, start, fs_info.usedblocks, fs_info.usedblocks, BITMAP, bit_size);
     pc_init_bitmap(bitmap, 0x00, fs_info.totalblock);
     checked = 0;
+    progress_start();
     /**
      * thread to print progress
      */
@@ -403,7 +404,8 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     vmfs_bitmap_foreach(fbb_bmp,dump_bitmaps_fb,fs);
 
     fs_close();
-    bitmap_done = 1;
+    progress_stop();
+    pthread_join(prog_bitmap_thread, NULL);
     update_pui(&prog, 1, 1, 1);
 
     log_mesg(3, 0, 0, fs_opt.debug, "checked block %llu\n", checked);
@@ -447,10 +449,12 @@ void read_super_blocks(char* device, file_system_info* fs_info)
 
 void *thread_update_bitmap_pui(void *arg){
 
-    while (bitmap_done == 0) {
-	update_pui(&prog, checked, checked, 0);
-	sleep(4);
-    }
+    unsigned long long done_blocks, current;
+
+    do {
+	progress_peek(&done_blocks, &current);
+	update_pui(&prog, done_blocks, current, 0);
+    } while (!progress_wait(4));
     pthread_exit("exit");
 }
 
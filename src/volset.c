@@ -0,0 +1,532 @@
+/**
+ * volset.c - Part of Partclone project.
+ *
+ * an image split in volumes or striped over several files
+ *
+ * The image stream goes through a pipe, so the copy loops and the image
+ * format do not change. The stream is cut in chunks held in a ring of
+ * slots. With --split SIZE the chunks follow each other in the volumes
+ * name.000, name.001... of SIZE bytes. With --stripe DIR1,DIR2,... chunk i
+ * of VOLSET_UNIT bytes is at (i / N) * VOLSET_UNIT in the file of
+ * DIR(i % N), and each file has its own thread, so the disks under the
+ * directories work together.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "partclone.h"
+#include "volset.h"
+
+#define SLOT_FREE (~0ULL)
+
+typedef struct volume_set volume_set;
+
+typedef struct {
+	volume_set *vs;
+	unsigned int index;
+} volset_worker;
+
+struct volume_set {
+	int write;                        /// the files are written
+	int pipe_fd;                      /// the end of the pipe used by the threads
+	const char *name;
+	unsigned long long split_size;    /// 0 when striped
+	unsigned int files;               /// stripe files, or 1 for the volumes
+	char *paths[VOLSET_MAX];
+	int fds[VOLSET_MAX];
+	int overwrite;
+	int debug;
+
+	/// the ring of chunks, slot i % slots holds chunk i
+	unsigned int slots;
+	char **buf;
+	unsigned long long *held;         /// the chunk in each slot, or SLOT_FREE
+	unsigned int *len;
+	unsigned int *file;               /// volume or stripe file of the chunk
+	unsigned long long *offset;       /// in that file
+	unsigned long long chunks;        /// the chunks of the image, ~0 until known
+	unsigned long long given;         /// restore: the chunks given back through the pipe
+	int stop;                         /// the reader of the image went away
+	int failed;                       /// an error went on with --force
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t pipe_thread;
+	pthread_t threads[VOLSET_MAX];
+	volset_worker workers[VOLSET_MAX];
+};
+
+static volume_set *open_set = NULL;
+
+static char *volume_path(const char *name, unsigned int volume) {
+
+	char *path;
+
+	if (asprintf(&path, "%s.%03u", name, volume) < 0)
+		return NULL;
+	return path;
+}
+
+static int open_volume(volume_set *vs, unsigned int volume) {
+
+	char *path = volume_path(vs->name, volume);
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE;
+	int fd;
+
+	if (path == NULL)
+		log_mesg(0, 1, 1, vs->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	if (!vs->overwrite)
+		flags |= O_EXCL;
+	fd = vs->write ? open(path, flags, S_IRUSR | S_IWUSR) : open(path, O_RDONLY | O_LARGEFILE);
+	if (fd == -1 && !(errno == ENOENT && !vs->write)) {
+		if (errno == EEXIST)
+			log_mesg(0, 0, 1, vs->debug, "Output file '%s' already exists.\n"
+				"Use option --overwrite if you want to replace its content.\n", path);
+		log_mesg(0, 1, 1, vs->debug, "volume: open %s error: %s\n", path, strerror(errno));
+	}
+	free(path);
+	return fd;
+}
+
+/// log an error, it only returns with --force, then volset_close fails
+static void volset_error(volume_set *vs, const char *fmt, unsigned int file, const char *error) {
+
+	log_mesg(0, 1, 1, vs->debug, fmt, file, error);
+	pthread_mutex_lock(&vs->lock);
+	vs->failed = 1;
+	pthread_mutex_unlock(&vs->lock);
+}
+
+static void sync_file(volume_set *vs, int fd, unsigned int file) {
+
+	if (fsync(fd) || close(fd))
+		volset_error(vs, "volume: write error on file %u: %s\n", file, strerror(errno));
+}
+
+static ssize_t read_full(int fd, char *buf, size_t size) {
+
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t r = read(fd, buf + done, size - done);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/// wait until chunk i is in its slot, 0 when the image ends before it
+static int wait_chunk(volume_set *vs, unsigned long long i) {
+
+	int ready;
+
+	pthread_mutex_lock(&vs->lock);
+	while (vs->held[i % vs->slots] != i && i < vs->chunks && !vs->stop)
+		pthread_cond_wait(&vs->cond, &vs->lock);
+	ready = vs->held[i % vs->slots] == i && !vs->stop;
+	pthread_mutex_unlock(&vs->lock);
+	return ready;
+}
+
+/**
+ * wait until the slot of chunk i is free, 0 when the image is not wanted anymore.
+ * the chunks are read in parallel on restore, a slot is free for chunk i only
+ * once chunk i - slots went through the pipe, not before it was read.
+ */
+static int wait_slot(volume_set *vs, unsigned long long i) {
+
+	int ready;
+
+	pthread_mutex_lock(&vs->lock);
+	while ((vs->held[i % vs->slots] != SLOT_FREE || (!vs->write && i >= vs->given + vs->slots)) && !vs->stop)
+		pthread_cond_wait(&vs->cond, &vs->lock);
+	ready = !vs->stop && i < vs->chunks;
+	pthread_mutex_unlock(&vs->lock);
+	return ready;
+}
+
+static void set_slot(volume_set *vs, unsigned long long i, unsigned long long held) {
+
+	pthread_mutex_lock(&vs->lock);
+	vs->held[i % vs->slots] = held;
+	pthread_cond_broadcast(&vs->cond);
+	pthread_mutex_unlock(&vs->lock);
+}
+
+static void set_chunks(volume_set *vs, unsigned long long chunks) {
+
+	pthread_mutex_lock(&vs->lock);
+	if (chunks < vs->chunks)
+		vs->chunks = chunks;
+	pthread_cond_broadcast(&vs->cond);
+	pthread_mutex_unlock(&vs->lock);
+}
+
+/// clone: cut the stream of the pipe in chunks and place them
+static void *split_thread(void *arg) {
+
+	volume_set *vs = (volume_set *)arg;
+	unsigned long long i, position = 0;
+
+	for (i = 0; wait_slot(vs, i); i++) {
+		unsigned int slot = i % vs->slots;
+		size_t want = VOLSET_UNIT;
+		ssize_t r;
+
+		if (vs->split_size && vs->split_size - position % vs->split_size < want)
+			want = vs->split_size - position % vs->split_size;
+		r = read_full(vs->pipe_fd, vs->buf[slot], want);
+		if (r < 0)
+			volset_error(vs, "volume: read error on pipe %u: %s\n", 0, strerror(errno));
+		if (r <= 0)
+			break;
+
+		vs->len[slot] = r;
+		if (vs->split_size) {
+			vs->file[slot] = position / vs->split_size;
+			vs->offset[slot] = position % vs->split_size;
+		} else {
+			vs->file[slot] = i % vs->files;
+			vs->offset[slot] = (i / vs->files) * VOLSET_UNIT;
+		}
+		position += r;
+		set_slot(vs, i, i);
+		if ((size_t)r < want) {
+			i++;
+			break;
+		}
+	}
+	set_chunks(vs, i);
+	close(vs->pipe_fd);
+	return NULL;
+}
+
+/// clone: write the chunks of a stripe file, or all the volumes
+static void *write_thread(void *arg) {
+
+	volset_worker *w = (volset_worker *)arg;
+	volume_set *vs = w->vs;
+	const unsigned int step = vs->split_size ? 1 : vs->files;
+	unsigned int volume = 0;
+	unsigned long long i;
+	int fd = vs->fds[w->index];
+
+	for (i = w->index; wait_chunk(vs, i); i += step) {
+		unsigned int slot = i % vs->slots;
+		unsigned int done = 0;
+
+		if (vs->split_size && vs->file[slot] != volume) {
+			sync_file(vs, fd, volume);
+			volume = vs->file[slot];
+			fd = open_volume(vs, volume);
+		}
+		while (done < vs->len[slot]) {
+			ssize_t r = pwrite(fd, vs->buf[slot] + done, vs->len[slot] - done, vs->offset[slot] + done);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				volset_error(vs, "volume: write error on file %u: %s\n",
+					vs->file[slot], r < 0 ? strerror(errno) : "no space");
+				break;
+			}
+			done += r;
+		}
+		set_slot(vs, i, SLOT_FREE);
+	}
+	sync_file(vs, fd, vs->split_size ? volume : w->index);
+
+	/// a longer image written before with --overwrite left more volumes
+	while (vs->split_size) {
+		char *path = volume_path(vs->name, ++volume);
+
+		if (path == NULL || unlink(path)) {
+			free(path);
+			break;
+		}
+		log_mesg(1, 0, 0, vs->debug, "volume: removed the old %s\n", path);
+		free(path);
+	}
+	return NULL;
+}
+
+/// restore: read the chunks of a stripe file, or all the volumes
+static void *read_thread(void *arg) {
+
+	volset_worker *w = (volset_worker *)arg;
+	volume_set *vs = w->vs;
+	const unsigned int step = vs->split_size ? 1 : vs->files;
+	unsigned int volume = 0;
+	unsigned long long i, position = 0;
+	int fd = vs->fds[w->index];
+
+	for (i = w->index; wait_slot(vs, i); i += step) {
+		unsigned int slot = i % vs->slots;
+		ssize_t r;
+
+		if (vs->split_size) {
+			r = read_full(fd, vs->buf[slot], VOLSET_UNIT);
+			while (r == 0) {
+				int next = open_volume(vs, volume + 1);
+
+				if (next == -1)
+					break;
+				/// only the last volume may be short
+				if (position != vs->split_size)
+					volset_error(vs, "volume: volume %03u is %s than --split\n",
+						volume, position < vs->split_size ? "shorter" : "longer");
+				close(fd);
+				fd = next;
+				volume++;
+				position = 0;
+				r = read_full(fd, vs->buf[slot], VOLSET_UNIT);
+			}
+		} else {
+			r = pread(fd, vs->buf[slot], VOLSET_UNIT, (i / vs->files) * VOLSET_UNIT);
+			/// a regular file gives it all, unless it ends
+			while (r > 0 && r < VOLSET_UNIT) {
+				ssize_t more = pread(fd, vs->buf[slot] + r, VOLSET_UNIT - r, (i / vs->files) * VOLSET_UNIT + r);
+
+				if (more <= 0)
+					break;
+				r += more;
+			}
+		}
+		if (r < 0) {
+			volset_error(vs, "volume: read error on file %u: %s\n",
+				vs->split_size ? volume : w->index, strerror(errno));
+			r = 0;
+		}
+
+		position += r;
+		vs->len[slot] = r;
+		if (r > 0)
+			set_slot(vs, i, i);
+		/// a stripe file ends with a short unit, or in the middle of a volume
+		if (r == 0)
+			set_chunks(vs, i);
+		else if (!vs->split_size && r < VOLSET_UNIT)
+			set_chunks(vs, i + 1);
+		if (r == 0 || (!vs->split_size && r < VOLSET_UNIT))
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+/// restore: give the chunks back in order through the pipe
+static void *join_thread(void *arg) {
+
+	volume_set *vs = (volume_set *)arg;
+	unsigned long long i;
+	sigset_t set;
+
+	/// the reader may stop before the end, with --range, get EPIPE instead of the signal
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; wait_chunk(vs, i); i++) {
+		unsigned int slot = i % vs->slots;
+		unsigned int done = 0;
+
+		while (done < vs->len[slot]) {
+			ssize_t r = write(vs->pipe_fd, vs->buf[slot] + done, vs->len[slot] - done);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0 && errno != EPIPE)
+				volset_error(vs, "volume: write error on pipe %u: %s\n", 0, strerror(errno));
+			if (r <= 0) {
+				pthread_mutex_lock(&vs->lock);
+				vs->stop = 1;
+				pthread_cond_broadcast(&vs->cond);
+				pthread_mutex_unlock(&vs->lock);
+				break;
+			}
+			done += r;
+		}
+		pthread_mutex_lock(&vs->lock);
+		vs->held[slot] = SLOT_FREE;
+		vs->given = i + 1;
+		pthread_cond_broadcast(&vs->cond);
+		pthread_mutex_unlock(&vs->lock);
+	}
+	close(vs->pipe_fd);
+	return NULL;
+}
+
+static volume_set *volset_new(const char *name, cmd_opt *opt, int write) {
+
+	volume_set *vs = calloc(1, sizeof(volume_set));
+	unsigned int i;
+
+	if (vs == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	vs->write = write;
+	vs->name = name;
+	vs->split_size = opt->split_size;
+	vs->overwrite = opt->overwrite;
+	vs->debug = opt->debug;
+	vs->chunks = ~0ULL;
+	vs->files = 1;
+
+	if (opt->stripe) {
+		char *dirs = strdup(opt->stripe), *dir, *save = NULL;
+
+		vs->files = 0;
+		for (dir = strtok_r(dirs, ",", &save); dir; dir = strtok_r(NULL, ",", &save)) {
+			if (vs->files == VOLSET_MAX)
+				log_mesg(0, 1, 1, opt->debug, "volume: at most %i stripe directories\n", VOLSET_MAX);
+			if (asprintf(&vs->paths[vs->files++], "%s/%s", dir, name) < 0)
+				log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+		free(dirs);
+		if (vs->files == 0)
+			log_mesg(0, 1, 1, opt->debug, "volume: no stripe directory given\n");
+	}
+
+	/// two units ahead for each file
+	vs->slots = vs->files * 2 + 2;
+	vs->buf = calloc(vs->slots, sizeof(char *));
+	vs->held = malloc(vs->slots * sizeof(unsigned long long));
+	vs->len = calloc(vs->slots, sizeof(unsigned int));
+	vs->file = calloc(vs->slots, sizeof(unsigned int));
+	vs->offset = calloc(vs->slots, sizeof(unsigned long long));
+	if (!vs->buf || !vs->held || !vs->len || !vs->file || !vs->offset)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	for (i = 0; i < vs->slots; i++) {
+		vs->buf[i] = malloc(VOLSET_UNIT);
+		vs->held[i] = SLOT_FREE;
+		if (vs->buf[i] == NULL)
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+
+	/// the files are opened before the image is, to fail early
+	for (i = 0; i < vs->files; i++) {
+		if (vs->split_size) {
+			vs->fds[i] = open_volume(vs, 0);
+			if (vs->fds[i] == -1)
+				log_mesg(0, 1, 1, opt->debug, "volume: open %s.000 error: %s\n", name, strerror(errno));
+		} else if (write) {
+			int flags = O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE;
+
+			if (!vs->overwrite)
+				flags |= O_EXCL;
+			vs->fds[i] = open(vs->paths[i], flags, S_IRUSR | S_IWUSR);
+			if (vs->fds[i] == -1 && errno == EEXIST)
+				log_mesg(0, 0, 1, opt->debug, "Output file '%s' already exists.\n"
+					"Use option --overwrite if you want to replace its content.\n", vs->paths[i]);
+		} else {
+			vs->fds[i] = open(vs->paths[i], O_RDONLY | O_LARGEFILE);
+		}
+		if (vs->fds[i] == -1)
+			log_mesg(0, 1, 1, opt->debug, "volume: open %s error: %s\n", vs->paths[i], strerror(errno));
+	}
+
+	pthread_mutex_init(&vs->lock, NULL);
+	pthread_cond_init(&vs->cond, NULL);
+	return vs;
+}
+
+static void start_threads(volume_set *vs, void *(*pipe_fn)(void *), void *(*file_fn)(void *)) {
+
+	unsigned int i;
+
+	if (pthread_create(&vs->pipe_thread, NULL, pipe_fn, vs))
+		log_mesg(0, 1, 1, vs->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	for (i = 0; i < vs->files; i++) {
+		vs->workers[i].vs = vs;
+		vs->workers[i].index = i;
+		if (pthread_create(&vs->threads[i], NULL, file_fn, &vs->workers[i]))
+			log_mesg(0, 1, 1, vs->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+}
+
+int volset_open_write(const char *name, cmd_opt *opt) {
+
+	volume_set *vs = volset_new(name, opt, 1);
+	int p[2];
+
+	if (pipe(p))
+		log_mesg(0, 1, 1, opt->debug, "volume: pipe error: %s\n", strerror(errno));
+	fcntl(p[1], F_SETPIPE_SZ, 1024 * 1024);
+	vs->pipe_fd = p[0];
+	start_threads(vs, split_thread, write_thread);
+	log_mesg(1, 0, 0, opt->debug, "volume: writing %s to %u file(s), split %llu\n",
+		name, vs->files, vs->split_size);
+	open_set = vs;
+	return p[1];
+}
+
+int volset_open_read(const char *name, cmd_opt *opt) {
+
+	volume_set *vs = volset_new(name, opt, 0);
+	int p[2];
+
+	if (pipe(p))
+		log_mesg(0, 1, 1, opt->debug, "volume: pipe error: %s\n", strerror(errno));
+	fcntl(p[1], F_SETPIPE_SZ, 1024 * 1024);
+	vs->pipe_fd = p[1];
+	start_threads(vs, join_thread, read_thread);
+	log_mesg(1, 0, 0, opt->debug, "volume: reading %s from %u file(s), split %llu\n",
+		name, vs->files, vs->split_size);
+	open_set = vs;
+	return p[0];
+}
+
+int volset_close(int fd) {
+
+	volume_set *vs = open_set;
+	unsigned int i;
+	int ret;
+
+	if (close(fd))
+		return -1;
+	if (vs == NULL)
+		return 0;
+
+	/// errors exit from the threads, a join means the data is on the disks
+	pthread_join(vs->pipe_thread, NULL);
+	for (i = 0; i < vs->files; i++)
+		pthread_join(vs->threads[i], NULL);
+
+	ret = vs->failed ? -1 : 0;
+	for (i = 0; i < vs->slots; i++)
+		free(vs->buf[i]);
+	for (i = 0; i < vs->files; i++)
+		free(vs->paths[i]);
+	free(vs->buf);
+	free(vs->held);
+	free(vs->len);
+	free(vs->file);
+	free(vs->offset);
+	pthread_cond_destroy(&vs->cond);
+	pthread_mutex_destroy(&vs->lock);
+	free(vs);
+	open_set = NULL;
+	return ret;
+}
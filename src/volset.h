@@ -0,0 +1,39 @@
+/**
+ * volset.h - Part of Partclone project.
+ *
+ * an image split in volumes or striped over several files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef VOLSET_H_
+#define VOLSET_H_
+
+#define VOLSET_UNIT     (4 * 1024 * 1024)   /// bytes of the image in each stripe unit
+#define VOLSET_MAX      64                  /// files of a --stripe
+#define VOLSET_MIN_SPLIT (1024 * 1024)      /// smallest --split volume
+
+/// true when the image is given by --split or --stripe
+#define volset_wanted(opt) ((opt)->split_size || (opt)->stripe)
+
+/**
+ * create the files of the image name, --split volumes name.000, name.001...
+ * or the file name in each --stripe directory, and return the write end of
+ * a pipe whose data is written to them by their own threads. exits on error.
+ */
+int volset_open_write(const char *name, cmd_opt *opt);
+
+/**
+ * open the files of the image name written by volset_open_write and return
+ * the read end of a pipe giving back the image, the files being read ahead
+ * by their own threads. exits on error.
+ */
+int volset_open_read(const char *name, cmd_opt *opt);
+
+/// close the write end, wait for the data to be written and synced. 0, or -1 on error
+int volset_close(int fd);
+
+#endif /* VOLSET_H_ */
@@ -0,0 +1,63 @@
+/**
+ * writeback.c - Part of Partclone project.
+ *
+ * keep the dirty data behind the writer bounded
+ *
+ * The writeback of each write is started at once with sync_file_range(),
+ * and the writer waits for the data more than a window behind it to be on
+ * the device, then drops it from the page cache. The dirty data never
+ * grows past the window, so the progress follows the device and the final
+ * fsync has little left to do.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "partclone.h"
+#include "writeback.h"
+
+void writeback_init(writeback_ctl *wb, int fd, unsigned long long window, int debug) {
+	memset(wb, 0, sizeof(writeback_ctl));
+	wb->fd = fd;
+	wb->window = window;
+	wb->debug = debug;
+}
+
+void writeback_update(writeback_ctl *wb, unsigned long long offset, unsigned long long length) {
+	unsigned long long end = offset + length;
+
+	if (wb->window == 0 || length == 0)
+		return;
+
+	/// the writer went back, wait from there on
+	if (offset < wb->waited)
+		wb->waited = offset;
+
+	if (sync_file_range(wb->fd, offset, length, SYNC_FILE_RANGE_WRITE) == -1) {
+		log_mesg(0, 0, 1, wb->debug, "writeback: sync_file_range error: %s, writeback window disabled\n", strerror(errno));
+		wb->window = 0;
+		return;
+	}
+
+	if (end - wb->waited > wb->window) {
+		unsigned long long wait_end = end - wb->window;
+
+		if (sync_file_range(wb->fd, wb->waited, wait_end - wb->waited,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+			log_mesg(0, 1, 1, wb->debug, "writeback: write error before offset %llu: %s\n", wait_end, strerror(errno));
+		/// written data is not read again, leave the cache to others
+		posix_fadvise(wb->fd, wb->waited, wait_end - wb->waited, POSIX_FADV_DONTNEED);
+		wb->waited = wait_end;
+		log_mesg(1, 0, 0, wb->debug, "writeback: %llu bytes on the device\n", wait_end);
+	}
+}
@@ -0,0 +1,27 @@
+/**
+ * writeback.h - Part of Partclone project.
+ *
+ * keep the dirty data behind the writer bounded
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef WRITEBACK_H_
+#define WRITEBACK_H_
+
+typedef struct {
+	int fd;
+	unsigned long long window;  /// bytes left dirty behind the writer, 0 when off
+	unsigned long long waited;  /// the data before this offset is on the device
+	int debug;
+} writeback_ctl;
+
+// init, a window of 0 leaves the writeback to the kernel
+void writeback_init(writeback_ctl *wb, int fd, unsigned long long window, int debug);
+// data was written at offset of fd, start its writeback and wait for the old data
+void writeback_update(writeback_ctl *wb, unsigned long long offset, unsigned long long length);
+
+#endif /* WRITEBACK_H_ */
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <openssl/sha.h>
 #include "xfs/libxfs.h"
 #include "partclone.h"
 #include "xfsclone.h"
@@ -25,9 +26,8 @@
 int	source_fd = -1;
 int     first_residue;
 extern progress_bar prog;
-unsigned long long checked;
+static unsigned long long checked;   /// written by read_bitmap's thread only, see progress.h
 unsigned long long total_block;
-int bitmap_done = 0;
 unsigned long* xfs_bitmap;
 
 xfs_mount_t     *mp;
@@ -84,6 +84,7 @@ static void set_bitmap(unsigned long* bitmap, uint64_t start, int count)
 	log_mesg(3, 0, 0, fs_opt.debug, "%s: block %i is free\n", __FILE__, block);
 	checked++;
     }
+    progress_publish(checked, checked);
 
 }
 // copy from xfs_db freesp ....
@@ -256,6 +257,10 @@ static void fs_open(char* device)
     xfs_sb_t        *sb;
     int             tmp_residue;
 
+    /// already mounted by this session
+    if (mp)
+	return;
+
     /* open up source -- is it a file? */
     open_flags = O_RDONLY;
 
@@ -340,9 +345,74 @@ static void fs_open(char* device)
 static void fs_close()
 {
     libxfs_device_close(xargs.ddev);
+    close(source_fd);
+    source_fd = -1;
+    mp = NULL;
     log_mesg(0, 0, 0, fs_opt.debug, "%s: fs_close\n", __FILE__);
 }
 
+/// end the session opened by read_super_blocks or read_bitmap
+void fs_session_close(void)
+{
+    if (mp)
+	fs_close();
+}
+
+/// cycle of a block of the internal log, stamped at its start or in the record header
+static int log_cycle(xfs_daddr_t log_start, xfs_daddr_t blk, uint32_t *cycle)
+{
+    __be32 word[2];
+
+    if (pread(source_fd, word, sizeof(word), BBTOB(log_start + blk)) != sizeof(word))
+	return -1;
+    *cycle = be32_to_cpu(word[0]) == XLOG_HEADER_MAGIC_NUM ? be32_to_cpu(word[1]) : be32_to_cpu(word[0]);
+    return 0;
+}
+
+/**
+ * the UUID and the head of the log, the LSN of the next record: every change
+ * and every mount is logged first, so it moves with them. The blocks before
+ * the head carry the cycle of the first block, the ones after it the cycle
+ * before, like xlog_find_head() of the kernel without its search for the
+ * torn writes of an unclean shutdown: the identity only has to change.
+ */
+int get_fs_identity(char* device, file_system_info* fs_info, unsigned char* identity)
+{
+    struct {
+	unsigned char uuid[16];
+	uint32_t cycle;
+	uint64_t head;
+    } __attribute__((packed)) id;
+    xfs_daddr_t start, lo, hi, mid;
+    uint32_t first, last, cycle;
+
+    fs_open(device);
+    start = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart);
+    hi = XFS_FSB_TO_BB(mp, (xfs_daddr_t)mp->m_sb.sb_logblocks) - 1;
+    if (log_cycle(start, 0, &first) || log_cycle(start, hi, &last)) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: can't read the log: %s\n", __FILE__, strerror(errno));
+	return 0;
+    }
+
+    /// a log of one cycle ends at its last block
+    for (lo = 0; first != last && hi - lo > 1; ) {
+	mid = lo + (hi - lo) / 2;
+	if (log_cycle(start, mid, &cycle))
+	    return 0;
+	if (cycle == first)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    memset(&id, 0, sizeof(id));
+    memcpy(id.uuid, &mp->m_sb.sb_uuid, sizeof(id.uuid));
+    id.cycle = first;
+    id.head = first == last ? 0 : hi;
+    SHA256((unsigned char*)&id, sizeof(id), identity);
+    return 1;
+}
+
 void read_super_blocks(char* device, file_system_info* fs_info)
 {
     fs_open(device);
@@ -358,7 +428,6 @@ void read_super_blocks(char* device, file_system_info* fs_info)
     log_mesg(1, 0, 0, fs_opt.debug, "%s: used block= %lli\n", __FILE__, (mp->m_sb.sb_dblocks - mp->m_sb.sb_fdblocks));
     log_mesg(1, 0, 0, fs_opt.debug, "%s: superBlockUsedBlocks= %lli\n", __FILE__, fs_info->superBlockUsedBlocks);
     log_mesg(1, 0, 0, fs_opt.debug, "%s: device size= %lli\n", __FILE__, (mp->m_sb.sb_blocksize*mp->m_sb.sb_dblocks));
-    fs_close();
 
 }
 
@@ -386,6 +455,7 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     /// init progress
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
     checked = 0;
+    progress_start();
     /**
      * thread to print progress
      */
@@ -411,17 +481,19 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     }
     log_mesg(0, 0, 0, fs_opt.debug, "%s: bused = %lli, bfree = %lli\n", __FILE__, bused, bfree);
 
-    fs_close();
-    bitmap_done = 1;
+    progress_stop();
+    pthread_join(prog_bitmap_thread, NULL);
     update_pui(&prog, 1, 1, 1);
 
 }
 void *thread_update_bitmap_pui(void *arg){
 
-    while (bitmap_done == 0) {
-	update_pui(&prog, checked, checked, 0);
-	sleep(2);
-    }
+    unsigned long long done_blocks, current;
+
+    do {
+	progress_peek(&done_blocks, &current);
+	update_pui(&prog, done_blocks, current, 0);
+    } while (!progress_wait(2));
     pthread_exit("exit");
 }
 